@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock *next;    // The block allocated before this one.
+    size_t size;         // The bytes in data.
+    size_t used;         // The bytes of data handed out so far.
+    unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_BYTES ? size : ARENA_BLOCK_BYTES;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+    char *copy = arena_alloc(arena, n + 1);
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL) {
+        return;
+    }
+    while (block->next != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    block->used = 0;
+    arena->blocks = block;
+}
+
+
+void arena_release(Arena *arena) {
+    arena_reset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * A bump allocator.
+ *
+ * Memory is handed out from blocks of ARENA_BLOCK_BYTES (or one big enough
+ * for a larger allocation) and is never freed on its own: everything
+ * allocated from an arena is released at once by arena_reset or
+ * arena_release. So whatever owns an arena owns everything allocated from
+ * it, and a parse that gives up halfway leaks nothing.
+ *
+ * An arena of all zeros is empty and ready to use.
+ */
+#define ARENA_BLOCK_BYTES 4096
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;  // The block being allocated from, then the older ones.
+} Arena;
+
+/*
+ * Return size bytes, aligned for any type, that stay valid until the
+ * arena is reset. (Exits if memory runs out.)
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/*
+ * Return a null-terminated copy of the first n bytes of s.
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t n);
+
+/*
+ * Free everything allocated from the arena, keeping its first block to
+ * allocate from again.
+ */
+void arena_reset(Arena *arena);
+
+/*
+ * Free everything allocated from the arena, and the arena's blocks.
+ */
+void arena_release(Arena *arena);
+
+#endif /* ARENA_H_*/
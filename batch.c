@@ -0,0 +1,359 @@
+#define _GNU_SOURCE  // For memfd_create.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "batch.h"
+
+
+/*
+ * A batch being run. Images go through it in order: the reader thread reads
+ * image i into inputs[i], the main thread filters it into outputs[i], and
+ * the writer thread writes that out. Each of them has done the first
+ * num_read, num_filtered and num_written images respectively. Everything
+ * but items is protected by lock.
+ */
+typedef struct {
+    const BatchItem *items;
+    int num_items;
+    int max_in_flight;
+    int *inputs;                 // In-memory files, or -1 for images that
+    int *outputs;                // couldn't be read or filtered.
+    int num_read;
+    int num_filtered;
+    int num_written;
+    int failures;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // Signalled whenever a count goes up.
+} Batch;
+
+
+/*
+ * Copy size bytes from the start of in to out. Return 0 on success and -1
+ * on failure (with errno set).
+ */
+static int copy_file(int out, int in, off_t size) {
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t sent = sendfile(out, in, &offset, size - offset);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            if (sent == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Read the image at path into an in-memory file, and return it; or return
+ * -1 if it can't be read or isn't a BMP file the filters accept.
+ */
+static int load_image(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    unsigned char header[BMP_INFO_BYTES];
+    BmpInfo info;
+    struct stat st;
+    ssize_t len;
+    if (fstat(fd, &st) == -1 || (len = pread(fd, header, sizeof(header), 0)) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    // Checked here, to skip the image before it is copied.
+    if (parse_bmp_info(header, len, &info) == -1 ||
+        st.st_size < info.header_size + (off_t) info.row_bytes * info.height) {
+        fprintf(stderr, "%s: not a BMP image that can be filtered\n", path);
+        close(fd);
+        return -1;
+    }
+    int image = memfd_create("input.bmp", 0);
+    if (image == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    if (copy_file(image, fd, st.st_size) == -1 || lseek(image, 0, SEEK_SET) == -1) {
+        perror(path);
+        close(image);
+        image = -1;
+    }
+    close(fd);
+    return image;
+}
+
+
+/*
+ * Run the stages on the image in the in-memory file input, into another
+ * one, and return that; or return -1 if a filter rejects the image. The
+ * filters run in a child process, since they exit on an image they can't
+ * filter (e.g. one too small for a 3-by-3 filter).
+ */
+static int filter_image(const FilterStage *stages, int n, int input, const char *path) {
+    int output = memfd_create("output.bmp", 0);
+    if (output == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    if (run_pipeline_in_child(stages, n, input, output) == -1) {
+        fprintf(stderr, "%s: could not be filtered\n", path);
+        close(output);
+        return -1;
+    }
+    return output;
+}
+
+
+/*
+ * Write the in-memory file image to path. Return 0 on success and -1 on
+ * failure.
+ */
+static int save_image(int image, const char *path) {
+    struct stat st;
+    if (fstat(image, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || copy_file(fd, image, st.st_size) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (close(fd) == -1) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void *read_images(void *arg) {
+    Batch *batch = arg;
+    for (int i = 0; i < batch->num_items; i++) {
+        pthread_mutex_lock(&batch->lock);
+        while (i - batch->num_written >= batch->max_in_flight) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        int image = load_image(batch->items[i].input);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->inputs[i] = image;
+        batch->num_read = i + 1;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+
+static void *write_images(void *arg) {
+    Batch *batch = arg;
+    for (int i = 0; i < batch->num_items; i++) {
+        pthread_mutex_lock(&batch->lock);
+        while (batch->num_filtered <= i) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+        int image = batch->outputs[i];
+        pthread_mutex_unlock(&batch->lock);
+
+        int failed = image == -1 || save_image(image, batch->items[i].output) == -1;
+        if (image != -1) {
+            close(image);
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        batch->failures += failed;
+        batch->num_written = i + 1;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+
+int run_batch(const FilterStage *stages, int n, const BatchItem *items, int num_items,
+              int max_in_flight) {
+    Batch batch = {
+        .items = items,
+        .num_items = num_items,
+        .max_in_flight = max_in_flight < 1 ? 1 : max_in_flight,
+        .inputs = malloc(sizeof(int) * num_items),
+        .outputs = malloc(sizeof(int) * num_items),
+    };
+    if (num_items > 0 && (batch.inputs == NULL || batch.outputs == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, read_images, &batch) != 0 ||
+        pthread_create(&writer, NULL, write_images, &batch) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    // The filtering happens in children of this thread (see filter_image).
+    for (int i = 0; i < num_items; i++) {
+        pthread_mutex_lock(&batch.lock);
+        while (batch.num_read <= i) {
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        }
+        int input = batch.inputs[i];
+        pthread_mutex_unlock(&batch.lock);
+
+        int output = -1;
+        if (input != -1) {
+            output = filter_image(stages, n, input, batch.items[i].input);
+            close(input);
+        }
+
+        pthread_mutex_lock(&batch.lock);
+        batch.outputs[i] = output;
+        batch.num_filtered = i + 1;
+        pthread_cond_broadcast(&batch.changed);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.changed);
+    free(batch.inputs);
+    free(batch.outputs);
+    return batch.failures;
+}
+
+
+/*
+ * Append an item to *items (which has room for *capacity), taking
+ * ownership of input and output.
+ */
+static void add_item(BatchItem **items, int *num_items, int *capacity, char *input, char *output) {
+    if (*num_items == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 16;
+        *items = realloc(*items, sizeof(BatchItem) * *capacity);
+        if (*items == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    (*items)[*num_items].input = input;
+    (*items)[*num_items].output = output;
+    (*num_items)++;
+}
+
+
+static char *join_path(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const BatchItem *) a)->input, ((const BatchItem *) b)->input);
+}
+
+
+int collect_batch(const char *input, const char *output_dir, BatchItem **items) {
+    struct stat st;
+    if (stat(input, &st) == -1) {
+        perror(input);
+        return -1;
+    }
+    *items = NULL;
+    int num_items = 0;
+    int capacity = 0;
+    int default_outputs = 0;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(input);
+        if (dir == NULL) {
+            perror(input);
+            return -1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (len < 4 || strcasecmp(entry->d_name + len - 4, ".bmp") != 0) {
+                continue;
+            }
+            char *path = join_path(input, entry->d_name);
+            if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+                free(path);
+                continue;
+            }
+            add_item(items, &num_items, &capacity, path, join_path(output_dir, entry->d_name));
+        }
+        closedir(dir);
+        qsort(*items, num_items, sizeof(BatchItem), compare_items);
+        default_outputs = num_items;
+    } else {
+        FILE *manifest = fopen(input, "r");
+        if (manifest == NULL) {
+            perror(input);
+            return -1;
+        }
+        char *line = NULL;
+        size_t size = 0;
+        while (getline(&line, &size, manifest) != -1) {
+            char *image = strtok(line, " \t\r\n");
+            if (image == NULL || image[0] == '#') {
+                continue;
+            }
+            char *output = strtok(NULL, " \t\r\n");
+            if (output == NULL) {
+                char *name = strrchr(image, '/');
+                add_item(items, &num_items, &capacity, strdup(image),
+                         join_path(output_dir, name != NULL ? name + 1 : image));
+                default_outputs++;
+            } else {
+                add_item(items, &num_items, &capacity, strdup(image), strdup(output));
+            }
+        }
+        free(line);
+        fclose(manifest);
+    }
+
+    if (default_outputs > 0 && mkdir(output_dir, 0777) == -1 && errno != EEXIST) {
+        perror(output_dir);
+        free_batch(*items, num_items);
+        return -1;
+    }
+    return num_items;
+}
+
+
+void free_batch(BatchItem *items, int num_items) {
+    for (int i = 0; i < num_items; i++) {
+        free(items[i].input);
+        free(items[i].output);
+    }
+    free(items);
+}
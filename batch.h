@@ -0,0 +1,39 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "pipeline.h"
+
+/*
+ * Running one chain of filters over many images in a single process.
+ *
+ * A batch is a list of input and output paths. collect_batch makes it from
+ * input, which is either a directory, standing for every .bmp file in it
+ * (in name order), or a manifest: a file with one image per line, as its
+ * input path, optionally followed by whitespace and an output path. Blank
+ * lines and lines starting with '#' are ignored. An image without an
+ * output path goes to the file of the same name in output_dir, which is
+ * created if need be. collect_batch returns the number of images and sets
+ * *items to them, or returns -1 (with a message on stderr) if input can't
+ * be read.
+ *
+ * run_batch runs the n stages on every image (see run_pipeline), with the
+ * reading and the writing in threads of their own: while one image is
+ * being filtered, the next ones are read into memory and the previous ones
+ * written out. At most max_in_flight images are in memory at once, counted
+ * from when they start being read until their output is written. Since an
+ * image is read in full before its output is opened, an output may be its
+ * own input. An image that can't be read, isn't a BMP file the filters
+ * accept, is rejected by one of them, or whose output can't be written is
+ * skipped with a message on stderr; run_batch returns the number of them.
+ */
+typedef struct {
+    char *input;
+    char *output;
+} BatchItem;
+
+int collect_batch(const char *input, const char *output_dir, BatchItem **items);
+int run_batch(const FilterStage *stages, int n, const BatchItem *items, int num_items,
+              int max_in_flight);
+void free_batch(BatchItem *items, int num_items);
+
+#endif /* BATCH_H_*/
@@ -0,0 +1,407 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bitmap.h"
+#include "pipeline.h"
+
+/*
+ * A benchmark of the filters, on synthetic images.
+ *
+ * For every image size and aspect ratio asked for, a BMP of (about) that
+ * many pixels is generated, and then timed:
+ *   - every filter program in filters/, on its own;
+ *   - every chain, through image_filter, both with one process per filter
+ *     and in-process; the in-process runs also report how long each step of
+ *     the chain took.
+ *
+ * Each measurement is the fastest of a number of runs. The results are
+ * printed as tab-separated lines, after a header line naming the columns:
+ *   kind         filter, chain, chain-in-process, or stage
+ *   name         the filter, or the chain (its stages joined with '|')
+ *   stage        for a stage line, the step of the chain; otherwise "-"
+ *   width, height, megapixels   of the input image
+ *   seconds      wall-clock time
+ *   mpix_per_s   input megapixels per second
+ *   peak_rss_kb  the most memory any process of the run used (not
+ *                measured per stage, so "-" for stage lines)
+ */
+
+#define MAX_ITEMS 32
+#define FILTER_DIR "filters/"
+#define MAX_REPORT 4096
+
+#define DEFAULT_SIZES "256,1024,4096"
+#define DEFAULT_ASPECTS "1:1"
+#define DEFAULT_CHAINS "greyscale|gaussian_blur|edge_detection", "scale 2|gaussian_blur"
+#define DEFAULT_RUNS 3
+
+// The result of running a command once.
+typedef struct {
+    double seconds;
+    long peak_rss_kb;
+    char report[MAX_REPORT];  // What the command wrote to stderr.
+} Run;
+
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Split a list on the given separator into at most MAX_ITEMS strings
+ * (pointing into list, which is modified). Return the number of items.
+ */
+static int split(char *list, const char *separator, char **items) {
+    int n = 0;
+    for (char *item = strtok(list, separator); item != NULL && n < MAX_ITEMS;
+         item = strtok(NULL, separator)) {
+        items[n++] = item;
+    }
+    return n;
+}
+
+
+/******************************************************************************
+ * Synthetic images.
+ *****************************************************************************/
+
+/*
+ * Write a width by height 24-bit BMP to path: smooth gradients with some
+ * noise on top, so that the filters have edges and detail to work on.
+ */
+static void generate_image(const char *path, int width, int height) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    int row_bytes = BMP_ROW_BYTES(width);
+    unsigned char header[54] = {'B', 'M'};
+    int file_size = sizeof(header) + row_bytes * height;
+    int header_size = sizeof(header), info_size = 40, image_size = row_bytes * height;
+    short planes = 1, bits_per_pixel = 24;
+    memcpy(header + BMP_FILE_SIZE_OFFSET, &file_size, sizeof(int));
+    memcpy(header + BMP_HEADER_SIZE_OFFSET, &header_size, sizeof(int));
+    memcpy(header + 14, &info_size, sizeof(int));  // BITMAPINFOHEADER
+    memcpy(header + BMP_WIDTH_OFFSET, &width, sizeof(int));
+    memcpy(header + BMP_HEIGHT_OFFSET, &height, sizeof(int));
+    memcpy(header + 26, &planes, sizeof(short));
+    memcpy(header + BMP_BITS_PER_PIXEL_OFFSET, &bits_per_pixel, sizeof(short));
+    memcpy(header + 34, &image_size, sizeof(int));
+    fwrite(header, 1, sizeof(header), fp);
+
+    unsigned char *row = calloc(row_bytes, 1);
+    unsigned int noise = 12345;
+    for (int r = 0; r < height; r++) {
+        for (int c = 0; c < width; c++) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            row[3 * c] = (c * 255 / width + (noise & 31)) & 0xff;
+            row[3 * c + 1] = (r * 255 / height + (noise >> 8 & 31)) & 0xff;
+            row[3 * c + 2] = ((c ^ r) & 0xff) / 2 + (noise >> 16 & 63);
+        }
+        if (fwrite(row, 1, row_bytes, fp) != row_bytes) {
+            perror("fwrite");
+            exit(1);
+        }
+    }
+    free(row);
+    if (fclose(fp) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+}
+
+
+/******************************************************************************
+ * Running things.
+ *****************************************************************************/
+
+/*
+ * Run the program argv (in the directory dir, if not NULL), with stdin and
+ * stdout redirected from and to the given files if they aren't NULL, and
+ * stdout discarded otherwise. Fill in run, and return 0 if the program
+ * succeeded and -1 if not.
+ */
+static int run_program(char *const argv[], const char *dir,
+                       const char *in_path, const char *out_path, Run *run) {
+    int report[2];
+    if (pipe(report) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    // Start from an empty output, as a filter writing to a new file would.
+    if (out_path != NULL) {
+        unlink(out_path);
+    }
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        int in = open(in_path ? in_path : "/dev/null", O_RDONLY);
+        // The output is opened for reading too, so that it can be mapped.
+        int out = out_path ? open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                           : open("/dev/null", O_WRONLY);
+        if (in == -1 || out == -1 || (dir != NULL && chdir(dir) == -1)) {
+            perror(argv[0]);
+            exit(1);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(report[1], STDERR_FILENO);
+        close(in);
+        close(out);
+        close(report[0]);
+        close(report[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        exit(1);
+    }
+    close(report[1]);
+
+    int len = 0;
+    ssize_t n;
+    while ((n = read(report[0], run->report + len, sizeof(run->report) - 1 - len)) > 0) {
+        len += n;
+    }
+    run->report[len] = '\0';
+    close(report[0]);
+
+    // The usage of a child that has been waited for includes that of its own
+    // children (the filters image_filter starts, for instance).
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        exit(1);
+    }
+    run->seconds = now_seconds() - start;
+    run->peak_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed:\n%s", argv[0], run->report);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run the program num_runs times, keeping the fastest run in best (which
+ * holds the most memory any run used). Return 0 on success and -1 if the
+ * program failed.
+ */
+static int time_program(char *const argv[], const char *dir, const char *in_path,
+                        const char *out_path, int num_runs, Run *best) {
+    Run run;
+    long peak_rss_kb = 0;
+    for (int i = 0; i < num_runs; i++) {
+        if (run_program(argv, dir, in_path, out_path, &run) == -1) {
+            return -1;
+        }
+        if (i == 0 || run.seconds < best->seconds) {
+            *best = run;
+        }
+        peak_rss_kb = max(peak_rss_kb, run.peak_rss_kb);
+    }
+    best->peak_rss_kb = peak_rss_kb;
+    return 0;
+}
+
+
+static void print_result(const char *kind, const char *name, const char *stage,
+                         int width, int height, double seconds, long peak_rss_kb) {
+    double megapixels = (double) width * height / 1e6;
+    printf("%s\t%s\t%s\t%d\t%d\t%.3f\t%.6f\t%.2f\t", kind, name, stage, width, height,
+           megapixels, seconds, megapixels / seconds);
+    if (peak_rss_kb >= 0) {
+        printf("%ld\n", peak_rss_kb);
+    } else {
+        printf("-\n");
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Time every filter program in filters/ on the image in in_path.
+ */
+static void bench_filters(const char *in_path, const char *out_path,
+                          int width, int height, int num_runs) {
+    DIR *d = opendir(FILTER_DIR);
+    if (d == NULL) {
+        perror(FILTER_DIR);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        // The programs are the files without an extension.
+        char path[sizeof(FILTER_DIR) + 256];
+        snprintf(path, sizeof(path), FILTER_DIR "%s", entry->d_name);
+        if (strchr(entry->d_name, '.') != NULL || access(path, X_OK) == -1) {
+            continue;
+        }
+        const FilterSpec *spec = find_filter(entry->d_name);
+        char *argv[] = {path, NULL, NULL, NULL};
+        char half_width[16];
+        if (spec != NULL && spec->arg_kind == SCALE_ARG) {
+            argv[1] = "2";
+        } else if (spec != NULL && spec->arg_kind == SIZE_ARG) {
+            // A thumbnail-like downscale to half the width.
+            snprintf(half_width, sizeof(half_width), "%d", max(width / 2, 1));
+            argv[1] = half_width;
+            argv[2] = "0";
+        } else if (spec != NULL && spec->arg_kind == POINT_ARG) {
+            // A point filter takes as long whatever its arguments are.
+            argv[1] = "2";
+        }
+        Run best;
+        if (time_program(argv, NULL, in_path, out_path, num_runs, &best) == 0) {
+            print_result("filter", entry->d_name, "-", width, height, best.seconds,
+                         best.peak_rss_kb);
+        }
+    }
+    closedir(d);
+}
+
+
+/*
+ * Time the chain (its stages separated by '|') through image_filter, with
+ * a process per filter and in-process, and report each step of the latter.
+ */
+static void bench_chain(const char *chain, const char *in_path, const char *out_path,
+                        int width, int height, int num_runs) {
+    char stages_list[strlen(chain) + 1];
+    strcpy(stages_list, chain);
+    char *stages[MAX_ITEMS];
+    int num_stages = split(stages_list, "|", stages);
+
+    // image_filter runs the filter programs from the current directory.
+    unlink(out_path);
+    char *argv[MAX_ITEMS + 6] = {"../image_filter"};
+    int argc = 1;
+    argv[argc++] = (char *) in_path;
+    argv[argc++] = (char *) out_path;
+    for (int i = 0; i < num_stages; i++) {
+        argv[argc++] = stages[i];
+    }
+    argv[argc] = NULL;
+    Run best;
+    if (time_program(argv, FILTER_DIR, NULL, NULL, num_runs, &best) == 0) {
+        print_result("chain", chain, "-", width, height, best.seconds, best.peak_rss_kb);
+    }
+
+    char *in_process_argv[MAX_ITEMS + 6] = {"./image_filter", "-i", "-T"};
+    memcpy(in_process_argv + 3, argv + 1, sizeof(char *) * argc);
+    if (time_program(in_process_argv, NULL, NULL, NULL, num_runs, &best) == -1) {
+        return;
+    }
+    print_result("chain-in-process", chain, "-", width, height, best.seconds,
+                 best.peak_rss_kb);
+
+    // Each line of the report is a step and its time; see report_stage_times.
+    char *line = strtok(best.report, "\n");
+    for (; line != NULL; line = strtok(NULL, "\n")) {
+        char *tab = strchr(line, '\t');
+        if (tab != NULL) {
+            *tab = '\0';
+            print_result("stage", chain, line, width, height, strtod(tab + 1, NULL), -1);
+        }
+    }
+}
+
+
+/*
+ * Options:
+ *   -s sizes    comma-separated image sizes, each the side of a square of
+ *               the same number of pixels (default 256,1024,4096)
+ *   -a aspects  comma-separated aspect ratios, as width:height (default 1:1)
+ *   -c chain    a chain to time, its stages separated by '|' (e.g.
+ *               "greyscale|scale 2"); may be repeated, and replaces the
+ *               default chains
+ *   -r runs     the number of runs each measurement is the best of
+ *               (default 3)
+ *
+ * Run from the directory with image_filter and filters/ in it.
+ */
+int main(int argc, char **argv) {
+    char sizes_list[256] = DEFAULT_SIZES;
+    char aspects_list[256] = DEFAULT_ASPECTS;
+    char *default_chains[] = {DEFAULT_CHAINS};
+    char *chains[MAX_ITEMS];
+    int num_chains = 0;
+    int num_runs = DEFAULT_RUNS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:a:c:r:")) != -1) {
+        if (opt == 's') {
+            snprintf(sizes_list, sizeof(sizes_list), "%s", optarg);
+        } else if (opt == 'a') {
+            snprintf(aspects_list, sizeof(aspects_list), "%s", optarg);
+        } else if (opt == 'c' && num_chains < MAX_ITEMS) {
+            chains[num_chains++] = optarg;
+        } else if (opt == 'r' && (num_runs = strtol(optarg, NULL, 10)) > 0) {
+            continue;
+        } else {
+            fprintf(stderr, "Usage: benchmark [-s sizes] [-a aspects] [-c chain]... [-r runs]\n");
+            exit(1);
+        }
+    }
+    if (num_chains == 0) {
+        num_chains = sizeof(default_chains) / sizeof(default_chains[0]);
+        memcpy(chains, default_chains, sizeof(default_chains));
+    }
+
+    char *sizes[MAX_ITEMS], *aspects[MAX_ITEMS];
+    int num_sizes = split(sizes_list, ",", sizes);
+    int num_aspects = split(aspects_list, ",", aspects);
+
+    // The images live in a directory of their own, removed at the end.
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char dir[strlen(tmpdir) + 32];
+    sprintf(dir, "%s/bench.XXXXXX", tmpdir);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char in_path[sizeof(dir) + 16], out_path[sizeof(dir) + 16];
+    sprintf(in_path, "%s/in.bmp", dir);
+    sprintf(out_path, "%s/out.bmp", dir);
+
+    printf("kind\tname\tstage\twidth\theight\tmegapixels\tseconds\tmpix_per_s\tpeak_rss_kb\n");
+    for (int i = 0; i < num_sizes; i++) {
+        for (int j = 0; j < num_aspects; j++) {
+            double side = strtod(sizes[i], NULL);
+            double w = 1, h = 1;
+            sscanf(aspects[j], "%lf:%lf", &w, &h);
+            int width = max(1, (int) lround(side * sqrt(w / h)));
+            int height = max(1, (int) lround(side * sqrt(h / w)));
+
+            generate_image(in_path, width, height);
+            bench_filters(in_path, out_path, width, height, num_runs);
+            for (int k = 0; k < num_chains; k++) {
+                bench_chain(chains[k], in_path, out_path, width, height, num_runs);
+            }
+        }
+    }
+
+    unlink(in_path);
+    unlink(out_path);
+    rmdir(dir);
+    return 0;
+}
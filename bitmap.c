@@ -1,72 +1,103 @@
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "bitmap.h"
+#include "threadpool.h"
 
 
 /*
- * Read in bitmap header data from stdin, and return a pointer to
- * a new Bitmap struct containing the important metadata for the image file.
- *
-
+ * Return a new Bitmap for the given header (which it takes ownership of),
+ * described by info, reading from in and writing to stdout.
  */
-Bitmap *read_header() {
-    int height, width, header_size;
+static Bitmap *new_bitmap(unsigned char *header, const BmpInfo *info, PixelStream in) {
+    int width = info->width;
+    int height = info->height;
     //allocating memory for bitmap
     Bitmap* bitmap_ptr = malloc(sizeof(Bitmap));
+
+    bitmap_ptr->width = width;
+    bitmap_ptr->height = height;
+    bitmap_ptr->headerSize = info->header_size;
+    bitmap_ptr->header = header;
+    bitmap_ptr->scale_factor = 1;
+    bitmap_ptr->out_width = width;
+    bitmap_ptr->out_height = height;
+    bitmap_ptr->radius = 0;
+    bitmap_ptr->resample = RESAMPLE_AREA;
+    bitmap_ptr->num_params = 0;
+    bitmap_ptr->in = in;
+    bitmap_ptr->out = (PixelStream) {.fp = stdout};
+    set_input_format(bitmap_ptr, info);
+    return bitmap_ptr;
+}
+
+
+/*
+ * Read in bitmap header data from in, and return a pointer to
+ * a new Bitmap struct containing the important metadata for the image file.
+ * The pixels are read from in and written to stdout until the caller
+ * says otherwise.
+ */
+Bitmap *read_header(FILE *in) {
+    int header_size;
     unsigned char initial_data[BMP_HEADER_SIZE_OFFSET];
     unsigned char head_size[sizeof(int)];
 
-    if(fread(initial_data, 1, BMP_HEADER_SIZE_OFFSET, stdin) != BMP_HEADER_SIZE_OFFSET){
+    if(fread(initial_data, 1, BMP_HEADER_SIZE_OFFSET, in) != BMP_HEADER_SIZE_OFFSET){
         perror("fread");
         exit(1);
     }
    
-    if(fread(head_size, 1, sizeof(int), stdin) != sizeof(int)){
+    if(fread(head_size, 1, sizeof(int), in) != sizeof(int)){
         perror("fread");
         exit(1);
     }
     
     memcpy(&header_size, head_size, sizeof(int));
+    //Check if we can even memcpy (before reading the rest of the header)
+    if(header_size < BMP_HEIGHT_OFFSET + (int) sizeof(int)){
+        fprintf(stderr, "Header size not big enough to store width or height");
+        exit(1);
+    }
 
     unsigned char* header = malloc(header_size);
     unsigned char remaining_data[header_size - BMP_HEADER_SIZE_OFFSET - sizeof(int)];
     
-    if(fread(remaining_data, 1, header_size - BMP_HEADER_SIZE_OFFSET - sizeof(int), stdin) !=
+    if(fread(remaining_data, 1, header_size - BMP_HEADER_SIZE_OFFSET - sizeof(int), in) !=
         header_size - BMP_HEADER_SIZE_OFFSET - sizeof(int)){
         perror("fread");
         exit(1);
     }
-    //Check if we can even memcpy 
-    if(BMP_HEIGHT_OFFSET + sizeof(int) > header_size || BMP_WIDTH_OFFSET + sizeof(int) > header_size){
-        fprintf(stderr, "Header size not big enough to store width or height");
-        exit(1);
-    }
-    
-    memcpy(&width, &remaining_data[BMP_WIDTH_OFFSET - BMP_HEADER_SIZE_OFFSET - sizeof(int)], sizeof(int));
-    memcpy(&height, &remaining_data[BMP_HEIGHT_OFFSET - BMP_HEADER_SIZE_OFFSET - sizeof(int)], sizeof(int)); 
-    
-    bitmap_ptr->width = width;
-    bitmap_ptr->height = height;
-    bitmap_ptr->headerSize = header_size;
-    
 
     memcpy(header, initial_data, BMP_HEADER_SIZE_OFFSET);
     memcpy(header + BMP_HEADER_SIZE_OFFSET, head_size, sizeof(int));
     memcpy(header + BMP_HEADER_SIZE_OFFSET + sizeof(int), remaining_data, header_size - BMP_HEADER_SIZE_OFFSET - sizeof(int));
 
-    bitmap_ptr->header = header;
-    
-    return bitmap_ptr;
+    BmpInfo info;
+    if(parse_bmp_info(header, header_size, &info) == -1){
+        fprintf(stderr, "Not a BMP image in a supported format "
+                "(24-bit, 32-bit or 8-bit with a palette, uncompressed)\n");
+        exit(1);
+    }
+    return new_bitmap(header, &info, (PixelStream) {.fp = in});
 }
 
 /*
- * Write out bitmap metadata to stdout.
-
+ * Write out bitmap metadata to the output stream.
  */
 void write_header(const Bitmap *bmp) {
-    fwrite(bmp->header, bmp->headerSize, 1, stdout);
+    if (bmp->out.data != NULL) {
+        // The header goes right before the pixel rows of the mapping.
+        memcpy(bmp->out.data - bmp->headerSize, bmp->header, bmp->headerSize);
+        return;
+    }
+    fwrite(bmp->header, bmp->headerSize, 1, bmp->out.fp);
 }
 
 /*
@@ -82,16 +113,114 @@ void free_bitmap(Bitmap *bmp) {
 
  
  */
-void scale(Bitmap *bmp, int scale_factor) {
-    bmp->scale_factor = scale_factor;
-    int width, height;
-    width = bmp->width * scale_factor;
-    height = bmp->height * scale_factor;
-    int file_size;
-    file_size = 3 * width * height + bmp->headerSize;
+void resize(Bitmap *bmp, int width, int height) {
+    int stored_height;
+    if (width <= 0 && height <= 0) {
+        width = bmp->width;
+        height = bmp->height;
+    } else if (width <= 0) {
+        width = max(1, (int) (((long) bmp->width * height + bmp->height / 2) / bmp->height));
+    } else if (height <= 0) {
+        height = max(1, (int) (((long) bmp->height * width + bmp->width / 2) / bmp->width));
+    }
+    bmp->out_width = width;
+    bmp->out_height = height;
+    int image_size = BMP_ROW_BYTES(width) * height;
+    int file_size = image_size + bmp->headerSize;
+    // A top-down image's rows are written in the order they are read, so
+    // it stays top-down.
+    memcpy(&stored_height, &bmp->header[BMP_HEIGHT_OFFSET], sizeof(int));
+    if (stored_height < 0) {
+        height = -height;
+    }
     memcpy(&bmp->header[BMP_HEIGHT_OFFSET], &height, sizeof(int));
     memcpy(&bmp->header[BMP_WIDTH_OFFSET], &width, sizeof(int));
     memcpy(&bmp->header[BMP_FILE_SIZE_OFFSET], &file_size, sizeof(int));
+    memcpy(&bmp->header[BMP_IMAGE_SIZE_OFFSET], &image_size, sizeof(int));
+}
+
+
+void scale(Bitmap *bmp, int scale_factor) {
+    bmp->scale_factor = scale_factor;
+    resize(bmp, bmp->width * scale_factor, bmp->height * scale_factor);
+}
+
+
+/******************************************************************************
+ * Memory-mapped files.
+ *****************************************************************************/
+
+/*
+ * Whether fd is a regular file whose offset is still at the start.
+ */
+static int is_mappable(int fd, struct stat *st) {
+    return fstat(fd, st) == 0 && S_ISREG(st->st_mode) && lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+
+Bitmap *map_bitmap(int fd, MappedFile *file) {
+    struct stat st;
+    BmpInfo info;
+    int saved_errno = errno;
+    if (!is_mappable(fd, &st) || st.st_size < BMP_HEIGHT_OFFSET + sizeof(int)) {
+        errno = saved_errno;
+        return NULL;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+
+    // Anything unusual is left to read_header to report.
+    if (parse_bmp_info(data, min(st.st_size, BMP_INFO_BYTES), &info) == -1 ||
+            info.header_size > st.st_size ||
+            (st.st_size - info.header_size) / info.row_bytes < info.height) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    unsigned char *header = malloc(info.header_size);
+    memcpy(header, data, info.header_size);
+    Bitmap *bmp = new_bitmap(header, &info, (PixelStream) {.data = data + info.header_size});
+    file->data = data;
+    file->size = st.st_size;
+    return bmp;
+}
+
+
+int map_output(Bitmap *bmp, int fd, MappedFile *file) {
+    struct stat st;
+    int saved_errno = errno;
+    int width = bmp->out_width;
+    int height = bmp->out_height;
+    size_t size = bmp->headerSize + (size_t) BMP_ROW_BYTES(width) * height;
+    // Emptying the file first means every byte of it comes back as zero,
+    // even where an existing, larger file had data before.
+    if (!is_mappable(fd, &st) || ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        errno = saved_errno;
+        return -1;
+    }
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        // Don't leave a stale errno behind for the stdio fallback.
+        errno = saved_errno;
+        return -1;
+    }
+    // ftruncate filled the file with zeros, so the row padding is done.
+    bmp->out = (PixelStream) {.data = data + bmp->headerSize};
+    file->data = data;
+    file->size = size;
+    return 0;
+}
+
+
+void unmap_file(MappedFile *file) {
+    if (file->data != NULL) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
 }
 
 
@@ -99,23 +228,200 @@ void scale(Bitmap *bmp, int scale_factor) {
  * The "main" function.
  *
  * Run a given filter function, and apply a scale factor if necessary.
+ * radius is passed on to the filter through bmp->radius. A width or height
+ * above 0 resizes the image to that size instead, with the given method
+ * passed on through bmp->resample. The num_params params are passed on
+ * through bmp->params.
  */
-void run_filter(void (*filter)(Bitmap *), int scale_factor) {
-    Bitmap *bmp = read_header();
+static void run(void (*filter)(Bitmap *), int scale_factor, int radius,
+                int width, int height, ResampleMethod method,
+                const double *params, int num_params) {
+    // Filters move whole blocks of rows at a time, so give stdio buffers
+    // big enough that each block is a single read or write.
+    setvbuf(stdin, NULL, _IOFBF, IO_BLOCK_BYTES);
+    setvbuf(stdout, NULL, _IOFBF, IO_BLOCK_BYTES);
+
+    // When stdin and stdout are files, use them through mappings instead.
+    MappedFile in_map = {NULL}, out_map = {NULL};
+    Bitmap *bmp = map_bitmap(STDIN_FILENO, &in_map);
+    if (bmp == NULL) {
+        bmp = read_header(stdin);
+    }
+    bmp->radius = radius;
+    if (num_params > 0) {
+        memcpy(bmp->params, params, sizeof(double) * num_params);
+    }
+    bmp->num_params = num_params;
 
     if (scale_factor > 1) {
         scale(bmp, scale_factor);
+    } else if (width > 0 || height > 0) {
+        resize(bmp, width, height);
+        bmp->resample = method;
     }
 
+    map_output(bmp, STDOUT_FILENO, &out_map);
     write_header(bmp);
 
     // Note: here is where we call the filter function.
     filter(bmp);
 
+    unmap_file(&in_map);
+    unmap_file(&out_map);
     free_bitmap(bmp);
 }
 
 
+void run_filter(void (*filter)(Bitmap *), int scale_factor) {
+    run(filter, scale_factor, 0, 0, 0, RESAMPLE_AREA, NULL, 0);
+}
+
+
+void run_filter_with_radius(void (*filter)(Bitmap *), int radius) {
+    run(filter, 1, radius, 0, 0, RESAMPLE_AREA, NULL, 0);
+}
+
+
+void run_filter_resized(void (*filter)(Bitmap *), int width, int height,
+                        ResampleMethod method) {
+    run(filter, 1, 0, width, height, method, NULL, 0);
+}
+
+
+void run_point_filter(void (*filter)(Bitmap *), const double *params, int num_params) {
+    run(filter, 1, 0, 0, 0, RESAMPLE_AREA, params, num_params);
+}
+
+
+/******************************************************************************
+ * Block-buffered pixel I/O.
+ *****************************************************************************/
+Pixel *alloc_rows(int width, int n) {
+    void *rows;
+    int err = posix_memalign(&rows, 64, (size_t) BMP_ROW_BYTES(width) * n);
+    if (err != 0) {
+        fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+        exit(1);
+    }
+    return rows;
+}
+
+
+int rows_per_block(int width) {
+    return max(1, IO_BLOCK_BYTES / BMP_ROW_BYTES(width));
+}
+
+
+void read_rows(Bitmap *bmp, Pixel *rows, int n) {
+    size_t packed = (size_t) bmp->width * sizeof(Pixel);
+    size_t padded = BMP_ROW_BYTES(bmp->width);
+    unsigned char *data = (unsigned char *) rows;
+
+    if (bmp->in.format != BMP_BGR24) {
+        decode_rows(&bmp->in, bmp->width, rows, n);
+        return;
+    }
+    if (bmp->in.data != NULL) {
+        const unsigned char *src = bmp->in.data + (size_t) bmp->in.row * padded;
+        if (packed == padded) {
+            memcpy(data, src, n * packed);
+        } else {
+            for (int i = 0; i < n; i++) {
+                memcpy(data + i * packed, src + i * padded, packed);
+            }
+        }
+        bmp->in.row += n;
+        return;
+    }
+    if (bmp->in.fp == NULL) {
+        memcpy(rows, bmp->in.pixels + (size_t) bmp->in.row * bmp->width, n * packed);
+        bmp->in.row += n;
+        return;
+    }
+    if (fread(data, padded, n, bmp->in.fp) != n) {
+        perror("fread");
+        exit(1);
+    }
+    // Squeeze out the row padding; every row only ever moves towards the
+    // front of the buffer, so this is safe to do in place.
+    if (packed != padded) {
+        for (int i = 1; i < n; i++) {
+            memmove(data + i * packed, data + i * padded, packed);
+        }
+    }
+}
+
+
+void write_rows(Bitmap *bmp, const Pixel *rows, int n) {
+    static const unsigned char padding[3] = {0, 0, 0};
+    int width = bmp->out_width;
+    size_t packed = (size_t) width * sizeof(Pixel);
+    size_t pad = BMP_ROW_BYTES(width) - packed;
+
+    if (bmp->out.data != NULL) {
+        unsigned char *dst = bmp->out.data + (size_t) bmp->out.row * (packed + pad);
+        if (pad == 0) {
+            memcpy(dst, rows, n * packed);
+        } else {
+            for (int i = 0; i < n; i++) {
+                memcpy(dst + i * (packed + pad), rows + (size_t) i * width, packed);
+            }
+        }
+        bmp->out.row += n;
+        return;
+    }
+    if (bmp->out.fp == NULL) {
+        memcpy(bmp->out.pixels + (size_t) bmp->out.row * width, rows, n * packed);
+        bmp->out.row += n;
+        return;
+    }
+    if (pad == 0) {
+        if (fwrite(rows, packed, n, bmp->out.fp) != n) {
+            perror("fwrite");
+            exit(1);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fwrite(rows + (size_t) i * width, 1, packed, bmp->out.fp) != packed ||
+                fwrite(padding, 1, pad, bmp->out.fp) != pad) {
+            perror("fwrite");
+            exit(1);
+        }
+    }
+}
+
+
+const Pixel *input_rows(Bitmap *bmp, int n) {
+    const Pixel *rows;
+    if (bmp->in.data != NULL && bmp->in.format == BMP_BGR24 &&
+            BMP_ROW_BYTES(bmp->width) == bmp->width * sizeof(Pixel)) {
+        rows = (const Pixel *) bmp->in.data + (size_t) bmp->in.row * bmp->width;
+    } else if (bmp->in.data == NULL && bmp->in.fp == NULL) {
+        rows = bmp->in.pixels + (size_t) bmp->in.row * bmp->width;
+    } else {
+        return NULL;
+    }
+    bmp->in.row += n;
+    return rows;
+}
+
+
+Pixel *output_rows(Bitmap *bmp, int n) {
+    int width = bmp->out_width;
+    Pixel *rows;
+    if (bmp->out.data != NULL && BMP_ROW_BYTES(width) == width * sizeof(Pixel)) {
+        rows = (Pixel *) bmp->out.data + (size_t) bmp->out.row * width;
+    } else if (bmp->out.data == NULL && bmp->out.fp == NULL) {
+        rows = bmp->out.pixels + (size_t) bmp->out.row * width;
+    } else {
+        return NULL;
+    }
+    bmp->out.row += n;
+    return rows;
+}
+
+
 /******************************************************************************
  * The gaussian blur and edge detection filters.
  *****************************************************************************/
@@ -194,3 +500,88 @@ Pixel apply_edge_detection_kernel(Pixel *row0, Pixel *row1, Pixel *row2) {
 
     return new;
 }
+
+
+/******************************************************************************
+ * Running the 3-by-3 filters over whole images.
+ *****************************************************************************/
+static int filter_threads = 0;       // 0 means "not configured yet".
+static ThreadPool *filter_pool = NULL;
+
+
+void set_filter_threads(int num_threads) {
+    filter_threads = max(1, num_threads);
+}
+
+
+int get_filter_threads(void) {
+    if (filter_threads == 0) {
+        char *env = getenv("IMAGE_FILTER_THREADS");
+        set_filter_threads(env ? strtol(env, NULL, 10) : 1);
+    }
+    return filter_threads;
+}
+
+
+/*
+ * A forked child has none of the pool's threads, so it makes a pool of its
+ * own when it needs one.
+ */
+static void forget_filter_pool(void) {
+    filter_pool = NULL;
+}
+
+
+ThreadPool *get_filter_pool(void) {
+    static int forget_on_fork = 0;
+    int threads = get_filter_threads();
+    if (threads == 1) {
+        return NULL;
+    }
+    if (filter_pool == NULL || pool_size(filter_pool) != threads) {
+        if (filter_pool != NULL) {
+            pool_destroy(filter_pool);
+        }
+        filter_pool = pool_create(threads);
+        if (!forget_on_fork) {
+            pthread_atfork(NULL, NULL, forget_filter_pool);
+            forget_on_fork = 1;
+        }
+    }
+    return filter_pool;
+}
+
+
+/*
+ * Work out one tile of a 3-by-3 filter; arg points to the RowKernel.
+ */
+static void convolve_tile(void *arg, Tile *tile) {
+    RowKernel kernel = *(RowKernel *) arg;
+    // A tile narrower than the image works out its halo columns as well
+    // (with the border rule at the tile's edges), so those go to a row of
+    // their own.
+    Pixel *row = tile->in_width > tile->width ? alloc_rows(tile->in_width, 1) : NULL;
+
+    for (int y = tile->y; y < tile->y + tile->height; y++) {
+        // Border rows use the grid of their inner neighbour.
+        int centre = min(max(y, 1), tile->image_height - 2);
+        const Pixel *above = tile_input_row(tile, centre - 1);
+        const Pixel *middle = tile_input_row(tile, centre);
+        const Pixel *below = tile_input_row(tile, centre + 1);
+        if (row == NULL) {
+            kernel(tile_output_row(tile, y), above, middle, below, tile->width);
+        } else {
+            kernel(row, above, middle, below, tile->in_width);
+            memcpy(tile_output_row(tile, y), row + (tile->x - tile->in_x),
+                   tile->width * sizeof(Pixel));
+        }
+        // The next row looks at this row's input row and below.
+        release_tile_rows(tile, y + 1, y);
+    }
+    free(row);
+}
+
+
+void convolve_filter(Bitmap *bmp, RowKernel kernel) {
+    run_tiled(bmp, 1, sizeof(Pixel), convolve_tile, &kernel);
+}
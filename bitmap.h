@@ -1,12 +1,36 @@
 #ifndef BITMAP_H_
 #define BITMAP_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include "threadpool.h"
+
 // Use the following offsets to index into the `header`
 // field of the Bitmap struct.
 #define BMP_FILE_SIZE_OFFSET 2
 #define BMP_HEADER_SIZE_OFFSET 10
 #define BMP_WIDTH_OFFSET 18
 #define BMP_HEIGHT_OFFSET 22
+#define BMP_INFO_SIZE_OFFSET 14
+#define BMP_BITS_PER_PIXEL_OFFSET 28
+#define BMP_COMPRESSION_OFFSET 30
+#define BMP_IMAGE_SIZE_OFFSET 34
+#define BMP_COLORS_USED_OFFSET 46
+#define BMP_COLORS_IMPORTANT_OFFSET 50
+#define BMP_MASKS_OFFSET 54
+
+// How much of the start of a BMP file parse_bmp_info may look at (up to
+// the end of the red, green and blue masks).
+#define BMP_INFO_BYTES (BMP_MASKS_OFFSET + 12)
+
+// Pixel rows in a BMP file are padded out to a multiple of 4 bytes.
+#define BMP_ROW_BYTES(width) ((((width) * 3) + 3) & ~3)
+
+// Target size of one block of rows moved by read_rows/write_rows.
+#define IO_BLOCK_BYTES (1 << 20)
+
+// The most arguments a point filter takes (see point_filter).
+#define MAX_POINT_PARAMS 3
 
 typedef struct pixel{
     unsigned char blue;
@@ -14,16 +38,186 @@ typedef struct pixel{
     unsigned char red;
 } Pixel;
 
+// The layouts of the pixel rows of a BMP file that the filters can read
+// (see decode.c). They only ever write 24-bit rows.
+typedef enum {
+    BMP_BGR24,               // 3 bytes a pixel: blue, green, red.
+    BMP_BGRA32,              // 4 bytes a pixel; the fourth is ignored.
+    BMP_PALETTE8,            // 1 byte a pixel, indexing a palette.
+} BmpPixelFormat;
+
+// One end of a filter: pixel rows either come from (or go to) a stdio
+// stream, a memory-mapped BMP file, or an in-memory image of tightly
+// packed rows.
+typedef struct {
+    FILE *fp;                // The stream, or NULL if the rows are in memory.
+    unsigned char *data;     // The (padded) rows of a mapped file, or NULL.
+    Pixel *pixels;           // The in-memory rows (if fp and data are NULL).
+    int row;                 // The next row of pixels to read or write.
+    BmpPixelFormat format;   // The layout of the rows of fp or data.
+    const uint32_t *palette; // The colours of BMP_PALETTE8 rows.
+} PixelStream;
+
 typedef struct {
     int headerSize;          // The size of the header.
     unsigned char *header;   // The contents of the image header.
     int width;               // The width of the image, in pixels.
     int height;              // The height of the image, in pixels.
-    int scale_factor;		
+    int scale_factor;        // The factor the output is scaled by (1 if none).
+    int out_width;           // The size of the output image.
+    int out_height;
+    int radius;              // The blur radius (0 for the 3-by-3 kernel).
+    int resample;            // How resize_filter resamples (a ResampleMethod).
+    double params[MAX_POINT_PARAMS];  // The arguments of a point filter,
+    int num_params;                   // and how many there are.
+    PixelStream in;          // Where the filter reads the input pixels from.
+    PixelStream out;         // Where the filter writes the output pixels to.
+    uint32_t palette[256];   // The colours of an 8-bit input image.
 } Bitmap;
 
 
+// The ways resample can work out the pixels of a resized image.
+typedef enum {
+    RESAMPLE_AREA,           // Average the input pixels each output pixel covers.
+    RESAMPLE_BILINEAR,       // Interpolate linearly between the nearest pixels.
+    RESAMPLE_BICUBIC,        // Interpolate with a cubic through 4 x 4 pixels.
+} ResampleMethod;
+
+
 void run_filter(void (*filter)(Bitmap *), int scale_factor);
+void run_filter_with_radius(void (*filter)(Bitmap *), int radius);
+void run_filter_resized(void (*filter)(Bitmap *), int width, int height,
+                        ResampleMethod method);
+void run_point_filter(void (*filter)(Bitmap *), const double *params, int num_params);
+
+
+/*
+ * Header functions
+ * ----------------
+ *
+ * read_header reads the header from the given stream and returns a new Bitmap
+ * whose input and output are set to `in` and stdout. It exits if the image
+ * isn't in a format parse_bmp_info accepts.
+ * write_header writes the header to the Bitmap's output stream.
+ * resize updates the header (and bmp->out_width and bmp->out_height) to
+ * record a resizing of the image to the given size; a width or height of
+ * 0 keeps the aspect ratio. scale does the same for a resizing by an integer
+ * factor, which it records in bmp->scale_factor as well. Both keep a
+ * top-down image top-down.
+ */
+Bitmap *read_header(FILE *in);
+void write_header(const Bitmap *bmp);
+void free_bitmap(Bitmap *bmp);
+void resize(Bitmap *bmp, int width, int height);
+void scale(Bitmap *bmp, int scale_factor);
+
+
+/*
+ * BMP formats
+ * -----------
+ *
+ * Besides 24-bit images, the filters read 32-bit ones (BGRA, or BGRX) and
+ * 8-bit ones with a palette, converting their rows to Pixels as they are
+ * read; the output is always 24-bit, with a header to match. They also
+ * read images stored top row first (which have a negative height in the
+ * header). Since the filters treat every row alike, rows are simply
+ * processed in the order they are stored, and the output is stored in the
+ * same order, so a top-down image needs no flipping: bmp->height is the
+ * number of rows, and the header keeps the sign.
+ *
+ * parse_bmp_info fills in info from the first len bytes of a BMP file (of
+ * which it needs at most BMP_INFO_BYTES, and none past the header). It
+ * returns 0 on success and -1 if the header is malformed, the format isn't
+ * one of the above, or len is too short to tell.
+ *
+ * set_input_format sets bmp up to read the rows info describes from bmp->in:
+ * it loads the palette from bmp->header, and rewrites the header as that of
+ * a 24-bit image of the same size and row order.
+ *
+ * decode_rows reads n rows from a mapped or stdio stream whose format isn't
+ * BMP_BGR24, converting them to tightly packed Pixels (with SSSE3 or AVX2
+ * shuffles and gathers when the CPU has them); read_rows uses it.
+ */
+typedef struct {
+    int header_size;         // The offset of the pixel rows in the file.
+    int width;
+    int height;              // The number of rows (positive either way).
+    int top_down;            // Whether the top row comes first.
+    BmpPixelFormat format;
+    int row_bytes;           // The size of a row in the file, with padding.
+    int palette_offset;      // Where the palette starts in the header,
+    int palette_size;        // and its number of colours.
+} BmpInfo;
+
+int parse_bmp_info(const unsigned char *data, int len, BmpInfo *info);
+void set_input_format(Bitmap *bmp, const BmpInfo *info);
+void decode_rows(PixelStream *in, int width, Pixel *rows, int n);
+
+
+/*
+ * Memory-mapped files
+ * -------------------
+ *
+ * For images in regular files, the pixels can be read straight out of the
+ * page cache, and written straight into it, instead of being copied through
+ * stdio buffers.
+ *
+ * map_bitmap maps the BMP file open on fd (which must be at offset 0), and
+ * returns a new Bitmap whose input rows come from the mapping and whose
+ * output is stdout. It returns NULL, without reading anything, if fd is not
+ * a regular file or doesn't hold a complete image; the caller can then fall
+ * back to read_header.
+ *
+ * map_output sizes the regular file open on fd (for reading and writing, at
+ * offset 0) to exactly the image bmp will write, maps it, and points bmp->out
+ * at it; write_header and write_rows then fill in the mapping. It returns -1
+ * and leaves bmp->out alone if fd can't be mapped.
+ *
+ * unmap_file releases a mapping made by either function (if there is one).
+ */
+typedef struct {
+    unsigned char *data;     // The whole file, or NULL if nothing is mapped.
+    size_t size;
+} MappedFile;
+
+Bitmap *map_bitmap(int fd, MappedFile *file);
+int map_output(Bitmap *bmp, int fd, MappedFile *file);
+void unmap_file(MappedFile *file);
+
+
+/*
+ * Functions for block-buffered pixel I/O
+ * --------------------------------------
+ *
+ * Filters should move pixels with these rather than calling fread/fwrite
+ * once per Pixel. They take care of the padding at the end of each BMP row,
+ * so the buffers handed to filters always hold tightly packed Pixel rows.
+ *
+ * alloc_rows returns an aligned buffer large enough to hold n rows of the
+ * given width *including* padding; the buffers passed to read_rows must come
+ * from alloc_rows (the padding is read in place and then squeezed out).
+ * Free them with free().
+ *
+ * read_rows reads n rows of bmp->width pixels from bmp->in.
+ * write_rows writes n rows of the output width (bmp->out_width) to bmp->out.
+ * Both exit the program if the image data is truncated or cannot be written.
+ *
+ * rows_per_block returns how many rows of the given width fit into one
+ * IO_BLOCK_BYTES block (at least 1).
+ *
+ * input_rows and output_rows give filters direct access to the next n input
+ * or output rows when those are already in memory as tightly packed rows (an
+ * in-memory image, or a mapped file whose rows need no padding), and count
+ * them as read or written. Otherwise they return NULL and the filter has to
+ * use read_rows and write_rows as usual. The rows returned by output_rows
+ * must all be filled in by the filter.
+ */
+Pixel *alloc_rows(int width, int n);
+void read_rows(Bitmap *bmp, Pixel *rows, int n);
+void write_rows(Bitmap *bmp, const Pixel *rows, int n);
+int rows_per_block(int width);
+const Pixel *input_rows(Bitmap *bmp, int n);
+Pixel *output_rows(Bitmap *bmp, int n);
 
 
 // Macros and functions for performing the two multi-row filters.
@@ -53,4 +247,244 @@ void run_filter(void (*filter)(Bitmap *), int scale_factor);
 Pixel apply_gaussian_kernel(Pixel *row0, Pixel *row1, Pixel *row2);
 Pixel apply_edge_detection_kernel(Pixel *row0, Pixel *row1, Pixel *row2);
 
+
+/*
+ * Whole-row versions of the functions above
+ * -----------------------------------------
+ *
+ * above, middle and below are three consecutive rows of the given width
+ * (at least 3). out[c] is set to exactly what the function above would return
+ * for the grid centred on column c, except that the first and last columns
+ * use the grid of their inner neighbour.
+ *
+ * These work on 16 or 32 bytes at a time with SSE2 or AVX2 when the CPU
+ * supports them; see kernels.c.
+ */
+typedef void (*RowKernel)(Pixel *out, const Pixel *above, const Pixel *middle,
+                          const Pixel *below, int width);
+
+void gaussian_row(Pixel *out, const Pixel *above, const Pixel *middle,
+                  const Pixel *below, int width);
+void edge_detection_row(Pixel *out, const Pixel *above, const Pixel *middle,
+                        const Pixel *below, int width);
+
+
+/*
+ * Planar images
+ * -------------
+ *
+ * A PlanarImage keeps each channel in its own plane instead of interleaving
+ * them in 3-byte Pixels, which lets the filters work on whole vectors of
+ * a single channel. Filters that can work on planar images declare so in the
+ * filter table (see pipeline.h), and a filter chain converts to and from the
+ * packed BMP layout only once for a whole run of such filters.
+ *
+ * packed_to_planar and planar_to_packed convert a whole image of
+ * img->width * img->height tightly packed Pixels (with SSSE3 shuffles when
+ * the CPU has them).
+ *
+ * average_planes sets out[i] to the average of the three channels of pixel i,
+ * exactly as greyscale computes it.
+ *
+ * gaussian_plane_row is gaussian_row for one plane: above, middle and below
+ * are three consecutive rows of the plane.
+ *
+ * edge_detection_plane_row sets out to the edge values of the row `centre`
+ * of img (which must have a row above and below it), the same value
+ * edge_detection_row puts in each channel.
+ */
+typedef struct {
+    int width;
+    int height;
+    unsigned char *planes[3];    // Blue, green and red; width * height each.
+} PlanarImage;
+
+PlanarImage *alloc_planar(int width, int height);
+void free_planar(PlanarImage *img);
+void packed_to_planar(PlanarImage *img, const Pixel *pixels);
+void planar_to_packed(Pixel *pixels, const PlanarImage *img);
+void average_planes(unsigned char *out, const PlanarImage *img);
+void gaussian_plane_row(unsigned char *out, const unsigned char *above,
+                        const unsigned char *middle, const unsigned char *below,
+                        int width);
+void edge_detection_plane_row(unsigned char *out, const PlanarImage *img, int centre);
+
+
+/*
+ * Tiles
+ * -----
+ *
+ * run_tiled runs a filter that keeps the size of the image, and works out
+ * every output pixel from the input pixels at most halo rows and columns
+ * away, a tile at a time: it reads every row from bmp->in, calls
+ * filter(arg, tile) once for every tile, and writes the result to bmp->out.
+ * Tiles are done on the filter threads when there are several, and the
+ * memory the input, output and tiles take stays within the memory budget,
+ * however large the image. column_bytes is what the filter allocates for a
+ * tile per column of its input. See tiles.c.
+ *
+ * A Tile gives the filter the output pixels to fill in, and the input
+ * pixels it may look at: the output pixels grown by the halo on every
+ * side, clipped to the image. A tile within halo rows of the top or bottom
+ * also gets the input around the first or last row that isn't, so that
+ * its border rows can use that row's neighbourhood. tile_input_row returns input row y (of the
+ * image), from column in_x on; tile_output_row returns output row y, from
+ * column x on.
+ *
+ * A filter goes through its tile's output rows in order, and calls
+ * release_tile_rows(tile, y, in_y) once it has filled in the rows above y,
+ * and won't look at the input rows above in_y again.
+ */
+typedef struct {
+    int x, y;                // The first output column and row,
+    int width, height;       // and the number of them.
+    int in_x, in_y;          // The input pixels the filter may look at.
+    int in_width, in_height;
+    int image_width;         // The size of the whole image.
+    int image_height;
+    const unsigned char *in; // Input pixel (in_x, in_y), and the bytes
+    size_t in_stride;        // from one input row to the next.
+    unsigned char *out;      // Output pixel (x, y), likewise.
+    size_t out_stride;
+    int released;            // The rest is for release_tile_rows: the
+    int released_in;         // output and input rows released so far, and
+    int drop_in;             // whether to drop the pages of the input and
+    int drop_out;            // output rows it releases.
+} Tile;
+
+typedef void (*TileFilter)(void *arg, Tile *tile);
+
+void run_tiled(Bitmap *bmp, int halo, size_t column_bytes, TileFilter filter, void *arg);
+const Pixel *tile_input_row(const Tile *tile, int y);
+Pixel *tile_output_row(const Tile *tile, int y);
+void release_tile_rows(Tile *tile, int y, int in_y);
+
+/*
+ * Run a whole 3-by-3 filter: read every row from bmp->in, apply kernel to
+ * every row, and write the result to bmp->out.
+ *
+ * Pixels on the border use the grid of their nearest inner neighbour, so the
+ * image must be at least 3 pixels wide and high.
+ *
+ * The image is processed in tiles (see run_tiled). Tiles only read the
+ * (shared) input, so the output is exactly the same however the image is
+ * split up, and with any number of threads.
+ */
+void convolve_filter(Bitmap *bmp, RowKernel kernel);
+
+/*
+ * Run a gaussian blur with the given radius (at least 1): read every row
+ * from bmp->in and write the blurred rows to bmp->out. The image is
+ * processed in tiles, like convolve_filter's. See blur.c.
+ *
+ * separable_blur_planar does the same blur on a whole planar image, in
+ * bands of each plane on the filter threads, and makes exactly the same
+ * pixels.
+ */
+void separable_blur_filter(Bitmap *bmp, int radius);
+void separable_blur_planar(const PlanarImage *in, PlanarImage *out, int radius);
+
+/*
+ * Resize the image to bmp->out_width by bmp->out_height pixels with the
+ * given method: read every row from bmp->in and write the resized rows to
+ * bmp->out. See resample.c.
+ *
+ * parse_resample_method sets method to the one with the given name ("area",
+ * "bilinear" or "bicubic"); it returns 0 on success and -1 if there is none.
+ */
+void resample(Bitmap *bmp, ResampleMethod method);
+int parse_resample_method(const char *name, ResampleMethod *method);
+
+/*
+ * Write num_levels successively halved copies of the image (each 2-by-2
+ * block of pixels averaged into one): read every row from bmp->in once, and
+ * write level k (1 / 2^(k + 1) of the size, rounded up) to outs[k] as a
+ * complete BMP image. See pyramid.c.
+ */
+void write_pyramid(Bitmap *bmp, FILE **outs, int num_levels);
+
+/*
+ * Point operations
+ * ----------------
+ *
+ * A point operation works out every pixel from the input pixel in the same
+ * place alone, with 256-entry tables; see pointops.c. A plain operation
+ * looks each channel up in a table of its own. A mono operation first mixes
+ * the channels into one value (greyscale's average, or a luminance), and
+ * looks that up in a table per output channel.
+ *
+ * The *_op functions set up op as the operation of a filter, given the n
+ * arguments of the filter in params; they return -1 if the arguments are
+ * invalid and 0 otherwise. parse_point_params converts n arguments from
+ * strings into params, returning n, or -1 if they aren't all numbers or
+ * there are too many.
+ *
+ * compose_point_ops sets op to op followed by next, as one operation that
+ * gives exactly the same result.
+ *
+ * apply_point_op applies op to n tightly packed pixels of in, writing them
+ * to out (which may be in). It uses AVX-512 table lookups when the CPU has
+ * them (with VBMI); everywhere else, including CPUs with just SSSE3 or AVX2,
+ * it looks up one byte at a time.
+ *
+ * point_filter runs the operation that make sets up from bmp->params: it
+ * reads every row from bmp->in, and writes the result to bmp->out. When the
+ * rows are all in memory, the filter threads share them in bands.
+ */
+typedef struct {
+    int mono;                    // Whether the channels are mixed first.
+    unsigned char pre[3][256];   // For a mono operation, the table of each
+                                 // input channel, before they are mixed;
+    int weights[3];              // the weight of each (in 1/65536ths), and
+    int bias;                    // what is added to the sum before it is
+                                 // rounded down (to at most 255).
+    unsigned char lut[3][256];   // The table of each output channel.
+} PointOp;
+
+typedef int (*PointOpMaker)(PointOp *op, const double *params, int n);
+
+int greyscale_op(PointOp *op, const double *params, int n);
+int invert_op(PointOp *op, const double *params, int n);
+int brightness_contrast_op(PointOp *op, const double *params, int n);
+int gamma_op(PointOp *op, const double *params, int n);
+int threshold_op(PointOp *op, const double *params, int n);
+int sepia_op(PointOp *op, const double *params, int n);
+int levels_op(PointOp *op, const double *params, int n);
+int parse_point_params(double *params, char **args, int n);
+
+void compose_point_ops(PointOp *op, const PointOp *next);
+void apply_point_op(const PointOp *op, Pixel *out, const Pixel *in, int n);
+void point_filter(Bitmap *bmp, PointOpMaker make);
+
+/*
+ * The number of threads the filters use. This defaults to the value of the
+ * IMAGE_FILTER_THREADS environment variable, or 1 if it isn't set.
+ *
+ * get_filter_pool returns the pool of that many threads that the filters
+ * share (created on first use), or NULL if there is only one thread. The
+ * filters hand it bands of rows or tiles as tasks, several per thread, so
+ * that threads that finish early steal from the rest (see threadpool.h).
+ * A process forked after the pool is made gets a pool of its own.
+ */
+void set_filter_threads(int num_threads);
+int get_filter_threads(void);
+ThreadPool *get_filter_pool(void);
+
+/*
+ * The memory budget, in bytes, for the buffers and mapped pages of an image
+ * that a filter holds at once (see run_tiled). This defaults to the value of
+ * the IMAGE_FILTER_MEMORY environment variable, or 256M if it isn't set.
+ * The budget is kept to as closely as the filter allows: a band or tile
+ * never gets smaller than a few rows or columns, and chains that need
+ * whole images in memory avoid doing so for images larger than it (see
+ * run_pipeline).
+ *
+ * parse_memory_size sets bytes to a size given as a number of bytes,
+ * optionally followed by K, M or G; it returns 0 on success and -1 if the
+ * size isn't valid.
+ */
+void set_filter_memory(size_t bytes);
+size_t get_filter_memory(void);
+int parse_memory_size(const char *s, size_t *bytes);
+
 #endif /* BITMAP_H_*/
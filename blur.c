@@ -0,0 +1,458 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+
+/******************************************************************************
+ * Separable gaussian blur with an arbitrary radius.
+ *
+ * The blur is done as a horizontal pass over each input row followed by
+ * vertical passes over columns of horizontally blurred rows, so the cost per
+ * pixel grows linearly with the radius. Everything is integer fixed point:
+ * weights are in Q14 (they add up to exactly 1 << 14) and the rows between
+ * the passes hold Q8 values (the pixel value times 256) in 16 bits.
+ *
+ * Up to MAX_GAUSSIAN_RADIUS the passes use real gaussian weights. Beyond
+ * that, three box blurs of carefully chosen sizes are used instead; their
+ * cost doesn't depend on the radius at all, and they are a close
+ * approximation of the gaussian.
+ *
+ * Unlike the 3-by-3 kernel, pixels near the border see the border
+ * pixels repeated outwards.
+ *
+ * The image is blurred a tile at a time (see run_tiled), each tile with
+ * passes of its own over its input, which reaches as far as the blur does.
+ * Only the edges of that input that are the edges of the image need the
+ * border pixels repeated; everywhere else, the tile's pixels come out just
+ * as if the whole image had been blurred at once.
+ *
+ * The same passes blur a single plane of a PlanarImage, where neighbouring
+ * values belong to neighbouring pixels instead of being 3 channels apart.
+ * Each channel is blurred on its own either way, so the planes come out
+ * exactly as the channels of the packed image would.
+ *****************************************************************************/
+#define MAX_GAUSSIAN_RADIUS 12
+#define WEIGHT_BITS 14
+#define NUM_BOXES 3
+
+typedef uint16_t Q8;
+
+
+/*
+ * One vertical pass. Rows are pulled through a chain of these: asking a
+ * pass for its output row y makes it pull the input rows it needs from
+ * the pass before it (or from the horizontal pass, for the first one).
+ * Rows are always asked for in increasing order, so each pass only has to
+ * remember its last few input rows.
+ */
+typedef struct vpass {
+    struct vpass *prev;      // Where input rows come from; NULL for the first.
+    int radius;
+    const int *weights;      // 2 * radius + 1 weights, or NULL for a box.
+    int ring_size;           // The number of input rows kept around.
+    Q8 **ring;               // Input row k lives in ring[k % ring_size].
+    int next_in;             // The next input row to pull.
+    uint32_t *sums;          // Column sums (running sums, for a box).
+    int sum_row;             // The row `sums` is for, or -1.
+    Q8 *out;                 // The last output row.
+} VPass;
+
+// The blur every tile does.
+typedef struct {
+    int channels;            // Values per pixel: 3, or 1 for a plane.
+    int radius;
+    int weights[2 * MAX_GAUSSIAN_RADIUS + 1];  // The gaussian weights, up to
+                                               // MAX_GAUSSIAN_RADIUS;
+    int boxes[NUM_BOXES];    // the box radii beyond it.
+} Blur;
+
+typedef struct {
+    const Tile *tile;        // Where input rows come from.
+    int channels;            // Values per pixel, interleaved.
+    int width;               // The number of Q8 values in a row.
+    int height;              // The height of the whole image.
+    int radius;
+    const int *weights;      // The horizontal gaussian weights, or NULL.
+    const int *boxes;        // The box radii, when weights is NULL.
+    int32_t *scratch[2];     // Row buffers for the horizontal pass.
+} HPass;
+
+
+/*
+ * Fill weights[0 .. 2 * radius] with a gaussian of standard deviation
+ * radius / 2, in fixed point. Any rounding error goes on the centre weight
+ * so that the weights always add up to exactly 1 << WEIGHT_BITS.
+ */
+static void gaussian_weights(int *weights, int radius) {
+    double sigma = radius / 2.0;
+    double raw[2 * radius + 1];
+    double total = 0;
+    for (int k = -radius; k <= radius; k++) {
+        raw[k + radius] = exp(-(k * k) / (2 * sigma * sigma));
+        total += raw[k + radius];
+    }
+    int sum = 0;
+    for (int k = 0; k <= 2 * radius; k++) {
+        weights[k] = lround(raw[k] / total * (1 << WEIGHT_BITS));
+        sum += weights[k];
+    }
+    weights[radius] += (1 << WEIGHT_BITS) - sum;
+}
+
+
+/*
+ * Pick the radii of NUM_BOXES box blurs that together come closest to a
+ * gaussian of the same standard deviation as gaussian_weights uses.
+ * See "Fast Almost-Gaussian Filtering" (Kovesi, 2010).
+ */
+static void box_radii(int *boxes, int radius) {
+    double sigma = radius / 2.0;
+    int lower = floor(sqrt(12 * sigma * sigma / NUM_BOXES + 1));
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    int upper = lower + 2;
+    int num_lower = lround((12 * sigma * sigma - NUM_BOXES * lower * lower
+                            - 4 * NUM_BOXES * lower - 3 * NUM_BOXES) / (-4 * lower - 4));
+    for (int i = 0; i < NUM_BOXES; i++) {
+        boxes[i] = ((i < num_lower ? lower : upper) - 1) / 2;
+    }
+}
+
+
+/*
+ * Box-blur a row of Q8 values (n channels interleaved) with the given radius.
+ */
+static void box_row(int32_t *out, const int32_t *in, int width, int n, int radius) {
+    int pixels = width / n;
+    int size = 2 * radius + 1;
+    for (int ch = 0; ch < n; ch++) {
+        int32_t sum = 0;
+        for (int k = -radius; k <= radius; k++) {
+            sum += in[n * min(max(k, 0), pixels - 1) + ch];
+        }
+        for (int c = 0; c < pixels; c++) {
+            out[n * c + ch] = (sum + size / 2) / size;
+            sum += in[n * min(c + radius + 1, pixels - 1) + ch]
+                 - in[n * max(c - radius, 0) + ch];
+        }
+    }
+}
+
+
+/*
+ * Blur input row y horizontally into out.
+ */
+static void horizontal_pass(HPass *h, int y, Q8 *out) {
+    const unsigned char *in = (const unsigned char *) tile_input_row(h->tile, y);
+    int32_t *a = h->scratch[0], *b = h->scratch[1];
+    int n = h->channels;
+
+    if (h->weights != NULL) {
+        // Repeat the border pixels radius times on each side, so the
+        // loops below never have to clamp anything.
+        int pad = n * h->radius;
+        for (int i = 0; i < h->width; i++) {
+            a[i + pad] = in[i];
+        }
+        for (int i = 0; i < pad; i++) {
+            a[i] = in[i % n];
+            a[pad + h->width + i] = in[h->width - n + i % n];
+        }
+        memset(b, 0, sizeof(int32_t) * h->width);
+        for (int k = 0; k <= 2 * h->radius; k++) {
+            int w = h->weights[k];
+            const int32_t *shifted = a + n * k;
+            for (int i = 0; i < h->width; i++) {
+                b[i] += w * shifted[i];
+            }
+        }
+        for (int i = 0; i < h->width; i++) {
+            out[i] = (b[i] + (1 << (WEIGHT_BITS - 9))) >> (WEIGHT_BITS - 8);
+        }
+        return;
+    }
+
+    for (int i = 0; i < h->width; i++) {
+        a[i] = in[i] << 8;
+    }
+    for (int i = 0; i < NUM_BOXES; i++) {
+        box_row(b, a, h->width, n, h->boxes[i]);
+        int32_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    for (int i = 0; i < h->width; i++) {
+        out[i] = a[i];
+    }
+}
+
+
+/*
+ * The number of input rows a pass keeps around. A box needs one extra row:
+ * the one that just left the window.
+ */
+static int ring_size(int radius, const int *weights) {
+    return 2 * radius + (weights ? 1 : 2);
+}
+
+
+static VPass *vpass_create(VPass *prev, int radius, const int *weights, int width) {
+    VPass *v = calloc(1, sizeof(VPass));
+    v->prev = prev;
+    v->radius = radius;
+    v->weights = weights;
+    v->ring_size = ring_size(radius, weights);
+    v->ring = malloc(sizeof(Q8 *) * v->ring_size);
+    for (int i = 0; i < v->ring_size; i++) {
+        v->ring[i] = malloc(sizeof(Q8) * width);
+    }
+    v->sums = malloc(sizeof(uint32_t) * width);
+    v->sum_row = -1;
+    v->out = malloc(sizeof(Q8) * width);
+    return v;
+}
+
+
+static void vpass_free(VPass *v) {
+    for (int i = 0; i < v->ring_size; i++) {
+        free(v->ring[i]);
+    }
+    free(v->ring);
+    free(v->sums);
+    free(v->out);
+    free(v);
+}
+
+
+static const Q8 *vpass_row(VPass *v, HPass *h, int y);
+
+
+/*
+ * Set up the chain of passes ending in v to make its rows from y on: each
+ * pass starts with the first input row the pass after it will ask for.
+ */
+static void vpass_start(VPass *v, int y) {
+    for (; v != NULL; v = v->prev) {
+        y = max(y - v->radius, 0);
+        v->next_in = y;
+        v->sum_row = -1;
+    }
+}
+
+
+/*
+ * Return input row k (clamped to the image) of the given pass, pulling
+ * rows from the previous pass as necessary.
+ */
+static const Q8 *vpass_input(VPass *v, HPass *h, int k) {
+    k = min(max(k, 0), h->height - 1);
+    while (v->next_in <= k) {
+        Q8 *slot = v->ring[v->next_in % v->ring_size];
+        if (v->prev == NULL) {
+            horizontal_pass(h, v->next_in, slot);
+        } else {
+            memcpy(slot, vpass_row(v->prev, h, v->next_in), sizeof(Q8) * h->width);
+        }
+        v->next_in++;
+    }
+    return v->ring[k % v->ring_size];
+}
+
+
+/*
+ * Return output row y of the given pass.
+ */
+static const Q8 *vpass_row(VPass *v, HPass *h, int y) {
+    int width = h->width;
+
+    if (v->weights != NULL) {
+        // Pull in the bottom row before looking at the others.
+        vpass_input(v, h, y + v->radius);
+        memset(v->sums, 0, sizeof(uint32_t) * width);
+        for (int k = -v->radius; k <= v->radius; k++) {
+            const Q8 *row = vpass_input(v, h, y + k);
+            int w = v->weights[k + v->radius];
+            for (int i = 0; i < width; i++) {
+                v->sums[i] += w * row[i];
+            }
+        }
+        for (int i = 0; i < width; i++) {
+            v->out[i] = (v->sums[i] + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+        }
+        return v->out;
+    }
+
+    int size = 2 * v->radius + 1;
+    if (v->sum_row == -1) {
+        memset(v->sums, 0, sizeof(uint32_t) * width);
+        for (int k = -v->radius; k <= v->radius; k++) {
+            const Q8 *row = vpass_input(v, h, y + k);
+            for (int i = 0; i < width; i++) {
+                v->sums[i] += row[i];
+            }
+        }
+    } else {
+        // Slide the window down by one row.
+        const Q8 *entering = vpass_input(v, h, y + v->radius);
+        const Q8 *leaving = vpass_input(v, h, y - v->radius - 1);
+        for (int i = 0; i < width; i++) {
+            v->sums[i] += entering[i] - leaving[i];
+        }
+    }
+    v->sum_row = y;
+    for (int i = 0; i < width; i++) {
+        v->out[i] = (v->sums[i] + size / 2) / size;
+    }
+    return v->out;
+}
+
+
+/*
+ * Blur one tile; arg points to the Blur.
+ */
+static void blur_tile(void *arg, Tile *tile) {
+    const Blur *blur = arg;
+    int radius = blur->radius;
+    int n = blur->channels;
+    int width = n * tile->in_width;
+    HPass h = {
+        .tile = tile,
+        .channels = n,
+        .width = width,
+        .height = tile->image_height,
+        .radius = radius,
+    };
+
+    VPass *last = NULL;
+    if (radius <= MAX_GAUSSIAN_RADIUS) {
+        h.weights = blur->weights;
+        h.scratch[0] = malloc(sizeof(int32_t) * (width + 2 * n * radius));
+        h.scratch[1] = malloc(sizeof(int32_t) * width);
+        last = vpass_create(NULL, radius, blur->weights, width);
+    } else {
+        h.boxes = blur->boxes;
+        h.scratch[0] = malloc(sizeof(int32_t) * width);
+        h.scratch[1] = malloc(sizeof(int32_t) * width);
+        for (int i = 0; i < NUM_BOXES; i++) {
+            last = vpass_create(last, blur->boxes[i], NULL, width);
+        }
+    }
+    vpass_start(last, tile->y);
+    VPass *first = last;
+    while (first->prev != NULL) {
+        first = first->prev;
+    }
+
+    int skip = n * (tile->x - tile->in_x);
+    for (int y = tile->y; y < tile->y + tile->height; y++) {
+        const Q8 *row = vpass_row(last, &h, y) + skip;
+        unsigned char *bytes = (unsigned char *) tile_output_row(tile, y);
+        for (int i = 0; i < n * tile->width; i++) {
+            bytes[i] = (row[i] + 128) >> 8;
+        }
+        // Input rows are only read once, by the horizontal pass.
+        release_tile_rows(tile, y + 1, first->next_in);
+    }
+
+    while (last != NULL) {
+        VPass *prev = last->prev;
+        vpass_free(last);
+        last = prev;
+    }
+    free(h.scratch[0]);
+    free(h.scratch[1]);
+}
+
+
+/*
+ * Set up blur for the given radius, and return how far its input reaches
+ * (the halo of a tile). Set *column_bytes to what a tile of it takes per
+ * column of input.
+ */
+static int setup_blur(Blur *blur, int channels, int radius, size_t *column_bytes) {
+    *blur = (Blur) {.channels = channels, .radius = radius};
+    // A tile's input reaches as far as all the passes together do, in
+    // both directions; and each column of it takes the horizontal pass's
+    // two rows, and the rows each vertical pass keeps.
+    int halo = 0;
+    size_t bytes = channels * 2 * sizeof(int32_t);
+    if (radius <= MAX_GAUSSIAN_RADIUS) {
+        gaussian_weights(blur->weights, radius);
+        halo = radius;
+        bytes += channels * (sizeof(Q8) * (ring_size(radius, blur->weights) + 1) +
+                             sizeof(uint32_t));
+    } else {
+        box_radii(blur->boxes, radius);
+        for (int i = 0; i < NUM_BOXES; i++) {
+            halo += blur->boxes[i];
+            bytes += channels * (sizeof(Q8) * (ring_size(blur->boxes[i], NULL) + 1) +
+                                 sizeof(uint32_t));
+        }
+    }
+    *column_bytes = bytes;
+    return halo;
+}
+
+
+void separable_blur_filter(Bitmap *bmp, int radius) {
+    Blur blur;
+    size_t column_bytes;
+    int halo = setup_blur(&blur, 3, radius, &column_bytes);
+    run_tiled(bmp, halo, column_bytes, blur_tile, &blur);
+}
+
+
+// The bands of the planes of one planar blur; shared by the threads.
+typedef struct {
+    const Blur *blur;
+    const PlanarImage *in;
+    PlanarImage *out;
+    int bands;               // Per plane.
+} PlanarBlur;
+
+
+/*
+ * Blur band task % bands of plane task / bands. Every band looks at the
+ * whole plane, so it is a tile as wide as the image, with all of the input.
+ */
+static void blur_plane_band(void *arg, int task) {
+    PlanarBlur *job = arg;
+    int width = job->in->width;
+    int height = job->in->height;
+    int plane = task / job->bands;
+    int band = task % job->bands;
+    int y0 = (long) height * band / job->bands;
+    int y1 = (long) height * (band + 1) / job->bands;
+    Tile tile = {
+        .y = y0, .width = width, .height = y1 - y0,
+        .in_width = width, .in_height = height,
+        .image_width = width, .image_height = height,
+        .in = job->in->planes[plane], .in_stride = width,
+        .out = job->out->planes[plane] + (size_t) y0 * width, .out_stride = width,
+        .released = y0,
+    };
+    blur_tile((void *) job->blur, &tile);
+}
+
+
+void separable_blur_planar(const PlanarImage *in, PlanarImage *out, int radius) {
+    Blur blur;
+    size_t column_bytes;
+    setup_blur(&blur, 1, radius, &column_bytes);
+    ThreadPool *pool = get_filter_pool();
+    PlanarBlur job = {.blur = &blur, .in = in, .out = out, .bands = 1};
+    if (pool == NULL) {
+        for (int plane = 0; plane < 3; plane++) {
+            blur_plane_band(&job, plane);
+        }
+        return;
+    }
+    // A few bands per thread, but none much shorter than the blur reaches,
+    // as every band works out the rows above it again.
+    job.bands = max(1, min(2 * get_filter_threads(), in->height / max(4 * radius, 16)));
+    pool_run(pool, blur_plane_band, &job, 3 * job.bands);
+}
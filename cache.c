@@ -0,0 +1,343 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define MAX_HASHED_IMAGES 64
+#define MAX_OPEN_RESULTS 64
+
+// Bump this when the output of any filter changes, to ignore old results.
+#define CACHE_VERSION "1"
+
+#define PRIME1 0x9e3779b97f4a7c15ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+
+
+// The content hash of an image file, as of the given size and mtime.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t hash[2];
+    unsigned long last_used;
+} HashedImage;
+
+// A result file in CACHE_DIR, as seen when trimming it.
+typedef struct {
+    char name[40];
+    off_t size;
+    struct timespec mtime;
+} DiskResult;
+
+// A result kept open in memory.
+typedef struct {
+    CacheKey key;
+    int fd;                  // Our own descriptor for the result.
+    off_t size;
+    unsigned long last_used;
+} OpenResult;
+
+static HashedImage hashed[MAX_HASHED_IMAGES];
+static int num_hashed = 0;
+static OpenResult results[MAX_OPEN_RESULTS];
+static int num_results = 0;
+static off_t results_bytes = 0;
+static unsigned long uses = 0;      // Counts uses, for the LRU order.
+
+
+/******************************************************************************
+ * Hashing.
+ *****************************************************************************/
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/*
+ * Mix len bytes of data into the 128-bit hash h, 16 bytes at a time.
+ */
+static void hash_bytes(uint64_t h[2], const unsigned char *data, size_t len) {
+    uint64_t a, b;
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        memcpy(&a, data + i, 8);
+        memcpy(&b, data + i + 8, 8);
+        h[0] = rotl(h[0] ^ a * PRIME1, 31) * PRIME2 + h[1];
+        h[1] = rotl(h[1] ^ b * PRIME2, 29) * PRIME1 + h[0];
+    }
+    unsigned char tail[16] = {0};
+    memcpy(tail, data + i, len - i);
+    memcpy(&a, tail, 8);
+    memcpy(&b, tail + 8, 8);
+    h[0] = rotl(h[0] ^ a * PRIME1, 31) * PRIME2 + h[1];
+    h[1] = rotl(h[1] ^ b * PRIME2, 29) * PRIME1 + h[0];
+    h[0] = finish(h[0] ^ len);
+    h[1] = finish(h[1] ^ h[0]);
+}
+
+
+/*
+ * Set h to the hash of the contents of the file open on fd, remembering it
+ * for next time.
+ */
+static int hash_image(uint64_t h[2], int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    uses++;
+    HashedImage *slot = &hashed[0];
+    for (int i = 0; i < num_hashed; i++) {
+        HashedImage *img = &hashed[i];
+        if (img->dev == st.st_dev && img->ino == st.st_ino && img->size == st.st_size &&
+            img->mtime.tv_sec == st.st_mtim.tv_sec && img->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            img->last_used = uses;
+            memcpy(h, img->hash, sizeof(img->hash));
+            return 0;
+        }
+        if (img->last_used < slot->last_used) {
+            slot = img;
+        }
+    }
+
+    h[0] = PRIME1;
+    h[1] = PRIME2;
+    if (st.st_size > 0) {
+        unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        hash_bytes(h, data, st.st_size);
+        munmap(data, st.st_size);
+    }
+
+    if (num_hashed < MAX_HASHED_IMAGES) {
+        slot = &hashed[num_hashed++];
+    }
+    *slot = (HashedImage) {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime = st.st_mtim,
+        .hash = {h[0], h[1]},
+        .last_used = uses,
+    };
+    return 0;
+}
+
+
+int cache_key(CacheKey *key, int image_fd, const char *filter) {
+    if (hash_image(key->hash, image_fd) == -1) {
+        return -1;
+    }
+    // A NUL separates the version from the filter, so neither can be
+    // mistaken for part of the other.
+    char extra[strlen(CACHE_VERSION) + 1 + strlen(filter)];
+    memcpy(extra, CACHE_VERSION, strlen(CACHE_VERSION) + 1);
+    memcpy(extra + strlen(CACHE_VERSION) + 1, filter, strlen(filter));
+    hash_bytes(key->hash, (const unsigned char *) extra, sizeof(extra));
+    return 0;
+}
+
+
+/******************************************************************************
+ * The results.
+ *****************************************************************************/
+static void result_path(char *path, const CacheKey *key) {
+    sprintf(path, CACHE_DIR "%016llx%016llx.bmp",
+            (unsigned long long) key->hash[0], (unsigned long long) key->hash[1]);
+}
+
+
+static void drop_result(OpenResult *result) {
+    close(result->fd);
+    results_bytes -= result->size;
+    *result = results[--num_results];
+}
+
+
+/*
+ * Keep a descriptor for the result open, evicting the least recently used
+ * results to stay within CACHE_MEMORY_BYTES.
+ */
+static void keep_result(const CacheKey *key, int fd, off_t size) {
+    if (size > CACHE_MEMORY_BYTES) {
+        return;
+    }
+    while (num_results > 0 &&
+           (num_results == MAX_OPEN_RESULTS || results_bytes + size > CACHE_MEMORY_BYTES)) {
+        OpenResult *oldest = &results[0];
+        for (int i = 1; i < num_results; i++) {
+            if (results[i].last_used < oldest->last_used) {
+                oldest = &results[i];
+            }
+        }
+        drop_result(oldest);
+    }
+    int kept = dup(fd);
+    if (kept == -1) {
+        return;
+    }
+    results[num_results++] = (OpenResult) {*key, kept, size, ++uses};
+    results_bytes += size;
+}
+
+
+int cache_lookup(const CacheKey *key, off_t *size) {
+    for (int i = 0; i < num_results; i++) {
+        if (memcmp(&results[i].key, key, sizeof(CacheKey)) == 0) {
+            results[i].last_used = ++uses;
+            *size = results[i].size;
+            return dup(results[i].fd);
+        }
+    }
+
+    char path[sizeof(CACHE_DIR) + 36];
+    result_path(path, key);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    // Mark the result as recently used, for trim_results.
+    futimens(fd, NULL);
+    keep_result(key, fd, st.st_size);
+    return fd;
+}
+
+
+static int compare_mtimes(const void *a, const void *b) {
+    const struct timespec *x = &((const DiskResult *) a)->mtime;
+    const struct timespec *y = &((const DiskResult *) b)->mtime;
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+
+/*
+ * Delete the oldest results in CACHE_DIR until the rest fit in
+ * CACHE_DISK_BYTES. Other processes may be doing the same, so results that
+ * are already gone are skipped.
+ */
+static void trim_results(void) {
+    DIR *dir = opendir(CACHE_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    DiskResult *found = NULL;
+    int num_found = 0, capacity = 0;
+    off_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Only finished results; a tmp. file is someone's store under way.
+        size_t len = strlen(entry->d_name);
+        if (len >= sizeof(found->name) || len < 4 || strcmp(entry->d_name + len - 4, ".bmp") != 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (num_found == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            DiskResult *grown = realloc(found, sizeof(DiskResult) * capacity);
+            if (grown == NULL) {
+                perror("realloc");
+                break;
+            }
+            found = grown;
+        }
+        DiskResult *result = &found[num_found++];
+        strcpy(result->name, entry->d_name);
+        result->size = st.st_size;
+        result->mtime = st.st_mtim;
+        total += st.st_size;
+    }
+
+    if (total > CACHE_DISK_BYTES) {
+        qsort(found, num_found, sizeof(DiskResult), compare_mtimes);
+        for (int i = 0; i < num_found && total > CACHE_DISK_BYTES; i++) {
+            if (unlinkat(dirfd(dir), found[i].name, 0) == 0 || errno == ENOENT) {
+                total -= found[i].size;
+            }
+        }
+    }
+    free(found);
+    closedir(dir);
+}
+
+
+void cache_store(const CacheKey *key, int fd, off_t size) {
+    keep_result(key, fd, size);
+
+    // Write to a temporary file first, so that other processes only ever
+    // see complete results.
+    if (mkdir(CACHE_DIR, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return;
+    }
+    char tmp[] = CACHE_DIR "tmp.XXXXXX";
+    int out = mkstemp(tmp);
+    if (out == -1) {
+        perror("mkstemp");
+        return;
+    }
+    off_t offset = 0;
+    while (offset < size) {
+        if (sendfile(out, fd, &offset, size - offset) <= 0) {
+            perror("sendfile");
+            close(out);
+            unlink(tmp);
+            return;
+        }
+    }
+    close(out);
+    char path[sizeof(CACHE_DIR) + 36];
+    result_path(path, key);
+    if (rename(tmp, path) == -1) {
+        perror("rename");
+        unlink(tmp);
+        return;
+    }
+    trim_results();
+}
+
+
+void cache_invalidate(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return;
+    }
+    for (int i = 0; i < num_hashed; i++) {
+        if (hashed[i].dev == st.st_dev && hashed[i].ino == st.st_ino) {
+            hashed[i] = hashed[--num_hashed];
+            return;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_DIR "cache/"
+
+/*
+ * A content-addressed cache of filter results.
+ *
+ * A result is stored under a key made from a hash of the input image's
+ * contents and the filter (with its parameters), so a result stays valid
+ * for as long as an image with the same contents exists, whatever its name.
+ * Results are kept as files in CACHE_DIR, and each process also keeps the
+ * most recently used ones open (up to CACHE_MEMORY_BYTES of them), so that
+ * a hit is a lookup and a sendfile away.
+ *
+ * CACHE_DIR is kept within CACHE_DISK_BYTES: storing a result that takes it
+ * over evicts the results least recently stored or found there (a hit on
+ * a file touches its modification time), oldest first.
+ *
+ * Hashing an image means reading all of it, so every process remembers the
+ * hash of the images it has seen, by inode, size and modification time.
+ * A file that changes in any way is therefore hashed again.
+ *
+ * The hash is fast, not cryptographic.
+ */
+#define CACHE_MEMORY_BYTES (64 << 20)
+#define CACHE_DISK_BYTES ((off_t) 1 << 30)
+
+typedef struct {
+    uint64_t hash[2];
+} CacheKey;
+
+/*
+ * Set key to the key for filtering the image open on image_fd with the
+ * given filter (e.g. "gaussian_blur 5"). Return 0 on success and -1 if the
+ * image can't be read.
+ */
+int cache_key(CacheKey *key, int image_fd, const char *filter);
+
+/*
+ * Return a new descriptor for the cached result with the given key and set
+ * *size to its size, or return -1 if there is no such result.
+ */
+int cache_lookup(const CacheKey *key, off_t *size);
+
+/*
+ * Store the first size bytes of the file open on fd as the result with the
+ * given key. The in-memory cache may keep its own descriptor for the file;
+ * the caller still closes fd.
+ */
+void cache_store(const CacheKey *key, int fd, off_t size);
+
+/*
+ * Forget what this process knows about the image at path, which is being
+ * replaced. (Other processes notice the change when they next stat it.)
+ */
+void cache_invalidate(const char *path);
+
+#endif /* CACHE_H_*/
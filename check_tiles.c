@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "pipeline.h"
+
+/*
+ * A check that the tiled filters (see run_tiled) give exactly the same
+ * image whatever the memory budget.
+ *
+ * Each filter is run on synthetic images of every height from 3 to
+ * MAX_HEIGHT, read both as a stream and through a mapping, with budgets
+ * small enough to cut them into bands; the result must match the one made
+ * with the whole image in a single band. The heights cover every remainder
+ * of the band heights the budgets give, including the ones that leave a
+ * last band a single row tall. The threads come from IMAGE_FILTER_THREADS,
+ * as usual.
+ *
+ * Every case that differs is printed, and the exit status is 1 if any do.
+ */
+
+#define MAX_HEIGHT 70
+
+static const char *const filters[] = {"gaussian_blur", "gaussian_blur 3", "edge_detection"};
+static const int widths[] = {41, 300};
+static const size_t budgets[] = {1 << 10, 4 << 10, 16 << 10};
+
+#define COUNT(array) ((int) (sizeof(array) / sizeof(array[0])))
+
+
+/*
+ * Make a width by height 24-bit BMP in memory, with noise in every channel
+ * so that no two rows are alike. Set *size to its size.
+ */
+static unsigned char *make_image(int width, int height, size_t *size) {
+    int row_bytes = BMP_ROW_BYTES(width);
+    int header_size = 54, info_size = 40, image_size = row_bytes * height;
+    int file_size = header_size + image_size;
+    short planes = 1, bits_per_pixel = 24;
+    unsigned char *image = calloc(file_size, 1);
+    if (image == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    image[0] = 'B';
+    image[1] = 'M';
+    memcpy(image + BMP_FILE_SIZE_OFFSET, &file_size, sizeof(int));
+    memcpy(image + BMP_HEADER_SIZE_OFFSET, &header_size, sizeof(int));
+    memcpy(image + 14, &info_size, sizeof(int));  // BITMAPINFOHEADER
+    memcpy(image + BMP_WIDTH_OFFSET, &width, sizeof(int));
+    memcpy(image + BMP_HEIGHT_OFFSET, &height, sizeof(int));
+    memcpy(image + 26, &planes, sizeof(short));
+    memcpy(image + BMP_BITS_PER_PIXEL_OFFSET, &bits_per_pixel, sizeof(short));
+    memcpy(image + 34, &image_size, sizeof(int));
+
+    unsigned int noise = 12345 + width * MAX_HEIGHT + height;
+    for (int r = 0; r < height; r++) {
+        unsigned char *row = image + header_size + (size_t) r * row_bytes;
+        for (int i = 0; i < 3 * width; i++) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            row[i] = noise >> 8;
+        }
+    }
+    *size = file_size;
+    return image;
+}
+
+
+/*
+ * Run stage on the image with the given memory budget, reading it through
+ * a mapping if mapped is set, and as a stream otherwise. Return the
+ * resulting file, and set *out_size to its size.
+ */
+static char *filter_image(const FilterStage *stage, unsigned char *image, size_t size,
+                          int mapped, size_t budget, size_t *out_size) {
+    FILE *in;
+    if (mapped) {
+        in = tmpfile();
+        if (in == NULL || fwrite(image, 1, size, in) != size || fflush(in) != 0) {
+            perror("tmpfile");
+            exit(1);
+        }
+        rewind(in);
+    } else {
+        in = fmemopen(image, size, "rb");
+    }
+    char *result;
+    FILE *out = open_memstream(&result, out_size);
+    if (in == NULL || out == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    set_filter_memory(budget);
+    run_pipeline(stage, 1, in, out);
+    fclose(in);
+    fclose(out);
+    return result;
+}
+
+
+int main(void) {
+    int failures = 0, runs = 0;
+    for (int f = 0; f < COUNT(filters); f++) {
+        FilterStage stage;
+        if (parse_stage(filters[f], &stage) == -1) {
+            fprintf(stderr, "Unknown filter: %s\n", filters[f]);
+            exit(1);
+        }
+        for (int w = 0; w < COUNT(widths); w++) {
+            for (int height = 3; height <= MAX_HEIGHT; height++) {
+                size_t size, expected_size;
+                unsigned char *image = make_image(widths[w], height, &size);
+                char *expected = filter_image(&stage, image, size, 0, (size_t) 256 << 20,
+                                              &expected_size);
+                for (int b = 0; b < COUNT(budgets); b++) {
+                    for (int mapped = 0; mapped <= 1; mapped++) {
+                        size_t result_size;
+                        char *result = filter_image(&stage, image, size, mapped, budgets[b],
+                                                    &result_size);
+                        runs++;
+                        if (result_size != expected_size ||
+                            memcmp(result, expected, expected_size) != 0) {
+                            printf("DIFF %s %dx%d budget=%zu %s\n", filters[f], widths[w],
+                                   height, budgets[b], mapped ? "mapped" : "stream");
+                            failures++;
+                        }
+                        free(result);
+                    }
+                }
+                free(expected);
+                free(image);
+            }
+        }
+    }
+    printf("%d runs, %d differ (%d threads)\n", runs, failures, get_filter_threads());
+    return failures > 0;
+}
@@ -0,0 +1,355 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/******************************************************************************
+ * Reading BMP files that aren't 24-bit.
+ *
+ * A 32-bit row is 4 bytes a pixel (blue, green, red and alpha, or unused),
+ * so converting it drops every fourth byte. An 8-bit row is an index into a
+ * palette of up to 256 colours, each stored as blue, green, red and a
+ * reserved byte; the palette is kept in that form, so looking up a pixel
+ * gives a 4-byte pixel too (AVX2 gathers 8 at a time). Either way, vectors
+ * of 4-byte pixels are squeezed down to 3 bytes a pixel with byte shuffles.
+ *****************************************************************************/
+
+// Values of the compression field.
+#define BI_RGB 0
+#define BI_BITFIELDS 3
+#define BI_ALPHABITFIELDS 6
+
+// The colour masks of a 32-bit image that BI_RGB would have implied.
+#define RED_MASK 0x00ff0000
+#define GREEN_MASK 0x0000ff00
+#define BLUE_MASK 0x000000ff
+
+// The offsets, from the start of the info header, of a BITMAPV5HEADER's
+// colour space and ICC profile fields.
+#define V5_HEADER_SIZE 124
+#define V5_CS_TYPE_OFFSET 56
+#define V5_PROFILE_DATA_OFFSET 112
+#define V5_PROFILE_SIZE_OFFSET 116
+#define LCS_SRGB 0x73524742          // 'sRGB'
+#define PROFILE_LINKED 0x4c494e4b    // 'LINK'
+#define PROFILE_EMBEDDED 0x4d424544  // 'MBED'
+
+
+static int read_int(const unsigned char *data, int offset) {
+    int value;
+    memcpy(&value, data + offset, sizeof(int));
+    return value;
+}
+
+
+static void write_int(unsigned char *data, int offset, int value) {
+    memcpy(data + offset, &value, sizeof(int));
+}
+
+
+/*
+ * The size of a row of the given width in the given format, with padding.
+ */
+static size_t row_bytes(int width, BmpPixelFormat format) {
+    switch (format) {
+    case BMP_BGRA32:
+        return (size_t) width * 4;
+    case BMP_PALETTE8:
+        return ((size_t) width + 3) & ~(size_t) 3;
+    default:
+        return BMP_ROW_BYTES((size_t) width);
+    }
+}
+
+
+int parse_bmp_info(const unsigned char *data, int len, BmpInfo *info) {
+    if (len < BMP_HEIGHT_OFFSET + (int) sizeof(int) || data[0] != 'B' || data[1] != 'M') {
+        return -1;
+    }
+    int header_size = read_int(data, BMP_HEADER_SIZE_OFFSET);
+    int width = read_int(data, BMP_WIDTH_OFFSET);
+    int height = read_int(data, BMP_HEIGHT_OFFSET);
+    if (header_size < BMP_HEIGHT_OFFSET + (int) sizeof(int) ||
+            width <= 0 || width > (INT_MAX - 3) / 4 || height == 0 || height == INT_MIN) {
+        return -1;
+    }
+
+    // The oldest headers stop after the height, and are taken to be 24-bit.
+    short bits_per_pixel = 24;
+    int compression = BI_RGB;
+    if (header_size >= BMP_BITS_PER_PIXEL_OFFSET + (int) sizeof(short)) {
+        if (len < BMP_COMPRESSION_OFFSET) {
+            return -1;
+        }
+        memcpy(&bits_per_pixel, data + BMP_BITS_PER_PIXEL_OFFSET, sizeof(short));
+    }
+    if (header_size >= BMP_COMPRESSION_OFFSET + (int) sizeof(int)) {
+        if (len < BMP_COMPRESSION_OFFSET + (int) sizeof(int)) {
+            return -1;
+        }
+        compression = read_int(data, BMP_COMPRESSION_OFFSET);
+    }
+
+    info->header_size = header_size;
+    info->width = width;
+    info->height = height < 0 ? -height : height;
+    info->top_down = height < 0;
+    info->palette_offset = 0;
+    info->palette_size = 0;
+    if (bits_per_pixel == 24 && compression == BI_RGB) {
+        info->format = BMP_BGR24;
+        info->row_bytes = row_bytes(width, BMP_BGR24);
+        return 0;
+    }
+
+    // Anything else has its header rewritten, so it has to be all there.
+    int info_size = read_int(data, BMP_INFO_SIZE_OFFSET);
+    if (len < BMP_MASKS_OFFSET || info_size < BMP_MASKS_OFFSET - BMP_INFO_SIZE_OFFSET ||
+            info_size > header_size - BMP_INFO_SIZE_OFFSET) {
+        return -1;
+    }
+    if (bits_per_pixel == 32 && compression == BI_RGB) {
+        info->format = BMP_BGRA32;
+    } else if (bits_per_pixel == 32 &&
+               (compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS)) {
+        // Only the masks that mean the same as BI_RGB.
+        if (len < BMP_INFO_BYTES || header_size < BMP_INFO_BYTES ||
+                read_int(data, BMP_MASKS_OFFSET) != RED_MASK ||
+                read_int(data, BMP_MASKS_OFFSET + 4) != GREEN_MASK ||
+                read_int(data, BMP_MASKS_OFFSET + 8) != BLUE_MASK) {
+            return -1;
+        }
+        info->format = BMP_BGRA32;
+    } else if (bits_per_pixel == 8 && compression == BI_RGB) {
+        // The palette follows the info header; 0 colours means all 256.
+        int colours = read_int(data, BMP_COLORS_USED_OFFSET);
+        if (colours == 0) {
+            colours = 256;
+        }
+        int offset = BMP_INFO_SIZE_OFFSET + info_size;
+        if (colours < 0 || colours > 256 || colours > (header_size - offset) / 4) {
+            return -1;
+        }
+        info->format = BMP_PALETTE8;
+        info->palette_offset = offset;
+        info->palette_size = colours;
+    } else {
+        return -1;
+    }
+    info->row_bytes = row_bytes(width, info->format);
+    return 0;
+}
+
+
+void set_input_format(Bitmap *bmp, const BmpInfo *info) {
+    bmp->in.format = info->format;
+    bmp->in.palette = bmp->palette;
+    if (info->format == BMP_BGR24) {
+        return;
+    }
+    if (info->format == BMP_PALETTE8) {
+        // Indices past the end of the palette are black.
+        memset(bmp->palette, 0, sizeof(bmp->palette));
+        memcpy(bmp->palette, bmp->header + info->palette_offset, 4 * info->palette_size);
+    }
+
+    // The output is 24-bit, so it keeps just the file and info headers,
+    // without a palette, masks or an ICC profile, and says so.
+    unsigned char *header = bmp->header;
+    int info_size = read_int(header, BMP_INFO_SIZE_OFFSET);
+    int header_size = BMP_INFO_SIZE_OFFSET + info_size;
+    short bits_per_pixel = 24;
+    memcpy(header + BMP_BITS_PER_PIXEL_OFFSET, &bits_per_pixel, sizeof(short));
+    write_int(header, BMP_COMPRESSION_OFFSET, BI_RGB);
+    write_int(header, BMP_COLORS_USED_OFFSET, 0);
+    write_int(header, BMP_COLORS_IMPORTANT_OFFSET, 0);
+    if (info_size >= V5_HEADER_SIZE) {
+        unsigned char *v5 = header + BMP_INFO_SIZE_OFFSET;
+        int cs_type = read_int(v5, V5_CS_TYPE_OFFSET);
+        if (cs_type == PROFILE_LINKED || cs_type == PROFILE_EMBEDDED) {
+            write_int(v5, V5_CS_TYPE_OFFSET, LCS_SRGB);
+        }
+        write_int(v5, V5_PROFILE_DATA_OFFSET, 0);
+        write_int(v5, V5_PROFILE_SIZE_OFFSET, 0);
+    }
+    int image_size = BMP_ROW_BYTES(bmp->width) * bmp->height;
+    write_int(header, BMP_IMAGE_SIZE_OFFSET, image_size);
+    write_int(header, BMP_HEADER_SIZE_OFFSET, header_size);
+    write_int(header, BMP_FILE_SIZE_OFFSET, header_size + image_size);
+    bmp->headerSize = header_size;
+}
+
+
+/******************************************************************************
+ * Converting rows.
+ *
+ * Each kernel converts n pixels of in to 3-byte pixels in out. The vector
+ * versions store whole vectors, which may run past the last pixel they
+ * convert, so they stop early enough to stay inside the row and leave the
+ * rest to the scalar versions.
+ *****************************************************************************/
+typedef int (*UnpackKernel)(unsigned char *out, const unsigned char *in, int n,
+                            const uint32_t *palette);
+
+static void bgra_scalar(unsigned char *out, const unsigned char *in, int n) {
+    for (int i = 0; i < n; i++) {
+        out[3 * i] = in[4 * i];
+        out[3 * i + 1] = in[4 * i + 1];
+        out[3 * i + 2] = in[4 * i + 2];
+    }
+}
+
+static void palette_scalar(unsigned char *out, const unsigned char *in, int n,
+                           const uint32_t *palette) {
+    // Every store but the last one's runs a byte into the next pixel, which
+    // the next store puts right.
+    int i = 0;
+    for (; i + 1 < n; i++) {
+        memcpy(out + 3 * i, &palette[in[i]], sizeof(uint32_t));
+    }
+    if (i < n) {
+        memcpy(out + 3 * i, &palette[in[i]], 3);
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// Squeezes 4 pixels of 4 bytes into the first 12 bytes (of each lane).
+#define SQUEEZE_BYTES 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static int bgra_ssse3(unsigned char *out, const unsigned char *in, int n,
+                      const uint32_t *palette) {
+    const __m128i squeeze = _mm_setr_epi8(SQUEEZE_BYTES);
+    int i = 0;
+    // Each 16-byte store has 12 bytes of pixels.
+    for (; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + 4 * i));
+        _mm_storeu_si128((__m128i *) (out + 3 * i), _mm_shuffle_epi8(v, squeeze));
+    }
+    return i;
+}
+
+/*
+ * Squeeze 8 pixels of 4 bytes into the first 24 bytes of a vector: each
+ * lane's 12 bytes, and then the two lanes' together.
+ */
+__attribute__((target("avx2")))
+static __m256i squeeze_avx2(__m256i v) {
+    const __m256i squeeze = _mm256_setr_epi8(SQUEEZE_BYTES, SQUEEZE_BYTES);
+    const __m256i together = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    return _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, squeeze), together);
+}
+
+__attribute__((target("avx2")))
+static int bgra_avx2(unsigned char *out, const unsigned char *in, int n,
+                     const uint32_t *palette) {
+    int i = 0;
+    // Each 32-byte store has 24 bytes of pixels.
+    for (; i + 11 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + 4 * i));
+        _mm256_storeu_si256((__m256i *) (out + 3 * i), squeeze_avx2(v));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int palette_avx2(unsigned char *out, const unsigned char *in, int n,
+                        const uint32_t *palette) {
+    int i = 0;
+    for (; i + 11 <= n; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in + i)));
+        __m256i v = _mm256_i32gather_epi32((const int *) palette, index, 4);
+        _mm256_storeu_si256((__m256i *) (out + 3 * i), squeeze_avx2(v));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static UnpackKernel bgra_bytes = NULL;
+static UnpackKernel palette_bytes = NULL;
+
+/*
+ * Pick the widest kernels the CPU supports, unless IMAGE_FILTER_SIMD asks
+ * for something narrower (see kernels.c).
+ */
+__attribute__((constructor))
+static void pick_unpack_kernels(void) {
+#ifdef HAVE_X86_SIMD
+    const char *force = getenv("IMAGE_FILTER_SIMD");
+    __builtin_cpu_init();
+    if (force != NULL && strcmp(force, "scalar") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2") &&
+        (force == NULL || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0)) {
+        bgra_bytes = bgra_avx2;
+        palette_bytes = palette_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        bgra_bytes = bgra_ssse3;
+    }
+#endif
+}
+
+
+static void unpack_row(unsigned char *out, const unsigned char *in, int width,
+                       const PixelStream *stream) {
+    int i = 0;
+    if (stream->format == BMP_BGRA32) {
+        if (bgra_bytes != NULL) {
+            i = bgra_bytes(out, in, width, NULL);
+        }
+        bgra_scalar(out + 3 * i, in + 4 * i, width - i);
+    } else {
+        if (palette_bytes != NULL) {
+            i = palette_bytes(out, in, width, stream->palette);
+        }
+        palette_scalar(out + 3 * i, in + i, width - i, stream->palette);
+    }
+}
+
+
+void decode_rows(PixelStream *in, int width, Pixel *rows, int n) {
+    size_t src_bytes = row_bytes(width, in->format);
+    size_t dst_bytes = (size_t) width * sizeof(Pixel);
+    unsigned char *out = (unsigned char *) rows;
+
+    if (in->data != NULL) {
+        const unsigned char *src = in->data + (size_t) in->row * src_bytes;
+        for (int i = 0; i < n; i++) {
+            unpack_row(out + i * dst_bytes, src + i * src_bytes, width, in);
+        }
+        in->row += n;
+        return;
+    }
+
+    // Rows from a stream are read a block at a time.
+    int block = min(n, max(1, IO_BLOCK_BYTES / (int) src_bytes));
+    unsigned char *buf = malloc(block * src_bytes);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int done = 0; done < n; done += block) {
+        int count = min(block, n - done);
+        if (fread(buf, src_bytes, count, in->fp) != count) {
+            perror("fread");
+            exit(1);
+        }
+        for (int i = 0; i < count; i++) {
+            unpack_row(out + (done + i) * dst_bytes, buf + i * src_bytes, width, in);
+        }
+    }
+    free(buf);
+    in->row += n;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Adds to the brightness of every channel and stretches its contrast (see
+ * brightness_contrast_op in pointops.c).
+ */
+void brightness_contrast_filter(Bitmap *bmp) {
+    point_filter(bmp, brightness_contrast_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main(int argc, char** argv) {
+    // The brightness to add (-255 to 255), and optionally the contrast to add,
+    // in percent (at least -100).
+    double params[MAX_POINT_PARAMS];
+    PointOp op;
+    int n = parse_point_params(params, argv + 1, argc - 1);
+    if(n == -1 || brightness_contrast_op(&op, params, n) == -1){
+        fprintf(stderr, "Usage: brightness_contrast brightness [contrast]\n");
+        return 1;
+    }
+    run_point_filter(brightness_contrast_filter, params, n);
+    return 0;
+}
+#endif
@@ -1,30 +1,45 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bitmap.h"
 
 
 /*
  * Main filter loop.
  * This function is responsible for doing the following:
- *   1. Read in pixels one at a time (because copy is a pixel-by-pixel transformation).
- *   2. Immediately write out each pixel.
+ *   1. Read in a block of rows at a time (copy is a pixel-by-pixel transformation,
+ *      so any number of rows can be handled at once).
+ *   2. Immediately write out each block.
  */
 void copy_filter(Bitmap *bmp) {
-    for(int i = 0; i < bmp->height * bmp->width; i++){
-    	Pixel pixel;
-    	if(fread(&pixel, 1, sizeof(Pixel), stdin) != sizeof(Pixel)){
-    		perror("fread");
-    		exit(1);
-    	}
-    	if(fwrite(&pixel, 1, sizeof(Pixel), stdout) != sizeof(Pixel)){
-    		perror("fwrite");
-    		exit(1);
-    	}	
+    // If the output rows are directly accessible, read straight into them.
+    Pixel *out = output_rows(bmp, bmp->height);
+    if(out != NULL){
+        read_rows(bmp, out, bmp->height);
+        return;
+    }
+    int block = rows_per_block(bmp->width);
+    Pixel *rows = alloc_rows(bmp->width, block);
+    for(int i = 0; i < bmp->height; i += block){
+        int n = min(block, bmp->height - i);
+        read_rows(bmp, rows, n);
+        write_rows(bmp, rows, n);
+    }
+    free(rows);
+}
+
+/*
+ * The same filter on a planar image.
+ */
+void copy_planar(const PlanarImage *in, PlanarImage *out, int arg) {
+    for(int ch = 0; ch < 3; ch++){
+        memcpy(out->planes[ch], in->planes[ch], (size_t) in->width * in->height);
     }
-    return;
 }
 
+#ifndef FILTER_LIBRARY
 int main() {
     run_filter(copy_filter, 1);
     return 0;
 }
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bitmap.h"
 
 
@@ -10,113 +11,31 @@ void edge_detection_filter(Bitmap *bmp) {
         fprintf(stderr, "Cannot perform gaussian blur with less than 3 height or width");
         exit(1);
     }
-    int width = bmp->width;
-    int height = bmp->height;
-
-    int i;
-    //allocates memory for 3 rows
-    Pixel **pixel_rows = malloc(sizeof(Pixel *) * 3);
-    //first get the first three rows
-    for(i = 0; i < 3; i++){
-        pixel_rows[i] = malloc(sizeof(Pixel) * width);
-        for(int j = 0; j < width; j++){
-            if(fread(&pixel_rows[i][j], 1, sizeof(Pixel), stdin) != sizeof(Pixel)){
-                perror("fread");
-                exit(1);
-            }
-        }
-    }
-    //write out the first two rows
-    for(int k = 0; k < 2; k++){
-        for(int l = 0; l < width; l++){
-            int row = k;
-            int column = l;
-            if(row == 0){
-                row++;
-            }
-            if(column == 0){
-                column++;
-            } else if(column == width - 1){
-                column--; 
-            }
-
-            Pixel grid[3][3];
-            for(int a = 0; a < 3; a++){
-                for(int b = 0; b < 3; b++){
-                    grid[a][b] = pixel_rows[row + a - 1][column + b - 1];
-                }
-            }
-            Pixel edge = apply_edge_detection_kernel(grid[0], grid[1], grid[2]);
-            if(fwrite(&edge, 1, sizeof(Pixel), stdout) != sizeof(Pixel)){
-                perror("fwrite");
-                exit(1);
-            }
-        }
-    }
-    //in between
-    while(i < height) {
-        //read in new row and shifting one up 
-        for(int l = 0; l < width; l++){
-            pixel_rows[0][l] = pixel_rows[1][l];
-            pixel_rows[1][l] = pixel_rows[2][l];
-            if(fread(&pixel_rows[2][l], 1, sizeof(Pixel), stdin) != sizeof(Pixel)){
-                perror("fread");
-                exit(1);
-            }
-        }
-        for(int c = 0; c < width; c++){
-            int column = c;
-            if(column == 0){
-                column++;
-            } else if(column == width-1){
-                column--;
-            }
-            Pixel grid[3][3]; // create grid for the pixel
-            for(int a = 0; a < 3; a++){
-                for(int b = 0; b < 3; b++){
-                    grid[a][b] = pixel_rows[a][column + b - 1];
-                }
-            }
-            // Get the transformation then write it out immediately
-            Pixel edge = apply_edge_detection_kernel(grid[0], grid[1], grid[2]);
-            if(fwrite(&edge, 1, sizeof(Pixel), stdout) != sizeof(Pixel)){
-                perror("fwrite");
-                exit(1);
-            }
-
-        }
-        i++;
-    }
+    convolve_filter(bmp, edge_detection_row);
+}
 
-    //Case: Last row
-   for(int x = 0; x < width; x++){
-        int column = x;
-        if(column == 0){
-            column++;
-        }else if(column == width-1){
-            column--;
-        }
-        Pixel grid[3][3];
-        for(int a = 0; a < 3; a++){
-            for(int b = 0; b < 3; b++){
-                grid[a][b] = pixel_rows[a][column + b - 1];    
-            }
-        }
-        Pixel edge = apply_edge_detection_kernel(grid[0], grid[1], grid[2]);
-        if(fwrite(&edge, 1, sizeof(Pixel), stdout) != sizeof(Pixel)){
-            perror("fwrite");
-            exit(1);
-        }
+/*
+ * The same filter on a planar image. Every plane gets the same edge values.
+ */
+void edge_detection_planar(const PlanarImage *in, PlanarImage *out, int arg) {
+    int width = in->width;
+    int height = in->height;
+    if(height < 3 || width < 3){
+        fprintf(stderr, "Cannot perform gaussian blur with less than 3 height or width");
+        exit(1);
     }
-
-    for(int m = 0; m < 3; m++){
-        free(pixel_rows[m]);
+    for(int y = 0; y < height; y++){
+        // Border rows use the grid of their inner neighbour.
+        int centre = min(max(y, 1), height - 2);
+        edge_detection_plane_row(out->planes[0] + (size_t) y * width, in, centre);
     }
-    free(pixel_rows);
-
+    memcpy(out->planes[1], out->planes[0], (size_t) width * height);
+    memcpy(out->planes[2], out->planes[0], (size_t) width * height);
 }
 
+#ifndef FILTER_LIBRARY
 int main() {
     run_filter(edge_detection_filter, 1);
     return 0;
 }
+#endif
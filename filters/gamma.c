@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Applies a gamma curve to every channel (see gamma_op in pointops.c).
+ */
+void gamma_filter(Bitmap *bmp) {
+    point_filter(bmp, gamma_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main(int argc, char** argv) {
+    // The gamma (above 0; above 1 brightens the image).
+    double params[MAX_POINT_PARAMS];
+    PointOp op;
+    int n = parse_point_params(params, argv + 1, argc - 1);
+    if(n == -1 || gamma_op(&op, params, n) == -1){
+        fprintf(stderr, "Usage: gamma value\n");
+        return 1;
+    }
+    run_point_filter(gamma_filter, params, n);
+    return 0;
+}
+#endif
@@ -1,37 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bitmap.h"
 
 
 /*
  * Main filter loop.
- * This function is responsible for doing the following:
- *   1. Read in pixels one at a time (because copy is a pixel-by-pixel transformation).
- *   2. Change pixels to the average.
-     3. Write out pixels right after.
-
+ * Greyscale is a point operation (see pointops.c): every channel of a pixel
+ * becomes the average of its three channels.
  */
 void greyscale_filter(Bitmap *bmp) {
-    for(int i = 0; i < bmp->height * bmp->width; i++){
-    	Pixel pixel;
-    	if(fread(&pixel, 1, sizeof(Pixel), stdin) != sizeof(Pixel)){
-    		perror("fread");
-    		exit(1);
-    	}
-        int avg = (pixel.red + pixel.blue + pixel.green) / 3;
-        pixel.red = avg;
-        pixel.blue = avg;
-        pixel.green = avg;
+    point_filter(bmp, greyscale_op);
+}
 
-    	if(fwrite(&pixel, 1, sizeof(Pixel), stdout) != sizeof(Pixel)){
-    		perror("fwrite");
-    		exit(1);
-    	}	
-    }
-    return;
+/*
+ * The same filter on a planar image: average the planes once,
+ * then every plane gets the average.
+ */
+void greyscale_planar(const PlanarImage *in, PlanarImage *out, int arg) {
+    size_t size = (size_t) in->width * in->height;
+    average_planes(out->planes[0], in);
+    memcpy(out->planes[1], out->planes[0], size);
+    memcpy(out->planes[2], out->planes[0], size);
 }
 
+#ifndef FILTER_LIBRARY
 int main() {
     run_filter(greyscale_filter, 1);
     return 0;
 }
+#endif
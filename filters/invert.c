@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Inverts every channel of every pixel (see invert_op in pointops.c).
+ */
+void invert_filter(Bitmap *bmp) {
+    point_filter(bmp, invert_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main() {
+    run_filter(invert_filter, 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Stretches the levels between black and white to the full range, with a
+ * gamma curve (see levels_op in pointops.c).
+ */
+void levels_filter(Bitmap *bmp) {
+    point_filter(bmp, levels_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main(int argc, char** argv) {
+    // The levels that become black and white (0 to 255; white is 255 by
+    // default), and optionally a gamma for the levels in between.
+    double params[MAX_POINT_PARAMS];
+    PointOp op;
+    int n = parse_point_params(params, argv + 1, argc - 1);
+    if(n == -1 || levels_op(&op, params, n) == -1){
+        fprintf(stderr, "Usage: levels black [white [gamma]]\n");
+        return 1;
+    }
+    run_point_filter(levels_filter, params, n);
+    return 0;
+}
+#endif
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Resizes the image to bmp->out_width by bmp->out_height pixels, streaming
+ * the rows through (see resample.c).
+ */
+void resize_filter(Bitmap *bmp) {
+    resample(bmp, bmp->resample);
+}
+
+#ifndef FILTER_LIBRARY
+int main(int argc, char** argv) {
+    // The new width and height (0 to keep the aspect ratio), and optionally
+    // how to resample: area (the default), bilinear or bicubic.
+    if(argc != 3 && argc != 4){
+        fprintf(stderr, "Usage: resize width height [area|bilinear|bicubic]\n");
+        return 1;
+    }
+    int width = strtol(argv[1], NULL, 10);
+    int height = strtol(argv[2], NULL, 10);
+    ResampleMethod method = RESAMPLE_AREA;
+    if(width < 0 || height < 0 || (width == 0 && height == 0) ||
+            (argc == 4 && parse_resample_method(argv[3], &method) == -1)){
+        fprintf(stderr, "Usage: resize width height [area|bilinear|bicubic]\n");
+        return 1;
+    }
+    run_filter_resized(resize_filter, width, height, method);
+    return 0;
+}
+#endif
@@ -5,34 +5,29 @@
 /*
  * Main filter loop.
  * This function is responsible for doing the following:
- *   1. Read in pixels one at a time (because copy is a pixel-by-pixel transformation).
- *   2. Immediately write out each pixel.
+ *   1. Read in one row at a time.
+ *   2. Stretch the row horizontally once, then write it out scale_factor times.
  */
 void scale_filter(Bitmap *bmp) {
-    Pixel *row = malloc(bmp->width * sizeof(Pixel));
+    int factor = bmp->scale_factor;
+    Pixel *row = alloc_rows(bmp->width, 1);
+    Pixel *scaled = alloc_rows(bmp->width * factor, 1);
     for(int k = 0; k < bmp->height; k++){
-        for(int i = 0; i < bmp->width; i++){
-    	   if(fread(&row[i], 1, sizeof(Pixel), stdin) != sizeof(Pixel)){
-    		  perror("fread");
-    		  exit(1);
-    	   }
-
-        }
-        for(int j = 0; j < bmp->scale_factor; j++){
-            for(int a = 0; a <  bmp->width; a++){
-                for(int b = 0; b < bmp->scale_factor; b++){
-                    if(fwrite(&row[a], sizeof(Pixel), 1, stdout) != 1){
-                        perror("fwrite");
-                        exit(1);
-                    }
-
-                }
+        read_rows(bmp, row, 1);
+        for(int a = 0; a < bmp->width; a++){
+            for(int b = 0; b < factor; b++){
+                scaled[a * factor + b] = row[a];
             }
         }
+        for(int j = 0; j < factor; j++){
+            write_rows(bmp, scaled, 1);
+        }
     }
+    free(scaled);
     free(row);
 }
 
+#ifndef FILTER_LIBRARY
 int main(int argc, char** argv) {
     if(argc != 2){
         fprintf(stderr, "Needs scale factor input");
@@ -42,3 +37,4 @@ int main(int argc, char** argv) {
     run_filter(scale_filter, scale);
     return 0;
 }
+#endif
@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Tones the image sepia, from each pixel's luminance (see sepia_op in
+ * pointops.c).
+ */
+void sepia_filter(Bitmap *bmp) {
+    point_filter(bmp, sepia_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main() {
+    run_filter(sepia_filter, 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+/*
+ * Main filter loop.
+ * Makes every pixel black or white by its luminance (see threshold_op in
+ * pointops.c).
+ */
+void threshold_filter(Bitmap *bmp) {
+    point_filter(bmp, threshold_op);
+}
+
+#ifndef FILTER_LIBRARY
+int main(int argc, char** argv) {
+    // The luminance from which pixels are white (0 to 256, 128 by default).
+    double params[MAX_POINT_PARAMS];
+    PointOp op;
+    int n = parse_point_params(params, argv + 1, argc - 1);
+    if(n == -1 || threshold_op(&op, params, n) == -1){
+        fprintf(stderr, "Usage: threshold [level]\n");
+        return 1;
+    }
+    run_point_filter(threshold_filter, params, n);
+    return 0;
+}
+#endif
@@ -4,7 +4,9 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "batch.h"
 #include "bitmap.h"
+#include "pipeline.h"
 #include <fcntl.h>
 
 
@@ -12,6 +14,19 @@
 #define SUCCESS_MESSAGE "Image transformed successfully!\n"
 
 
+/*
+ * Whether the given command runs one of the point filters (see bitmap.h).
+ */
+static int is_point_filter(const char *cmd) {
+    char name[64];
+    if (sscanf(cmd, "%63s", name) != 1) {
+        return 0;
+    }
+    const FilterSpec *spec = find_filter(name);
+    return spec != NULL && spec->point != NULL;
+}
+
+
 /*
  * Check whether the given command is a valid image filter, and if so,
  * run the process.
@@ -26,12 +41,31 @@ void run_command(const char *cmd) {
         strcmp(cmd, "gaussian_blur") == 0 || strcmp(cmd, "./gaussian_blur") == 0 ||
         strcmp(cmd, "edge_detection") == 0 || strcmp(cmd, "./edge_detection") == 0) {
         execl(cmd, cmd, NULL);
+    } else if (strncmp(cmd, "gaussian_blur ", 14) == 0) {
+        // Note: the radius starts at cmd[14]
+        execl("gaussian_blur", "gaussian_blur", cmd + 14, NULL);
+    } else if (strncmp(cmd, "./gaussian_blur ", 16) == 0) {
+        // Note: the radius starts at cmd[16]
+        execl("./gaussian_blur", "./gaussian_blur", cmd + 16, NULL);
     } else if (strncmp(cmd, "scale", 5) == 0) {
         // Note: the numeric argument starts at cmd[6]
         execl("scale", "scale", cmd + 6, NULL);
     } else if (strncmp(cmd, "./scale", 7) == 0) {
         // Note: the numeric argument starts at cmd[8]
         execl("./scale", "./scale", cmd + 8, NULL);
+    } else if (strncmp(cmd, "resize ", 7) == 0 || strncmp(cmd, "./resize ", 9) == 0 ||
+               is_point_filter(cmd)) {
+        // resize and the point filters take up to three arguments: split
+        // them at the spaces.
+        char args[strlen(cmd) + 1];
+        strcpy(args, cmd);
+        char *argv[5];
+        int argc = 0;
+        for (char *arg = strtok(args, " "); arg != NULL && argc < 4; arg = strtok(NULL, " ")) {
+            argv[argc++] = arg;
+        }
+        argv[argc] = NULL;
+        execv(argv[0], argv);
     } else {
         fprintf(stderr, "Invalid command '%s'\n", cmd);
         exit(1);
@@ -39,11 +73,254 @@ void run_command(const char *cmd) {
 }
 
 
+/*
+ * Run the whole chain inside this process instead of forking one process
+ * per filter. With no filters given, the image is copied.
+ */
+void run_in_process(const char *input, const char *output, char **cmds, int num_cmds) {
+    char *copy_cmd[] = {"copy"};
+    if (num_cmds == 0) {
+        cmds = copy_cmd;
+        num_cmds = 1;
+    }
+    FilterStage stages[num_cmds];
+    for (int i = 0; i < num_cmds; i++) {
+        if (parse_stage(cmds[i], &stages[i]) == -1) {
+            fprintf(stderr, "Invalid command '%s'\n", cmds[i]);
+            exit(1);
+        }
+    }
+
+    FILE *in = fopen(input, "rb");
+    if (in == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    // Open the output for reading too, so that it can be mapped.
+    FILE *out = fopen(output, "w+b");
+    if (out == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    run_pipeline(stages, num_cmds, in, out);
+    fclose(in);
+    fclose(out);
+    fprintf(stdout, "%s", SUCCESS_MESSAGE);
+}
+
+
+/*
+ * Run the chain in this process on every image of the batch that input
+ * names, with at most max_in_flight images in memory (see run_batch).
+ */
+void run_batch_mode(const char *input, const char *output_dir, char **cmds, int num_cmds,
+                    int max_in_flight) {
+    char *copy_cmd[] = {"copy"};
+    if (num_cmds == 0) {
+        cmds = copy_cmd;
+        num_cmds = 1;
+    }
+    FilterStage stages[num_cmds];
+    for (int i = 0; i < num_cmds; i++) {
+        if (parse_stage(cmds[i], &stages[i]) == -1) {
+            fprintf(stderr, "Invalid command '%s'\n", cmds[i]);
+            exit(1);
+        }
+    }
+
+    BatchItem *items;
+    int num_items = collect_batch(input, output_dir, &items);
+    if (num_items == -1) {
+        exit(1);
+    }
+    int failures = run_batch(stages, num_cmds, items, num_items, max_in_flight);
+    free_batch(items, num_items);
+    if (failures > 0) {
+        fprintf(stdout, "%d of %d images failed.\n%s", failures, num_items, ERROR_MESSAGE);
+        exit(1);
+    }
+    fprintf(stdout, "%d images transformed successfully!\n", num_items);
+}
+
+
+/*
+ * Make several images from one input in this process, each given as
+ * "output=filter|filter|...", running the filters their chains share only
+ * once (see FilterGraph). With no filters after the '=', the image is
+ * copied.
+ */
+void run_graph_mode(const char *input, char **variants, int num_variants) {
+    FILE *in = fopen(input, "rb");
+    if (in == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    FilterGraph *graph = graph_create(in);
+    FILE *outs[num_variants];
+    for (int i = 0; i < num_variants; i++) {
+        char variant[strlen(variants[i]) + 1];
+        strcpy(variant, variants[i]);
+        char *cmds = strchr(variant, '=');
+        if (cmds == NULL || cmds == variant) {
+            fprintf(stderr, "Invalid output '%s': expected output=filter|filter...\n", variants[i]);
+            exit(1);
+        }
+        *cmds++ = '\0';
+
+        int node = GRAPH_INPUT;
+        char *saved;
+        for (char *cmd = strtok_r(cmds, "|", &saved); cmd != NULL; cmd = strtok_r(NULL, "|", &saved)) {
+            FilterStage stage;
+            if (parse_stage(cmd, &stage) == -1) {
+                fprintf(stderr, "Invalid command '%s'\n", cmd);
+                exit(1);
+            }
+            node = graph_add(graph, node, &stage);
+        }
+        if (node == GRAPH_INPUT) {
+            FilterStage copy;
+            parse_stage("copy", &copy);
+            node = graph_add(graph, node, &copy);
+        }
+        // Open the output for reading too, so that it can be mapped.
+        outs[i] = fopen(variant, "w+b");
+        if (outs[i] == NULL) {
+            perror(variant);
+            exit(1);
+        }
+        graph_output(graph, node, outs[i]);
+    }
+    graph_run(graph);
+    graph_free(graph);
+    fclose(in);
+    for (int i = 0; i < num_variants; i++) {
+        fclose(outs[i]);
+    }
+    fprintf(stdout, "%s", SUCCESS_MESSAGE);
+}
+
+
+/*
+ * Write num_levels successively halved copies of the input (see
+ * run_pyramid), named after output as pyramid_level_path names them.
+ */
+void run_pyramid_mode(const char *input, const char *output, int num_levels) {
+    FILE *in = fopen(input, "rb");
+    if (in == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    FILE *outs[num_levels];
+    for (int k = 0; k < num_levels; k++) {
+        char path[strlen(output) + 16];
+        pyramid_level_path(path, sizeof(path), output, k);
+        outs[k] = fopen(path, "wb");
+        if (outs[k] == NULL) {
+            perror(path);
+            exit(1);
+        }
+    }
+    run_pyramid(in, outs, num_levels);
+    fclose(in);
+    for (int k = 0; k < num_levels; k++) {
+        fclose(outs[k]);
+    }
+    fprintf(stdout, "%s", SUCCESS_MESSAGE);
+}
+
+
+/*
+ * Options:
+ *   -i          run the filters in this process (see run_in_process)
+ *   -t threads  the number of threads gaussian_blur and edge_detection use
+ *   -m size     the memory budget of each filter, in bytes, or with a K, M
+ *               or G suffix (see get_filter_memory)
+ *   -T          with -i, -b, -g or -p, print how long each step of the
+ *               chain took to stderr (see report_stage_times)
+ *   -p levels   instead of filtering, write that many halved copies of the
+ *               input in one pass: output-2.bmp, output-4.bmp, ... for an
+ *               output of output.bmp (see run_pyramid_mode)
+ *   -b          run the filters in this process on a batch of images: input
+ *               is a directory of them or a manifest listing them, and
+ *               output the directory the results go in (see batch.h)
+ *   -j images   with -b, the most images in memory at once (default 3: one
+ *               being read, one filtered and one written)
+ *   -g          run the filters in this process to make several outputs
+ *               from the input, each given as output=filter|filter|...
+ *               in place of output and the filters (see run_graph_mode)
+ */
 int main(int argc, char **argv) {
-    if (argc < 3) {
-        printf("Usage: image_filter input output [filter ...]\n");
+    int in_process = 0;
+    int pyramid_levels = 0;
+    int batch = 0;
+    int graph = 0;
+    int max_in_flight = 3;
+    int opt;
+    // The leading '+' stops at the input file, so filters are never options.
+    while ((opt = getopt(argc, argv, "+it:m:Tp:bj:g")) != -1) {
+        if (opt == 'i') {
+            in_process = 1;
+        } else if (opt == 'b') {
+            batch = 1;
+        } else if (opt == 'g') {
+            graph = 1;
+        } else if (opt == 'j') {
+            max_in_flight = strtol(optarg, NULL, 10);
+            if (max_in_flight < 1) {
+                fprintf(stderr, "The number of images in flight must be at least 1\n");
+                exit(1);
+            }
+        } else if (opt == 'p') {
+            pyramid_levels = strtol(optarg, NULL, 10);
+            if (pyramid_levels < 1) {
+                fprintf(stderr, "The number of levels must be at least 1\n");
+                exit(1);
+            }
+        } else if (opt == 'T') {
+            report_stage_times(stderr);
+        } else if (opt == 't') {
+            // Separate filter processes pick this up from the environment.
+            setenv("IMAGE_FILTER_THREADS", optarg, 1);
+        } else if (opt == 'm') {
+            size_t bytes;
+            if (parse_memory_size(optarg, &bytes) == -1) {
+                fprintf(stderr, "Invalid memory budget '%s'\n", optarg);
+                exit(1);
+            }
+            setenv("IMAGE_FILTER_MEMORY", optarg, 1);
+        } else {
+            exit(1);
+        }
+    }
+    // Shift the arguments so that argv[1] is the input file.
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3 || (pyramid_levels > 0 && argc > 3)) {
+        printf("Usage: image_filter [-i [-T]] [-t threads] [-m size] input output [filter ...]\n"
+               "       image_filter -b [-j images] [-T] [-t threads] [-m size] "
+               "input output_dir [filter ...]\n"
+               "       image_filter -g [-T] [-t threads] [-m size] "
+               "input output=filter|filter... ...\n"
+               "       image_filter -p levels [-T] input output\n");
         exit(1);
     }
+    if (graph) {
+        run_graph_mode(argv[1], argv + 2, argc - 2);
+        return 0;
+    }
+    if (batch) {
+        run_batch_mode(argv[1], argv[2], argv + 3, argc - 3, max_in_flight);
+        return 0;
+    }
+    if (pyramid_levels > 0) {
+        run_pyramid_mode(argv[1], argv[2], pyramid_levels);
+        return 0;
+    }
+    if (in_process) {
+        run_in_process(argv[1], argv[2], argv + 3, argc - 3);
+        return 0;
+    }
     int status;
     if(argc == 3){
         int n = fork();
@@ -52,13 +329,11 @@ int main(int argc, char **argv) {
             exit(1);
         }
         if(n > 0){
-            if((WIFEXITED(status))) {
-                int exited = WEXITSTATUS(status);
-                if(exited == 0) {
-                    fprintf(stdout, "%s", ERROR_MESSAGE);
-                } else {
-                    fprintf(stdout, "%s", SUCCESS_MESSAGE);
-                }
+            if(waitpid(n, &status, 0) == n && WIFEXITED(status) &&
+                    WEXITSTATUS(status) == 0) {
+                fprintf(stdout, "%s", SUCCESS_MESSAGE);
+            } else {
+                fprintf(stdout, "%s", ERROR_MESSAGE);
             }
 
         } else if(n == 0){
@@ -86,13 +361,11 @@ int main(int argc, char **argv) {
             exit(1);
         }
         if(n > 0){
-            if((WIFEXITED(status))) {
-                int exited = WEXITSTATUS(status);
-                if(exited == 0) {
-                    fprintf(stdout, "%s", ERROR_MESSAGE);
-                } else {
-                    fprintf(stdout, "%s", SUCCESS_MESSAGE);
-                }
+            if(waitpid(n, &status, 0) == n && WIFEXITED(status) &&
+                    WEXITSTATUS(status) == 0) {
+                fprintf(stdout, "%s", SUCCESS_MESSAGE);
+            } else {
+                fprintf(stdout, "%s", ERROR_MESSAGE);
             }
 
         } else if(n == 0){
@@ -131,7 +404,7 @@ int main(int argc, char **argv) {
                     f = open(argv[1], O_RDONLY);
                     dup2(f, fileno(stdin));
                     close(f);
-                    run_command(argv[4]);
+                    run_command(argv[3]);
                 }
                 else if(j == argc - 4){
                     dup2(fd[j-1][0], fileno(stdin));
@@ -7,57 +7,176 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <time.h>
 #include <netinet/in.h>    /* Internet domain header */
 
 #include "socket.h"
 #include "request.h"
 #include "response.h"
+#include "workers.h"
+#include "metrics.h"
+#include "threadpool.h"
 
 #ifndef PORT
 #define PORT 30000
 #endif
 
-#define BACKLOG 10
-#define MAX_CLIENTS 10
+#define BACKLOG 128
+#define DEFAULT_MAX_CLIENTS 1024
+#define MAX_EVENTS 64
+#define DEFAULT_MAX_QUEUE 256
+
+// The number of worker processes; 0 means fork for every request.
+static int num_workers = 0;
+// Without workers, the number of children serving connections.
+static int num_children = 0;
+static int epfd = -1;
+
+
+/*
+ * Respond to the request at the front of the given client's buffer, whose
+ * start line has arrived. This runs in a child process (or a worker), never
+ * in the main server process.
+ *
+ * Return 1 if the connection stays open for another request, with the
+ * request removed from the buffer (leaving anything the client has sent
+ * since), and 0 if it should be closed.
+ */
+static int serve_client(ClientState *client) {
+    // The responses are written with plain blocking I/O.
+    int flags = fcntl(client->sock, F_GETFL);
+    fcntl(client->sock, F_SETFL, flags & ~O_NONBLOCK);
+
+    metrics_start_request(client->arrived);
+    double start = metrics_now();
+    int parsed = parse_req_start_line(client) != 0 && parse_req_headers(client) == 0;
+    metrics_parse_time(metrics_now() - start);
+    if(!parsed){
+        set_keep_alive(0);
+        bad_request_response(client->sock, "Malformed request");
+        return 0;
+    }
+    ReqData *req = client->reqData;
+    int is_upload = strcmp(req->method, POST) == 0 && strcmp(req->path, IMAGE_UPLOAD) == 0;
+    // A client waiting to be told to send a body nobody wants is answered
+    // without it, and the connection closed.
+    int keep_alive = req->keep_alive && (is_upload || !req->expect_continue);
+    set_keep_alive(keep_alive);
+
+    if(strcmp(req->method, GET) == 0 && strcmp(MAIN_HTML, req->path) == 0){
+        main_html_response(client->sock);
+    }else if(strcmp(req->method, GET) == 0 && strcmp(req->path, IMAGE_FILTER) == 0){
+        image_filter_response(client->sock, req);
+    }else if(is_upload){
+        if(image_upload_response(client) == -1){
+            return 0;
+        }
+    }else if(strcmp(req->method, GET) == 0 && strcmp(req->path, METRICS) == 0){
+        metrics_response(client->sock);
+    }else if(strcmp(req->method, GET) == 0 && strcmp(req->path, THUMBNAIL) == 0){
+        thumbnail_response(client->sock, req);
+    } else {
+        not_found_response(client->sock);
+    }
+    return keep_alive && skip_req_body(client) == 0;
+}
+
+
+/*
+ * Serve every request on the connection, in a child process, until the
+ * client closes it, asks to, or sends nothing for KEEP_ALIVE_TIMEOUT
+ * seconds.
+ */
+static void serve_connection(ClientState *client) {
+    struct timeval timeout = {.tv_sec = KEEP_ALIVE_TIMEOUT};
+    setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (serve_client(client)) {
+        clear_request(client);
+        client->arrived = client->num_bytes > 0 ? metrics_now() : 0;
+        while (find_network_newline(client->buf, client->num_bytes) < 0) {
+            if (read_from_client(client) <= 0) {
+                close_connection(client->sock);
+                return;
+            }
+            if (client->arrived == 0) {
+                client->arrived = metrics_now();
+            }
+        }
+    }
+    clear_request(client);
+    close_connection(client->sock);
+}
+
+
+/*
+ * Hand the request whose start line is at the front of the client's buffer
+ * to a worker. Return 0 if it's on its way, and 1 if the server should
+ * close the connection instead.
+ */
+static int submit_client(ClientState *client) {
+    // The server leaves the socket alone until the worker is done with it.
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->sock, NULL);
+    if(submit_request(client) == -1){
+        service_unavailable_response(client->sock);
+        return 1;
+    }
+    client->busy = 1;
+    return 0;
+}
 
 
 /*
  * Read data from a client socket, and, if there is enough information to
- * determine the type of request, spawn a child process to respond to the 
- * request.
+ * determine the type of request, pass it on to be responded to.
+ *
+ * The socket is non-blocking and edge-triggered, so everything the client
+ * has sent so far is read before returning.
  *
  * Return 1 if one of the conditions hold:
  *   a) No bytes were read from the socket. (The client has likely closed the 
  *      connection.)
- *   b) A child process has been created to respond to the request.
+ *   b) A child process has been created to respond to the request (and serve
+ *      the rest of the connection).
+ *   c) The request can't be served right now.
  *
  * This return value indicates that the server process should close the socket.
  * Otherwise, return 0 (indicating that the server must continue to monitor the 
- * socket).
- *
- * Complete this function according to the comments within.
- * Note that you'll be doing this incrementally, adding to the function as you
- * complete the different parts of the assignment.
+ * socket, or that a worker is responding to it).
  */
 int handle_client(ClientState *client) {
     // Read in data from the client's socket into its buffer, 
     // and update num_bytes. If no bytes were read, return 1.
-    int read_bytes;
-    if((read_bytes = read_from_client(client)) < 0){
-        exit(1);
-    } else if(read_bytes == 0){
-        return 1;
+    while(1){
+        int read_bytes = read_from_client(client);
+        if(read_bytes < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            perror("read");
+            return 1;
+        } else if(read_bytes == 0){
+            return 1;
+        }
+        client->last_active = time(NULL);
+        if(client->arrived == 0){
+            client->arrived = metrics_now();
+        }
+        if(find_network_newline(client->buf, client->num_bytes) > 0){
+            break;
+        }
     }
-    if(parse_req_start_line(client) == 0){
-        return 0;
+
+    // With a worker pool, a worker (eventually) responds to the request.
+    if(num_workers > 0){
+        return submit_client(client);
     }
-    //IMPLEMENT THIS
 
-    // At this point client->reqData is not null, and so we are guaranteed
-    // to spawn a child process to handle the request (so we return 1).
-    // First, call fork. In the *parent* process, just return 1.
-    // In the *child* process, check the values in client->reqData to determine
-    // how to respond to the request.
+    // Now that the start line is complete, we are guaranteed
+    // to spawn a child process to handle the connection (so we return 1).
     // The child should call exit(0) (rather than return) to prevent it from
     // executing the main server loop that listens for new requests.
     int n = fork();
@@ -65,38 +184,190 @@ int handle_client(ClientState *client) {
         perror("fork");
         exit(1);
     }else if(n > 0){
+        num_children++;
         return 1;
     }
 
-    if(strcmp(client->reqData->method, GET) == 0 && 
-                strcmp(MAIN_HTML, client->reqData->path) == 0){
-        main_html_response(client->sock);
-    }else if(strcmp(client->reqData->method, GET) == 0 && 
-                    strcmp(client->reqData->path, IMAGE_FILTER) == 0){
-        image_filter_response(client->sock, client->reqData);
-    }else if(strcmp(client->reqData->method, POST) == 0 && strcmp(client->reqData->path,
-                    IMAGE_UPLOAD) == 0){
-        image_upload_response(client);
-    } else {
-        not_found_response(client->sock);
+    serve_connection(client);
+    exit(0);
+}
+
+
+/*
+ * The clients currently connected, indexed by their socket fd.
+ */
+static ClientState **clients = NULL;
+static int clients_capacity = 0;
+static int num_clients = 0;
+
+
+/*
+ * Make a new ClientState for the given socket and add it to the table.
+ */
+static ClientState *add_client(int sock) {
+    if (sock >= clients_capacity) {
+        int capacity = clients_capacity > 0 ? clients_capacity : 16;
+        while (capacity <= sock) {
+            capacity *= 2;
+        }
+        clients = realloc(clients, sizeof(ClientState *) * capacity);
+        if (clients == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(clients + clients_capacity, 0,
+               sizeof(ClientState *) * (capacity - clients_capacity));
+        clients_capacity = capacity;
     }
+    ClientState *client = init_clients(1);
+    client->sock = sock;
+    clients[sock] = client;
+    num_clients++;
+    return client;
+}
 
 
-    //IMPLEMENT THIS
+/*
+ * Stop watching the client's socket, then close it and free the client.
+ * (A child process responding to the request may still have the socket
+ * open, so closing it alone wouldn't take it out of the epoll set.)
+ */
+static void drop_client(ClientState *client) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->sock, NULL);
+    clients[client->sock] = NULL;
+    remove_client(client);
+    free(client);
+    num_clients--;
+}
 
 
-    close(client->sock);
-    exit(0);
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+
+/*
+ * Start watching the client's socket for its next request.
+ */
+static int watch_client(ClientState *client) {
+    set_nonblocking(client->sock);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.fd = client->sock};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client->sock, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Called when a worker has responded to a request: go back to waiting for
+ * the client's next request, or pass it straight on if the client has
+ * already sent its start line.
+ */
+static void finish_client(int sock, int keep_alive, const char *buf, int num_bytes) {
+    ClientState *client = clients[sock];
+    client->busy = 0;
+    if (!keep_alive) {
+        drop_client(client);
+        return;
+    }
+    memcpy(client->buf, buf, num_bytes);
+    client->num_bytes = num_bytes;
+    client->buf[num_bytes] = '\0';
+    client->last_active = time(NULL);
+    client->arrived = num_bytes > 0 ? metrics_now() : 0;
+    if (find_network_newline(client->buf, client->num_bytes) > 0) {
+        if (submit_client(client) != 0) {
+            drop_client(client);
+        }
+    } else if (watch_client(client) == -1) {
+        drop_client(client);
+    }
+}
+
+
+/*
+ * Close the connections that have been waiting for a request for longer
+ * than KEEP_ALIVE_TIMEOUT.
+ */
+static void drop_idle_clients(void) {
+    time_t now = time(NULL);
+    for (int fd = 0; fd < clients_capacity; fd++) {
+        ClientState *client = clients[fd];
+        if (client != NULL && !client->busy && now - client->last_active > KEEP_ALIVE_TIMEOUT) {
+            drop_client(client);
+        }
+    }
+}
+
+
+/*
+ * Accept every pending connection. Connections beyond max_clients are told
+ * the server is busy and closed right away.
+ */
+static void accept_clients(int listenfd, int max_clients) {
+    int new_client_fd;
+    while ((new_client_fd = accept_connection(listenfd)) >= 0) {
+        if (num_clients >= max_clients) {
+            service_unavailable_response(new_client_fd);
+            close(new_client_fd);
+            continue;
+        }
+        ClientState *client = add_client(new_client_fd);
+        client->last_active = time(NULL);
+        client->arrived = metrics_now();
+        if (watch_client(client) == -1) {
+            drop_client(client);
+        }
+    }
 }
 
 
+/*
+ * Options:
+ *   -c max_clients  the number of connections served at once (default 1024)
+ *   -w workers      the number of worker processes (default: one per CPU);
+ *                   with 0, a process is forked for every request instead
+ *   -q max_queue    the number of requests that can wait for a worker
+ *                   (default 256); requests beyond that get a 503
+ *   -t threads      the number of threads a filter runs on, and the most
+ *                   threads running filters at once across all requests
+ *                   (a request's own thread always does); by default each
+ *                   filter runs on IMAGE_FILTER_THREADS threads, or one
+ */
 int main(int argc, char **argv) {
-    ClientState *clients = init_clients(MAX_CLIENTS);
+    int max_clients = DEFAULT_MAX_CLIENTS;
+    int max_queue = DEFAULT_MAX_QUEUE;
+    int max_threads = 0;
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:w:q:t:")) != -1) {
+        if (opt == 'c' && (max_clients = strtol(optarg, NULL, 10)) > 0) {
+            continue;
+        } else if (opt == 'w' && (num_workers = strtol(optarg, NULL, 10)) >= 0) {
+            continue;
+        } else if (opt == 'q' && (max_queue = strtol(optarg, NULL, 10)) >= 0) {
+            continue;
+        } else if (opt == 't' && (max_threads = strtol(optarg, NULL, 10)) > 0) {
+            continue;
+        }
+        fprintf(stderr, "Usage: image_server [-c max_clients] [-w workers] [-q max_queue] "
+                "[-t threads]\n");
+        exit(1);
+    }
+    // Writing to a client that has gone away shouldn't kill the server.
+    signal(SIGPIPE, SIG_IGN);
 
     struct sockaddr_in *servaddr = init_server_addr(PORT);
 
     // Create an fd to listen to new connections.
     int listenfd = setup_server_socket(servaddr, BACKLOG);
+    set_nonblocking(listenfd);
     
     // Print out information about this server
     char host[MAX_HOSTNAME];
@@ -107,74 +378,81 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Server hostname: %s\n", host);
     fprintf(stderr, "Port: %d\n", PORT);
 
-    // Set up the arguments for select
-    int maxfd = listenfd;
-    fd_set allset;
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    
-    // Set up a timer for select (This is only necessary for debugging help)
-    struct timeval timer;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event listen_event = {.events = EPOLLIN | EPOLLET, .data.fd = listenfd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &listen_event) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = 0;
 
+    // Before any forking, so that every process shares the metrics and
+    // the thread limit.
+    metrics_init();
+    if (max_threads > 0) {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", max_threads);
+        setenv("IMAGE_FILTER_THREADS", value, 1);
+        pool_share_thread_limit(max_threads);
+    }
+    if (num_workers > 0) {
+        // Workers run the filters in-process rather than exec'ing them.
+        set_in_process_filters(1);
+        start_workers(num_workers, max_queue, epfd, serve_client, finish_client);
+    }
 
     // Main server loop.
     while (1) {
-        fd_set rset = allset;
-        timer.tv_sec = 2;
-        timer.tv_usec = 0;
-        int nready = select(maxfd + 1, &rset, NULL, NULL, &timer);
-        if(nready == -1) {
-            perror("select");
-            exit(1);
-        }
-        
-        if(nready == 0) {  // timer expired
-            // Check if any children have failed
-            int status;
-            int pid;
-            errno = 0;
-            if((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                if(WIFSIGNALED(status)) {
-                    fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
-                            WTERMSIG(status));
-                }
+        // The timeout is only there so finished children and idle
+        // connections are noticed even while the server is idle.
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, 2000);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            continue;
+            perror("epoll_wait");
+            exit(1);
         }
-        
 
-        if (FD_ISSET(listenfd, &rset)) {    // New client connection.
-            int new_client_fd = accept_connection(listenfd);
-            if (new_client_fd >= 0) {
-                maxfd = (new_client_fd > maxfd) ? new_client_fd : maxfd;
-                FD_SET(new_client_fd, &allset);    // Add new descriptor to set.
-
-                for(int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].sock < 0) {
-                        clients[i].sock = new_client_fd;
-                        break;
-                    }
-                }
+        // Check if any children have failed. Only connections get children
+        // of their own; with a worker pool the only children are the
+        // workers, and handle_worker_event waits for those.
+        int status;
+        int pid;
+        while (num_children > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            num_children--;
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
+                        WTERMSIG(status));
             }
-
-            nready -= 1;
         }
 
-        // The nready is just an optimization; no harm in checking all fds 
-        // except efficiency
-        for (int i = 0; i < MAX_CLIENTS && nready > 0; i++) {
-            // Check whether clients[i] has an active, ready socket.
-            if (clients[i].sock < 0 || !FD_ISSET(clients[i].sock, &rset)) {
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenfd) {    // New client connections.
+                accept_clients(listenfd, max_clients);
+                continue;
+            } else if (is_worker_fd(fd)) {
+                handle_worker_event(fd);
                 continue;
             }
-
-            int done = handle_client(&clients[i]);
-            if (done) {
-                FD_CLR(clients[i].sock, &allset);
-                remove_client(&clients[i]);
+            ClientState *client = clients[fd];
+            if (client != NULL && handle_client(client)) {
+                drop_client(client);
             }
+        }
 
-            nready -= 1;
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            drop_idle_clients();
+            last_sweep = now;
         }
+        metrics_set_load(num_clients, num_workers > 0 ? busy_workers() : num_children,
+                         queued_requests());
     }
 }
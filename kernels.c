@@ -0,0 +1,522 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/******************************************************************************
+ * Whole-row 3-by-3 kernels.
+ *
+ * A row of Pixels is just a row of bytes where every channel of pixel c
+ * sits 3 bytes after the same channel of pixel c - 1. Both kernels treat
+ * the channels independently (edge detection only combines them at the
+ * very end), so each output byte i depends only on bytes i - 3, i and i + 3
+ * of the three input rows. That lets us work on 16 or 32 bytes at a time
+ * without ever splitting the pixels into channels.
+ *
+ * The same code works on a single plane of a PlanarImage, where neighbouring
+ * pixels are 1 byte apart instead of 3; that distance is `step` below.
+ *
+ * With t, m and b the rows above, in the middle and below, and
+ *     V[i] = t[i] + 2 * m[i] + b[i]                    (vertical 1-2-1 weights)
+ *     H(x)[i] = x[i - step] + 2 * x[i] + x[i + step]   (horizontal 1-2-1 weights)
+ * the kernels in bitmap.c work out to
+ *     gaussian  = (V[i - step] + 2 * V[i] + V[i + step]) / 16
+ *     dx        = V[i - step] - V[i + step]
+ *     dy        = H(t)[i] - H(b)[i]
+ * and every intermediate value fits in 16 bits (|dx|, |dy| <= 1020).
+ *****************************************************************************/
+
+// Pixels handled per chunk by edge detection; the chunk's scratch
+// space stays on the stack and in L1.
+#define EDGE_CHUNK 256
+
+typedef int (*ByteKernel)(unsigned char *o, const unsigned char *t,
+                          const unsigned char *m, const unsigned char *b,
+                          int start, int end, int step);
+typedef int (*EdgeKernel)(int *mag, const unsigned char *t,
+                          const unsigned char *m, const unsigned char *b,
+                          int start, int end, int step);
+
+
+/*
+ * Scalar versions. These also finish off whatever bytes are left over at
+ * the end of the row by the vector versions. Each returns `end`.
+ */
+static int gaussian_bytes_scalar(unsigned char *o, const unsigned char *t,
+                                 const unsigned char *m, const unsigned char *b,
+                                 int start, int end, int step) {
+    for (int i = start; i < end; i++) {
+        int left = t[i - step] + 2 * m[i - step] + b[i - step];
+        int centre = t[i] + 2 * m[i] + b[i];
+        int right = t[i + step] + 2 * m[i + step] + b[i + step];
+        o[i] = (left + 2 * centre + right) >> 4;
+    }
+    return end;
+}
+
+
+/*
+ * Store dx * dx + dy * dy for byte i in mag[i - start].
+ */
+static int edge_bytes_scalar(int *mag, const unsigned char *t,
+                             const unsigned char *m, const unsigned char *b,
+                             int start, int end, int step) {
+    for (int i = start; i < end; i++) {
+        int dx = (t[i - step] + 2 * m[i - step] + b[i - step]) - (t[i + step] + 2 * m[i + step] + b[i + step]);
+        int dy = (t[i - step] + 2 * t[i] + t[i + step]) - (b[i - step] + 2 * b[i] + b[i + step]);
+        mag[i - start] = dx * dx + dy * dy;
+    }
+    return end;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * The vector versions handle as many whole vectors as fit in [start, end)
+ * and return the index of the first byte they did not handle.
+ * They read bytes i - step .. i + step of each row, so callers must make
+ * sure end + step is still inside the row.
+ */
+
+// a + 2 * b + c, on 16-bit lanes.
+__attribute__((target("sse2")))
+static inline __m128i weigh_121_sse2(__m128i a, __m128i b, __m128i c) {
+    return _mm_add_epi16(_mm_add_epi16(a, c), _mm_slli_epi16(b, 1));
+}
+
+// Zero-extend the low (half = 0) or high (half = 1) 8 bytes to 16 bits.
+__attribute__((target("sse2")))
+static inline __m128i widen_sse2(__m128i v, int half) {
+    const __m128i zero = _mm_setzero_si128();
+    return half ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i load_sse2(const unsigned char *p) {
+    return _mm_loadu_si128((const __m128i *) p);
+}
+
+
+__attribute__((target("sse2")))
+static int gaussian_bytes_sse2(unsigned char *o, const unsigned char *t,
+                               const unsigned char *m, const unsigned char *b,
+                               int start, int end, int step) {
+    int i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i sum[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i v[3];
+            for (int k = 0; k < 3; k++) {
+                int at = i + step * (k - 1);
+                v[k] = weigh_121_sse2(widen_sse2(load_sse2(t + at), h),
+                                      widen_sse2(load_sse2(m + at), h),
+                                      widen_sse2(load_sse2(b + at), h));
+            }
+            sum[h] = _mm_srli_epi16(weigh_121_sse2(v[0], v[1], v[2]), 4);
+        }
+        _mm_storeu_si128((__m128i *) (o + i), _mm_packus_epi16(sum[0], sum[1]));
+    }
+    return i;
+}
+
+
+__attribute__((target("sse2")))
+static int edge_bytes_sse2(int *mag, const unsigned char *t,
+                           const unsigned char *m, const unsigned char *b,
+                           int start, int end, int step) {
+    int i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m128i t0 = load_sse2(t + i - step), t1 = load_sse2(t + i), t2 = load_sse2(t + i + step);
+        __m128i m0 = load_sse2(m + i - step), m2 = load_sse2(m + i + step);
+        __m128i b0 = load_sse2(b + i - step), b1 = load_sse2(b + i), b2 = load_sse2(b + i + step);
+
+        for (int h = 0; h < 2; h++) {
+            __m128i dx = _mm_sub_epi16(
+                weigh_121_sse2(widen_sse2(t0, h), widen_sse2(m0, h), widen_sse2(b0, h)),
+                weigh_121_sse2(widen_sse2(t2, h), widen_sse2(m2, h), widen_sse2(b2, h)));
+            __m128i dy = _mm_sub_epi16(
+                weigh_121_sse2(widen_sse2(t0, h), widen_sse2(t1, h), widen_sse2(t2, h)),
+                weigh_121_sse2(widen_sse2(b0, h), widen_sse2(b1, h), widen_sse2(b2, h)));
+            // madd on interleaved (dx, dy) pairs gives dx * dx + dy * dy.
+            __m128i lo = _mm_unpacklo_epi16(dx, dy);
+            __m128i hi = _mm_unpackhi_epi16(dx, dy);
+            _mm_storeu_si128((__m128i *) (mag + i - start + 8 * h), _mm_madd_epi16(lo, lo));
+            _mm_storeu_si128((__m128i *) (mag + i - start + 8 * h + 4), _mm_madd_epi16(hi, hi));
+        }
+    }
+    return i;
+}
+
+
+// The AVX2 versions of the helpers above.
+__attribute__((target("avx2")))
+static inline __m256i weigh_121_avx2(__m256i a, __m256i b, __m256i c) {
+    return _mm256_add_epi16(_mm256_add_epi16(a, c), _mm256_slli_epi16(b, 1));
+}
+
+// Zero-extend 16 bytes to 16 16-bit lanes, keeping them in order.
+__attribute__((target("avx2")))
+static inline __m256i load_wide_avx2(const unsigned char *p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+}
+
+
+__attribute__((target("avx2")))
+static int gaussian_bytes_avx2(unsigned char *o, const unsigned char *t,
+                               const unsigned char *m, const unsigned char *b,
+                               int start, int end, int step) {
+    int i = start;
+    for (; i + 32 <= end; i += 32) {
+        __m256i sum[2];
+        for (int h = 0; h < 2; h++) {
+            __m256i v[3];
+            for (int k = 0; k < 3; k++) {
+                int at = i + 16 * h + step * (k - 1);
+                v[k] = weigh_121_avx2(load_wide_avx2(t + at), load_wide_avx2(m + at),
+                                      load_wide_avx2(b + at));
+            }
+            sum[h] = _mm256_srli_epi16(weigh_121_avx2(v[0], v[1], v[2]), 4);
+        }
+        // packus works within 128-bit lanes; put the lanes back in order.
+        __m256i packed = _mm256_packus_epi16(sum[0], sum[1]);
+        _mm256_storeu_si256((__m256i *) (o + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+static int edge_bytes_avx2(int *mag, const unsigned char *t,
+                           const unsigned char *m, const unsigned char *b,
+                           int start, int end, int step) {
+    int i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m256i t0 = load_wide_avx2(t + i - step), t1 = load_wide_avx2(t + i);
+        __m256i t2 = load_wide_avx2(t + i + step);
+        __m256i m0 = load_wide_avx2(m + i - step), m2 = load_wide_avx2(m + i + step);
+        __m256i b0 = load_wide_avx2(b + i - step), b1 = load_wide_avx2(b + i);
+        __m256i b2 = load_wide_avx2(b + i + step);
+
+        __m256i dx = _mm256_sub_epi16(weigh_121_avx2(t0, m0, b0), weigh_121_avx2(t2, m2, b2));
+        __m256i dy = _mm256_sub_epi16(weigh_121_avx2(t0, t1, t2), weigh_121_avx2(b0, b1, b2));
+        // madd on interleaved (dx, dy) pairs gives dx * dx + dy * dy. The
+        // unpacks work within 128-bit lanes, so put the lanes back in order.
+        __m256i lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i hi = _mm256_unpackhi_epi16(dx, dy);
+        __m256i first = _mm256_permute2x128_si256(lo, hi, 0x20);
+        __m256i second = _mm256_permute2x128_si256(lo, hi, 0x31);
+        _mm256_storeu_si256((__m256i *) (mag + i - start), _mm256_madd_epi16(first, first));
+        _mm256_storeu_si256((__m256i *) (mag + i - start + 8), _mm256_madd_epi16(second, second));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/******************************************************************************
+ * Converting between packed Pixel rows and planar images.
+ *
+ * 16 pixels are 48 packed bytes, or 16 bytes in each of the three planes.
+ * The SSSE3 versions move them with byte shuffles; the shuffle masks are
+ * worked out once by init_shuffles.
+ *****************************************************************************/
+typedef void (*ConvertKernel)(unsigned char **planes, unsigned char *packed, int n);
+
+static void to_planar_scalar(unsigned char **planes, unsigned char *packed, int n) {
+    for (int i = 0; i < n; i++) {
+        planes[0][i] = packed[3 * i];
+        planes[1][i] = packed[3 * i + 1];
+        planes[2][i] = packed[3 * i + 2];
+    }
+}
+
+static void to_packed_scalar(unsigned char **planes, unsigned char *packed, int n) {
+    for (int i = 0; i < n; i++) {
+        packed[3 * i] = planes[0][i];
+        packed[3 * i + 1] = planes[1][i];
+        packed[3 * i + 2] = planes[2][i];
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// plane_masks[ch][v]: pulls the bytes of plane ch out of packed vector v.
+// packed_masks[v][ch]: pushes the bytes of plane ch into packed vector v.
+// Lanes that come from somewhere else are 0x80, which pshufb zeroes.
+static unsigned char plane_masks[3][3][16] __attribute__((aligned(16)));
+static unsigned char packed_masks[3][3][16] __attribute__((aligned(16)));
+
+static void init_shuffles(void) {
+    for (int g = 0; g < 48; g++) {
+        int pixel = g / 3, ch = g % 3, vec = g / 16, lane = g % 16;
+        for (int other = 0; other < 3; other++) {
+            plane_masks[ch][other][pixel] = other == vec ? lane : 0x80;
+            packed_masks[vec][other][lane] = other == ch ? pixel : 0x80;
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void to_planar_ssse3(unsigned char **planes, unsigned char *packed, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[3];
+        for (int k = 0; k < 3; k++) {
+            v[k] = _mm_loadu_si128((const __m128i *) (packed + 3 * i + 16 * k));
+        }
+        for (int ch = 0; ch < 3; ch++) {
+            __m128i plane = _mm_setzero_si128();
+            for (int k = 0; k < 3; k++) {
+                plane = _mm_or_si128(plane, _mm_shuffle_epi8(v[k],
+                                     _mm_load_si128((const __m128i *) plane_masks[ch][k])));
+            }
+            _mm_storeu_si128((__m128i *) (planes[ch] + i), plane);
+        }
+    }
+    unsigned char *rest[3] = {planes[0] + i, planes[1] + i, planes[2] + i};
+    to_planar_scalar(rest, packed + 3 * i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void to_packed_ssse3(unsigned char **planes, unsigned char *packed, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i p[3];
+        for (int ch = 0; ch < 3; ch++) {
+            p[ch] = _mm_loadu_si128((const __m128i *) (planes[ch] + i));
+        }
+        for (int k = 0; k < 3; k++) {
+            __m128i v = _mm_setzero_si128();
+            for (int ch = 0; ch < 3; ch++) {
+                v = _mm_or_si128(v, _mm_shuffle_epi8(p[ch],
+                                 _mm_load_si128((const __m128i *) packed_masks[k][ch])));
+            }
+            _mm_storeu_si128((__m128i *) (packed + 3 * i + 16 * k), v);
+        }
+    }
+    unsigned char *rest[3] = {planes[0] + i, planes[1] + i, planes[2] + i};
+    to_packed_scalar(rest, packed + 3 * i, n - i);
+}
+
+
+/*
+ * (b + g + r) / 3 for 16 pixels at a time. Multiplying by 21846 / 65536
+ * instead of dividing by 3 is exact for every sum up to 765.
+ */
+__attribute__((target("sse2")))
+static int average_sse2(unsigned char *out, const unsigned char *b,
+                        const unsigned char *g, const unsigned char *r, int n) {
+    const __m128i third = _mm_set1_epi16(21846);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i sum[2];
+        for (int h = 0; h < 2; h++) {
+            sum[h] = _mm_add_epi16(_mm_add_epi16(widen_sse2(load_sse2(b + i), h),
+                                                 widen_sse2(load_sse2(g + i), h)),
+                                   widen_sse2(load_sse2(r + i), h));
+            sum[h] = _mm_mulhi_epu16(sum[h], third);
+        }
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(sum[0], sum[1]));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static ByteKernel gaussian_bytes = gaussian_bytes_scalar;
+static EdgeKernel edge_bytes = edge_bytes_scalar;
+static ConvertKernel to_planar = to_planar_scalar;
+static ConvertKernel to_packed = to_packed_scalar;
+static int (*average_bytes)(unsigned char *, const unsigned char *,
+                            const unsigned char *, const unsigned char *, int) = NULL;
+
+
+/*
+ * Pick the widest kernels the CPU supports before main runs.
+ * IMAGE_FILTER_SIMD=scalar|sse2|avx2|avx512 overrides the choice (it can only
+ * narrow it), which is handy for checking the versions against each other.
+ */
+__attribute__((constructor))
+static void pick_row_kernels(void) {
+#ifdef HAVE_X86_SIMD
+    const char *force = getenv("IMAGE_FILTER_SIMD");
+    __builtin_cpu_init();
+    if (force != NULL && strcmp(force, "scalar") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2") &&
+        (force == NULL || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0)) {
+        gaussian_bytes = gaussian_bytes_avx2;
+        edge_bytes = edge_bytes_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        gaussian_bytes = gaussian_bytes_sse2;
+        edge_bytes = edge_bytes_sse2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        average_bytes = average_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        init_shuffles();
+        to_planar = to_planar_ssse3;
+        to_packed = to_packed_ssse3;
+    }
+#endif
+}
+
+
+/*
+ * Pixels in the first and last columns use the grid of their inner
+ * neighbour, so they come out the same as that neighbour.
+ */
+static void copy_border_columns(Pixel *out, int width) {
+    out[0] = out[1];
+    out[width - 1] = out[width - 2];
+}
+
+
+void gaussian_row(Pixel *out, const Pixel *above, const Pixel *middle,
+                  const Pixel *below, int width) {
+    unsigned char *o = (unsigned char *) out;
+    const unsigned char *t = (const unsigned char *) above;
+    const unsigned char *m = (const unsigned char *) middle;
+    const unsigned char *b = (const unsigned char *) below;
+
+    // Bytes 3 .. 3 * width - 4 are the inner columns.
+    int end = 3 * width - 3;
+    int done = gaussian_bytes(o, t, m, b, 3, end, 3);
+    gaussian_bytes_scalar(o, t, m, b, done, end, 3);
+    copy_border_columns(out, width);
+}
+
+
+/*
+ * The edge value of a pixel, given dx * dx + dy * dy for each channel.
+ *
+ * floor(sqrt(x)) only grows with x, so taking the largest channel first
+ * gives the same answer as the max of the three roots. Every magnitude is
+ * below 2^22, so the double sqrt is exact enough that the conversion always
+ * truncates to the right value.
+ */
+static inline int edge_value(int blue, int green, int red) {
+    return (int) sqrt((double) max(blue, max(green, red)));
+}
+
+
+void edge_detection_row(Pixel *out, const Pixel *above, const Pixel *middle,
+                        const Pixel *below, int width) {
+    const unsigned char *t = (const unsigned char *) above;
+    const unsigned char *m = (const unsigned char *) middle;
+    const unsigned char *b = (const unsigned char *) below;
+    int mag[3 * EDGE_CHUNK];
+
+    for (int first = 1; first < width - 1; first += EDGE_CHUNK) {
+        int count = min(EDGE_CHUNK, width - 1 - first);
+        int start = 3 * first;
+        int end = start + 3 * count;
+        int done = edge_bytes(mag, t, m, b, start, end, 3);
+        edge_bytes_scalar(mag + done - start, t, m, b, done, end, 3);
+
+        for (int c = 0; c < count; c++) {
+            int edge_val = edge_value(mag[3 * c], mag[3 * c + 1], mag[3 * c + 2]);
+            out[first + c].blue = edge_val;
+            out[first + c].green = edge_val;
+            out[first + c].red = edge_val;
+        }
+    }
+    copy_border_columns(out, width);
+}
+
+
+/******************************************************************************
+ * Planar images.
+ *****************************************************************************/
+PlanarImage *alloc_planar(int width, int height) {
+    PlanarImage *img = malloc(sizeof(PlanarImage));
+    if (img == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    img->width = width;
+    img->height = height;
+    for (int ch = 0; ch < 3; ch++) {
+        void *plane;
+        int err = posix_memalign(&plane, 64, (size_t) width * height);
+        if (err != 0) {
+            fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+            exit(1);
+        }
+        img->planes[ch] = plane;
+    }
+    return img;
+}
+
+
+void free_planar(PlanarImage *img) {
+    for (int ch = 0; ch < 3; ch++) {
+        free(img->planes[ch]);
+    }
+    free(img);
+}
+
+
+void packed_to_planar(PlanarImage *img, const Pixel *pixels) {
+    to_planar(img->planes, (unsigned char *) pixels, img->width * img->height);
+}
+
+
+void planar_to_packed(Pixel *pixels, const PlanarImage *img) {
+    unsigned char *planes[3] = {img->planes[0], img->planes[1], img->planes[2]};
+    to_packed(planes, (unsigned char *) pixels, img->width * img->height);
+}
+
+
+void average_planes(unsigned char *out, const PlanarImage *img) {
+    const unsigned char *b = img->planes[0], *g = img->planes[1], *r = img->planes[2];
+    int n = img->width * img->height;
+    int i = average_bytes ? average_bytes(out, b, g, r, n) : 0;
+    for (; i < n; i++) {
+        out[i] = (b[i] + g[i] + r[i]) / 3;
+    }
+}
+
+
+void gaussian_plane_row(unsigned char *out, const unsigned char *above,
+                        const unsigned char *middle, const unsigned char *below,
+                        int width) {
+    int done = gaussian_bytes(out, above, middle, below, 1, width - 1, 1);
+    gaussian_bytes_scalar(out, above, middle, below, done, width - 1, 1);
+    out[0] = out[1];
+    out[width - 1] = out[width - 2];
+}
+
+
+void edge_detection_plane_row(unsigned char *out, const PlanarImage *img, int centre) {
+    int width = img->width;
+    int mag[3][EDGE_CHUNK];
+
+    for (int first = 1; first < width - 1; first += EDGE_CHUNK) {
+        int count = min(EDGE_CHUNK, width - 1 - first);
+        for (int ch = 0; ch < 3; ch++) {
+            const unsigned char *m = img->planes[ch] + (size_t) centre * width;
+            const unsigned char *t = m - width, *b = m + width;
+            int done = edge_bytes(mag[ch], t, m, b, first, first + count, 1);
+            edge_bytes_scalar(mag[ch] + done - first, t, m, b, done, first + count, 1);
+        }
+        for (int c = 0; c < count; c++) {
+            out[first + c] = edge_value(mag[0][c], mag[1][c], mag[2][c]);
+        }
+    }
+    out[0] = out[1];
+    out[width - 1] = out[width - 2];
+}
@@ -0,0 +1,290 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+// The upper bounds of the histogram buckets, in seconds.
+static const double bucket_bounds[] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+#define NUM_BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+// Filters beyond this many share the slot named "other".
+#define MAX_FILTERS 16
+#define FILTER_NAME_BYTES 32
+
+// The status codes counted separately; any other counts as 0.
+static const int status_codes[] = {200, 303, 400, 404, 500, 503, 0};
+#define NUM_STATUS_CODES (sizeof(status_codes) / sizeof(status_codes[0]))
+
+// Every field is updated with atomic operations, by any process.
+typedef struct {
+    uint64_t buckets[NUM_BUCKETS + 1];  // The last one is +Inf.
+    uint64_t sum_ns;
+} Histogram;
+
+typedef struct {
+    char name[FILTER_NAME_BYTES];  // Empty while the slot is unclaimed.
+    int claimed;
+    Histogram time;
+} FilterMetrics;
+
+typedef struct {
+    Histogram latency;
+    Histogram parse_time;
+    FilterMetrics filters[MAX_FILTERS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t responses[NUM_STATUS_CODES];
+    int connections;
+    int busy;
+    int queued;
+} Metrics;
+
+static Metrics *metrics = NULL;
+
+// The request this process is responding to (see metrics_start_request).
+static double request_arrived = 0;
+static int first_byte_pending = 0;
+
+
+void metrics_init(void) {
+    metrics = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+
+double metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+static void observe(Histogram *h, double seconds) {
+    int i = 0;
+    while (i < NUM_BUCKETS && seconds > bucket_bounds[i]) {
+        i++;
+    }
+    add(&h->buckets[i], 1);
+    add(&h->sum_ns, seconds > 0 ? (uint64_t) (seconds * 1e9) : 0);
+}
+
+
+void metrics_start_request(double arrived) {
+    request_arrived = arrived;
+    first_byte_pending = 1;
+}
+
+
+void metrics_first_byte(void) {
+    if (metrics != NULL && first_byte_pending) {
+        first_byte_pending = 0;
+        observe(&metrics->latency, metrics_now() - request_arrived);
+    }
+}
+
+
+void metrics_parse_time(double seconds) {
+    if (metrics != NULL) {
+        observe(&metrics->parse_time, seconds);
+    }
+}
+
+
+/*
+ * Return the slot for the filter with the given name, claiming a free one
+ * if it has none yet. The last slot is kept for "other".
+ */
+static FilterMetrics *filter_slot(const char *filter) {
+    for (int i = 0; i < MAX_FILTERS - 1; i++) {
+        FilterMetrics *slot = &metrics->filters[i];
+        int claimed = __atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE);
+        if (claimed == 0) {
+            // Claim the slot, then publish the name; a process that loses
+            // the race waits for the winner's name to compare with.
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&slot->claimed, &expected, 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                snprintf(slot->name, sizeof(slot->name), "%s", filter);
+                __atomic_store_n(&slot->claimed, 2, __ATOMIC_RELEASE);
+                return slot;
+            }
+            claimed = expected;
+        }
+        while (claimed == 1) {
+            claimed = __atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(slot->name, filter, sizeof(slot->name) - 1) == 0) {
+            return slot;
+        }
+    }
+    FilterMetrics *other = &metrics->filters[MAX_FILTERS - 1];
+    strcpy(other->name, "other");
+    __atomic_store_n(&other->claimed, 2, __ATOMIC_RELEASE);
+    return other;
+}
+
+
+void metrics_filter_time(const char *filter, double seconds) {
+    if (metrics != NULL) {
+        observe(&filter_slot(filter)->time, seconds);
+    }
+}
+
+
+void metrics_cache_result(int hit) {
+    if (metrics != NULL) {
+        add(hit ? &metrics->cache_hits : &metrics->cache_misses, 1);
+    }
+}
+
+
+void metrics_bytes_received(long n) {
+    if (metrics != NULL && n > 0) {
+        add(&metrics->bytes_received, n);
+    }
+}
+
+
+void metrics_bytes_sent(long n) {
+    if (metrics != NULL && n > 0) {
+        add(&metrics->bytes_sent, n);
+    }
+}
+
+
+void metrics_count_status(int status) {
+    if (metrics == NULL) {
+        return;
+    }
+    int i = 0;
+    while (status_codes[i] != status && status_codes[i] != 0) {
+        i++;
+    }
+    add(&metrics->responses[i], 1);
+}
+
+
+void metrics_set_load(int connections, int busy, int queued) {
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->connections, connections, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->busy, busy, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->queued, queued, __ATOMIC_RELAXED);
+    }
+}
+
+
+/******************************************************************************
+ * The Prometheus text format.
+ *****************************************************************************/
+static void write_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/*
+ * Write the samples of a histogram; labels is either empty or a label
+ * followed by a comma (e.g. "filter=\"copy\",").
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels,
+                            const Histogram *h) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= NUM_BUCKETS; i++) {
+        cumulative += get(&h->buckets[i]);
+        if (i < NUM_BUCKETS) {
+            fprintf(out, "%s_bucket{%sle=\"%g\"} %llu\n", name, labels, bucket_bounds[i],
+                    (unsigned long long) cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels,
+                    (unsigned long long) cumulative);
+        }
+    }
+    // Without the trailing comma, the labels make a label set of their own.
+    int len = strlen(labels);
+    if (len > 0) {
+        fprintf(out, "%s_sum{%.*s} %.6f\n", name, len - 1, labels, get(&h->sum_ns) / 1e9);
+        fprintf(out, "%s_count{%.*s} %llu\n", name, len - 1, labels,
+                (unsigned long long) cumulative);
+    } else {
+        fprintf(out, "%s_sum %.6f\n", name, get(&h->sum_ns) / 1e9);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long) cumulative);
+    }
+}
+
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    write_header(out, name, "counter", help);
+    fprintf(out, "%s %llu\n", name, (unsigned long long) value);
+}
+
+
+static void write_gauge(FILE *out, const char *name, const char *help, int value) {
+    write_header(out, name, "gauge", help);
+    fprintf(out, "%s %d\n", name, value);
+}
+
+
+void write_metrics(FILE *out) {
+    if (metrics == NULL) {
+        return;
+    }
+    write_header(out, "image_server_request_latency_seconds", "histogram",
+                 "Time from a request's arrival (or its connection's accept) to the first "
+                 "byte of the response.");
+    write_histogram(out, "image_server_request_latency_seconds", "", &metrics->latency);
+    write_header(out, "image_server_parse_seconds", "histogram",
+                 "Time spent reading and parsing request start lines and headers.");
+    write_histogram(out, "image_server_parse_seconds", "", &metrics->parse_time);
+    write_header(out, "image_server_filter_seconds", "histogram",
+                 "Time spent running filters (for results that weren't cached).");
+    for (int i = 0; i < MAX_FILTERS; i++) {
+        FilterMetrics *slot = &metrics->filters[i];
+        if (__atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE) == 2) {
+            char labels[FILTER_NAME_BYTES + 16];
+            snprintf(labels, sizeof(labels), "filter=\"%s\",", slot->name);
+            write_histogram(out, "image_server_filter_seconds", labels, &slot->time);
+        }
+    }
+
+    write_header(out, "image_server_responses_total", "counter",
+                 "Responses sent, by status code (0 for any other code).");
+    for (int i = 0; i < NUM_STATUS_CODES; i++) {
+        fprintf(out, "image_server_responses_total{code=\"%d\"} %llu\n", status_codes[i],
+                (unsigned long long) get(&metrics->responses[i]));
+    }
+    write_counter(out, "image_server_received_bytes_total", "Bytes read from clients.",
+                  get(&metrics->bytes_received));
+    write_counter(out, "image_server_sent_bytes_total", "Bytes written to clients.",
+                  get(&metrics->bytes_sent));
+    write_counter(out, "image_server_cache_hits_total",
+                  "Filter results served from the result cache.", get(&metrics->cache_hits));
+    write_counter(out, "image_server_cache_misses_total",
+                  "Filter results that had to be computed.", get(&metrics->cache_misses));
+
+    write_gauge(out, "image_server_connections", "Client connections the server holds.",
+                __atomic_load_n(&metrics->connections, __ATOMIC_RELAXED));
+    write_gauge(out, "image_server_busy", "Requests (or connections, without workers) "
+                "being responded to.", __atomic_load_n(&metrics->busy, __ATOMIC_RELAXED));
+    write_gauge(out, "image_server_queued", "Requests waiting for a worker.",
+                __atomic_load_n(&metrics->queued, __ATOMIC_RELAXED));
+}
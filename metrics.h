@@ -0,0 +1,52 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+
+/*
+ * Counters and histograms describing what image_server is doing, shared by
+ * the server and every process it forks, and reported on GET /metrics in
+ * the Prometheus text format.
+ *
+ * metrics_init sets up the shared memory they live in; it must be called
+ * in the server before anything is forked. Until then, the functions that
+ * record something do nothing.
+ *
+ * The histograms are:
+ *   - latency: from the arrival of a request (for the first request on a
+ *     connection, from its accept) to the first byte of the response;
+ *   - parse time: reading and parsing the start line and headers;
+ *   - filter time, per filter: running a filter whose result wasn't cached.
+ * The counters are bytes received and sent, responses by status code, and
+ * result cache hits and misses; and the gauges are the connections the
+ * server holds, the requests being responded to, and the requests waiting
+ * for a worker.
+ *
+ * Times are in seconds, from metrics_now (a clock shared by all processes).
+ */
+void metrics_init(void);
+double metrics_now(void);
+
+/*
+ * metrics_start_request starts timing a request that arrived at the given
+ * time, in the process responding to it; metrics_first_byte records its
+ * latency when the first byte of the response is about to be written (and
+ * does nothing for any later bytes).
+ */
+void metrics_start_request(double arrived);
+void metrics_first_byte(void);
+
+void metrics_parse_time(double seconds);
+void metrics_filter_time(const char *filter, double seconds);
+void metrics_cache_result(int hit);
+void metrics_bytes_received(long n);
+void metrics_bytes_sent(long n);
+void metrics_count_status(int status);
+void metrics_set_load(int connections, int busy, int queued);
+
+/*
+ * Write all the metrics to out, in the Prometheus text format.
+ */
+void write_metrics(FILE *out);
+
+#endif /* METRICS_H_*/
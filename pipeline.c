@@ -0,0 +1,959 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pipeline.h"
+
+
+static const FilterSpec filter_table[] = {
+    {"copy", copy_filter, NO_ARG, copy_planar, NULL, NULL},
+    {"greyscale", greyscale_filter, NO_ARG, greyscale_planar, NULL, greyscale_op},
+    {"gaussian_blur", gaussian_blur_filter, RADIUS_ARG, gaussian_blur_planar, gaussian_row, NULL},
+    {"edge_detection", edge_detection_filter, NO_ARG, edge_detection_planar, edge_detection_row,
+     NULL},
+    {"scale", scale_filter, SCALE_ARG, NULL, NULL, NULL},
+    {"resize", resize_filter, SIZE_ARG, NULL, NULL, NULL},
+    {"invert", invert_filter, NO_ARG, NULL, NULL, invert_op},
+    {"brightness_contrast", brightness_contrast_filter, POINT_ARG, NULL, NULL,
+     brightness_contrast_op},
+    {"gamma", gamma_filter, POINT_ARG, NULL, NULL, gamma_op},
+    {"threshold", threshold_filter, POINT_ARG, NULL, NULL, threshold_op},
+    {"sepia", sepia_filter, NO_ARG, NULL, NULL, sepia_op},
+    {"levels", levels_filter, POINT_ARG, NULL, NULL, levels_op},
+};
+
+#define NUM_FILTERS (sizeof(filter_table) / sizeof(filter_table[0]))
+
+
+const FilterSpec *find_filter(const char *name) {
+    if (strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+    for (int i = 0; i < NUM_FILTERS; i++) {
+        if (strcmp(filter_table[i].name, name) == 0) {
+            return &filter_table[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Parse text, a whole decimal number of at least min, into *value.
+ * Return 0 on success and -1 if it is anything else.
+ */
+static int parse_number(const char *text, int min, int *value) {
+    char *end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || n < min || n > INT_MAX) {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+
+/*
+ * Parse the arguments of a SIZE_ARG filter, "width height [method]", into
+ * stage. Return 0 on success and -1 if they are invalid.
+ */
+static int parse_size(const char *args, FilterStage *stage) {
+    char method[16];
+    stage->method = RESAMPLE_AREA;
+    int n = sscanf(args, "%d %d %15s", &stage->width, &stage->height, method);
+    if (n < 2 || stage->width < 0 || stage->height < 0 ||
+        (stage->width == 0 && stage->height == 0)) {
+        return -1;
+    }
+    if (n == 3 && parse_resample_method(method, &stage->method) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse the arguments of a POINT_ARG filter (NULL if there are none) into
+ * stage. Return 0 on success and -1 if they are invalid.
+ */
+static int parse_point_args(const char *args, FilterStage *stage) {
+    char copy[args ? strlen(args) + 1 : 1];
+    char *words[MAX_POINT_PARAMS + 1];
+    int n = 0;
+    strcpy(copy, args ? args : "");
+    for (char *word = strtok(copy, " "); word != NULL && n <= MAX_POINT_PARAMS;
+         word = strtok(NULL, " ")) {
+        words[n++] = word;
+    }
+    PointOp op;
+    stage->num_params = parse_point_params(stage->params, words, n);
+    if (stage->num_params == -1) {
+        stage->num_params = 0;
+        return -1;
+    }
+    return stage->spec->point(&op, stage->params, stage->num_params);
+}
+
+
+int parse_stage(const char *cmd, FilterStage *stage) {
+    // Split "name arg" into its two parts; the argument is optional.
+    char name[64];
+    const char *space = strchr(cmd, ' ');
+    int len = space ? space - cmd : strlen(cmd);
+    if (len >= sizeof(name)) {
+        return -1;
+    }
+    memcpy(name, cmd, len);
+    name[len] = '\0';
+
+    // Fields the filter doesn't take stay zero, so stages compare equal
+    // field by field.
+    memset(stage, 0, sizeof(*stage));
+    stage->spec = find_filter(name);
+    if (stage->spec == NULL) {
+        return -1;
+    }
+    if (stage->spec->arg_kind == POINT_ARG) {
+        return parse_point_args(space ? space + 1 : NULL, stage);
+    }
+    if (space == NULL) {
+        return stage->spec->arg_kind == SCALE_ARG || stage->spec->arg_kind == SIZE_ARG ? -1 : 0;
+    }
+    if (stage->spec->arg_kind == NO_ARG) {
+        return -1;
+    }
+    if (stage->spec->arg_kind == SIZE_ARG) {
+        return parse_size(space + 1, stage);
+    }
+    // A radius of 0 is the plain 3 by 3 blur; a scale factor starts at 1.
+    return parse_number(space + 1, stage->spec->arg_kind == SCALE_ARG ? 1 : 0, &stage->arg);
+}
+
+
+/*
+ * Whether a stage can run on a planar image.
+ */
+static int runs_planar(const FilterStage *stage) {
+    return stage->spec->planar != NULL;
+}
+
+
+/*
+ * Whether a run of planar stages on an image of the given size fits into
+ * the memory budget: it holds the packed image and two planar copies.
+ */
+static int planar_fits(int width, int height) {
+    return 3 * (size_t) width * height * sizeof(Pixel) <= get_filter_memory();
+}
+
+
+/*
+ * Run n planar-capable stages back to back: read the whole image from
+ * bmp->in, convert it to a planar image once, run every stage on that,
+ * and convert the result back to write it to bmp->out.
+ */
+static void run_planar(Bitmap *bmp, const FilterStage *stages, int n) {
+    Pixel *pixels = alloc_rows(bmp->width, bmp->height);
+    PlanarImage *a = alloc_planar(bmp->width, bmp->height);
+    PlanarImage *b = alloc_planar(bmp->width, bmp->height);
+
+    read_rows(bmp, pixels, bmp->height);
+    packed_to_planar(a, pixels);
+    for (int i = 0; i < n; i++) {
+        stages[i].spec->planar(a, b, stages[i].arg);
+        PlanarImage *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    planar_to_packed(pixels, a);
+    write_rows(bmp, pixels, bmp->height);
+
+    free_planar(a);
+    free_planar(b);
+    free(pixels);
+}
+
+
+/******************************************************************************
+ * Fused chains.
+ *****************************************************************************/
+
+/*
+ * The scale factor a stage resizes the image by (1 if it doesn't).
+ */
+static int stage_factor(const FilterStage *stage) {
+    return stage->spec->arg_kind == SCALE_ARG && stage->arg > 1 ? stage->arg : 1;
+}
+
+
+/*
+ * Whether a stage can join a fused chain: it has to make each output row
+ * from a few input rows, without an argument changing that.
+ */
+static int fuses(const FilterStage *stage) {
+    const FilterSpec *spec = stage->spec;
+    return spec->filter == copy_filter || spec->point != NULL ||
+           spec->filter == scale_filter || (spec->kernel != NULL && stage->arg == 0);
+}
+
+
+/*
+ * Return how many of the n stages, from the first, can run as one fused
+ * chain on an image of the given size. A 3-by-3 stage that would see fewer
+ * than 3 rows or columns ends the chain, so that it fails as it would on
+ * its own.
+ */
+static int fused_run(const FilterStage *stages, int n, int width, int height) {
+    int run = 0;
+    while (run < n && fuses(&stages[run])) {
+        if (stages[run].spec->kernel != NULL && (width < 3 || height < 3)) {
+            break;
+        }
+        width *= stage_factor(&stages[run]);
+        height *= stage_factor(&stages[run]);
+        run++;
+    }
+    return run;
+}
+
+
+typedef enum {
+    SOURCE_STEP,                // Rows of the input image.
+    KERNEL_STEP,                // A 3-by-3 filter of the rows of the step before.
+    SCALE_STEP,                 // The rows of the step before, stretched.
+} StepKind;
+
+// One step of a fused chain: it makes rows on demand from the rows of the
+// step before it (or, for the first, from the input image). copy stages
+// have no step, and point filters are applied to the rows of the step
+// before.
+typedef struct {
+    StepKind kind;
+    RowKernel kernel;           // For a KERNEL_STEP.
+    int factor;                 // For a SCALE_STEP.
+    PointOp *point;             // The point filters (composed into one) to
+                                // apply to every row made, or NULL.
+    int width;                  // The size of the image the step makes.
+    int height;
+    Bitmap *bmp;                // Where a SOURCE_STEP without image reads rows.
+    const Pixel *image;         // The whole input image, or NULL.
+    Pixel *rows;                // The rows made so far: a ring of the last 3,
+    int ring;                   // when ring is set, or else the whole image.
+    int next;                   // The next row to make.
+} FusedStep;
+
+
+/*
+ * The rows in a ring are a pixel further apart than their width, which
+ * leaves room for read_rows to read a row's padding without overwriting
+ * the start of the next row.
+ */
+static Pixel *step_row(const FusedStep *step, int r) {
+    if (step->ring) {
+        return step->rows + (size_t) (r % 3) * (step->width + 1);
+    }
+    return step->rows + (size_t) r * step->width;
+}
+
+
+static const Pixel *fused_row(FusedStep *steps, int i, int r);
+
+/*
+ * Make row r of step i.
+ */
+static void make_row(FusedStep *steps, int i, int r) {
+    FusedStep *step = &steps[i];
+    Pixel *out = step_row(step, r);
+    if (step->kind == SOURCE_STEP) {
+        if (step->image != NULL && step->point != NULL) {
+            // The point filters go straight from the input row.
+            apply_point_op(step->point, out, step->image + (size_t) r * step->width,
+                           step->width);
+            return;
+        } else if (step->image != NULL) {
+            memcpy(out, step->image + (size_t) r * step->width, step->width * sizeof(Pixel));
+        } else {
+            read_rows(step->bmp, out, 1);
+        }
+    } else if (step->kind == KERNEL_STEP) {
+        // Border rows use the grid of their inner neighbour.
+        int centre = min(max(r, 1), step->height - 2);
+        const Pixel *above = fused_row(steps, i - 1, centre - 1);
+        const Pixel *middle = fused_row(steps, i - 1, centre);
+        const Pixel *below = fused_row(steps, i - 1, centre + 1);
+        step->kernel(out, above, middle, below, step->width);
+    } else {
+        const Pixel *in = fused_row(steps, i - 1, r / step->factor);
+        for (int a = 0; a < step->width; a++) {
+            out[a] = in[a / step->factor];
+        }
+    }
+    if (step->point != NULL) {
+        apply_point_op(step->point, out, out, step->width);
+    }
+}
+
+
+/*
+ * Return row r of step i, making it if it hasn't been made yet. Rows are
+ * asked for in order, and only the last 3 made are kept in a ring. (A chain
+ * that starts part-way down the image skips the rows above; its first step
+ * then has to have the whole image.)
+ */
+static const Pixel *fused_row(FusedStep *steps, int i, int r) {
+    FusedStep *step = &steps[i];
+    if (r >= step->next) {
+        make_row(steps, i, r);
+        step->next = r + 1;
+    }
+    return step_row(step, r);
+}
+
+
+/*
+ * Set up the steps of a fused chain of the n stages, on an image of the
+ * given size that comes from image if it is not NULL, or else from bmp->in.
+ * The last step makes its rows straight into out if that is not NULL.
+ * Return the number of steps.
+ */
+static int build_chain(FusedStep *steps, const FilterStage *stages, int n, int width,
+                       int height, Bitmap *bmp, const Pixel *image, Pixel *out) {
+    int num_steps = 1;
+    steps[0] = (FusedStep) {
+        .kind = SOURCE_STEP, .width = width, .height = height, .bmp = bmp, .image = image,
+    };
+    for (int i = 0; i < n; i++) {
+        const FilterSpec *spec = stages[i].spec;
+        FusedStep *last = &steps[num_steps - 1];
+        if (spec->point != NULL) {
+            PointOp op;
+            spec->point(&op, stages[i].params, stages[i].num_params);
+            if (last->point == NULL) {
+                last->point = malloc(sizeof(PointOp));
+                if (last->point == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+                *last->point = op;
+            } else {
+                compose_point_ops(last->point, &op);
+            }
+        } else if (spec->kernel != NULL) {
+            steps[num_steps++] = (FusedStep) {
+                .kind = KERNEL_STEP, .kernel = spec->kernel,
+                .width = last->width, .height = last->height,
+            };
+        } else if (stage_factor(&stages[i]) > 1) {
+            int factor = stage_factor(&stages[i]);
+            steps[num_steps++] = (FusedStep) {
+                .kind = SCALE_STEP, .factor = factor,
+                .width = last->width * factor, .height = last->height * factor,
+            };
+        }
+    }
+
+    for (int i = 0; i < num_steps; i++) {
+        FusedStep *step = &steps[i];
+        if (i == num_steps - 1 && out != NULL) {
+            step->rows = out;
+        } else if (i == 0 && image != NULL && step->point == NULL) {
+            // Every input row is already there.
+            step->rows = (Pixel *) image;
+            step->next = height;
+        } else {
+            step->rows = alloc_rows(step->width + 1, 3);
+            step->ring = 1;
+        }
+    }
+    return num_steps;
+}
+
+
+static void free_chain(FusedStep *steps, int num_steps) {
+    for (int i = 0; i < num_steps; i++) {
+        if (steps[i].ring) {
+            free(steps[i].rows);
+        }
+        free(steps[i].point);
+    }
+}
+
+
+// A fused chain split between the filter threads.
+typedef struct {
+    const FilterStage *stages;
+    int n;
+    int width;
+    int height;
+    const Pixel *image;         // The whole input image.
+    Pixel *out;                 // The whole output image.
+    int out_height;
+    int num_tasks;
+} FusedJob;
+
+
+/*
+ * Make one task's share of the output rows, with a chain of its own.
+ */
+static void run_fused_task(void *arg, int task) {
+    FusedJob *job = arg;
+    FusedStep steps[job->n + 1];
+    int num_steps = build_chain(steps, job->stages, job->n, job->width, job->height, NULL,
+                                job->image, job->out);
+    int start = (long) job->out_height * task / job->num_tasks;
+    int end = (long) job->out_height * (task + 1) / job->num_tasks;
+    for (int r = start; r < end; r++) {
+        fused_row(steps, num_steps - 1, r);
+    }
+    free_chain(steps, num_steps);
+}
+
+
+/*
+ * Run n fusable stages as one pass: read every row from bmp->in, and write
+ * every row of the result (bmp->out_width pixels wide) to bmp->out.
+ *
+ * With a single filter thread, the rows stream through; with more, each
+ * thread makes a contiguous range of output rows, which needs the whole
+ * input and output images in memory (or in a mapping). Images that would
+ * have to be read into memory beyond the memory budget stream through
+ * all the same.
+ */
+static void run_fused(Bitmap *bmp, const FilterStage *stages, int n) {
+    int width = bmp->width;
+    int height = bmp->height;
+    int out_height = bmp->out_height;
+    const Pixel *image = input_rows(bmp, height);
+    Pixel *out = output_rows(bmp, out_height);
+    ThreadPool *pool = get_filter_pool();
+    size_t buffered = (image ? 0 : (size_t) width * height) +
+                      (out ? 0 : (size_t) bmp->out_width * out_height);
+
+    if (pool == NULL || buffered * sizeof(Pixel) > get_filter_memory()) {
+        FusedStep steps[n + 1];
+        int num_steps = build_chain(steps, stages, n, width, height, bmp, image, out);
+        for (int r = 0; r < out_height; r++) {
+            const Pixel *row = fused_row(steps, num_steps - 1, r);
+            if (out == NULL) {
+                write_rows(bmp, row, 1);
+            }
+        }
+        free_chain(steps, num_steps);
+        return;
+    }
+
+    Pixel *in_buf = NULL, *out_buf = NULL;
+    if (image == NULL) {
+        in_buf = alloc_rows(width, height);
+        read_rows(bmp, in_buf, height);
+        image = in_buf;
+    }
+    if (out == NULL) {
+        out_buf = alloc_rows(bmp->out_width, out_height);
+        out = out_buf;
+    }
+    FusedJob job = {
+        .stages = stages,
+        .n = n,
+        .width = width,
+        .height = height,
+        .image = image,
+        .out = out,
+        .out_height = out_height,
+        .num_tasks = min(pool_size(pool), out_height),
+    };
+    pool_run(pool, run_fused_task, &job, job.num_tasks);
+    if (out_buf != NULL) {
+        write_rows(bmp, out_buf, out_height);
+    }
+    free(in_buf);
+    free(out_buf);
+}
+
+
+// Where run_pipeline reports the time each step takes, if anywhere.
+static FILE *stage_times = NULL;
+
+
+void report_stage_times(FILE *report) {
+    stage_times = report;
+}
+
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Report how long the given stages, run as one step, took.
+ */
+static void report_step(const FilterStage *stages, int n, double seconds) {
+    for (int i = 0; i < n; i++) {
+        fprintf(stage_times, i > 0 ? "+%s" : "%s", stages[i].spec->name);
+        if (stages[i].spec->arg_kind == SIZE_ARG) {
+            fprintf(stage_times, " %d %d", stages[i].width, stages[i].height);
+        } else if (stages[i].spec->arg_kind == POINT_ARG) {
+            for (int j = 0; j < stages[i].num_params; j++) {
+                fprintf(stage_times, " %g", stages[i].params[j]);
+            }
+        } else if (stages[i].arg != 0) {
+            fprintf(stage_times, " %d", stages[i].arg);
+        }
+    }
+    fprintf(stage_times, "\t%.6f\n", seconds);
+}
+
+
+/*
+ * Run the n stages one after the other on bmp, reading the image from
+ * bmp->in. If out isn't NULL, the last step writes the image to it
+ * (through out_map if it can be mapped); otherwise the image is left in
+ * memory, and returned. Either way, bmp ends up describing the image the
+ * last stage made (its size and header).
+ */
+static Pixel *run_chain(Bitmap *bmp, const FilterStage *stages, int n, FILE *out,
+                        MappedFile *out_map) {
+    PixelStream first_in = bmp->in;
+    Pixel *pixels = NULL;
+
+    for (int i = 0; i < n; ) {
+        // Two or more stages in a row that can be fused run together as
+        // one step of the chain. Failing that (a stage next to one that
+        // doesn't fuse, such as a blur with a radius), so do two or more
+        // planar stages, which are worth converting for if the copies fit
+        // into the memory budget.
+        int fused = fused_run(&stages[i], n - i, bmp->width, bmp->height);
+        int run = 0;
+        while (i + run < n && runs_planar(&stages[i + run])) {
+            run++;
+        }
+        if (!planar_fits(bmp->width, bmp->height)) {
+            run = 0;
+        }
+        int steps = fused >= 2 ? fused : run >= 2 ? run : 1;
+
+        // Each step sees the header exactly as the stage before it wrote
+        // it, and leaves it as its last stage would.
+        int factor = 1;
+        for (int j = i; j < i + steps; j++) {
+            factor *= stage_factor(&stages[j]);
+        }
+        bmp->scale_factor = 1;
+        bmp->out_width = bmp->width;
+        bmp->out_height = bmp->height;
+        bmp->radius = 0;
+        bmp->num_params = stages[i].num_params;
+        memcpy(bmp->params, stages[i].params, sizeof(bmp->params));
+        if (factor > 1) {
+            scale(bmp, factor);
+        } else if (stages[i].spec->arg_kind == RADIUS_ARG) {
+            bmp->radius = stages[i].arg;
+        } else if (stages[i].spec->arg_kind == SIZE_ARG) {
+            resize(bmp, stages[i].width, stages[i].height);
+            bmp->resample = stages[i].method;
+        }
+        int out_width = bmp->out_width;
+        int out_height = bmp->out_height;
+
+        Pixel *result = NULL;
+        if (i == 0) {
+            bmp->in = first_in;
+        } else {
+            bmp->in = (PixelStream) {.pixels = pixels};
+        }
+        if (i + steps == n && out != NULL) {
+            bmp->out = (PixelStream) {.fp = out};
+            map_output(bmp, fileno(out), out_map);
+            write_header(bmp);
+        } else {
+            result = alloc_rows(out_width, out_height);
+            bmp->out = (PixelStream) {.pixels = result};
+        }
+
+        double start = stage_times ? now_seconds() : 0;
+        if (fused >= 2) {
+            run_fused(bmp, &stages[i], steps);
+        } else if (steps > 1) {
+            run_planar(bmp, &stages[i], steps);
+        } else {
+            stages[i].spec->filter(bmp);
+        }
+        if (stage_times) {
+            report_step(&stages[i], steps, now_seconds() - start);
+        }
+
+        free(pixels);
+        pixels = result;
+        bmp->width = out_width;
+        bmp->height = out_height;
+        i += steps;
+    }
+    return pixels;
+}
+
+
+/*
+ * Set up a Bitmap to read the image from in, through in_map if it can be
+ * mapped.
+ */
+static Bitmap *open_input(FILE *in, MappedFile *in_map) {
+    setvbuf(in, NULL, _IOFBF, IO_BLOCK_BYTES);
+    Bitmap *bmp = map_bitmap(fileno(in), in_map);
+    if (bmp == NULL) {
+        bmp = read_header(in);
+    }
+    return bmp;
+}
+
+
+static void finish_output(FILE *out, MappedFile *out_map) {
+    if (fflush(out) != 0) {
+        perror("fflush");
+        exit(1);
+    }
+    unmap_file(out_map);
+}
+
+
+void run_pipeline(const FilterStage *stages, int n, FILE *in, FILE *out) {
+    setvbuf(out, NULL, _IOFBF, IO_BLOCK_BYTES);
+
+    // Files are read and written through mappings where possible.
+    MappedFile in_map = {NULL}, out_map = {NULL};
+    Bitmap *bmp = open_input(in, &in_map);
+    run_chain(bmp, stages, n, out, &out_map);
+    finish_output(out, &out_map);
+    unmap_file(&in_map);
+    free_bitmap(bmp);
+}
+
+
+int run_pipeline_in_child(const FilterStage *stages, int n, int in_fd, int out_fd) {
+    // Nothing buffered here should be written out twice.
+    fflush(NULL);
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // The streams get their own descriptors, so closing them leaves
+        // in_fd and out_fd open.
+        FILE *in = fdopen(dup(in_fd), "rb");
+        FILE *out = fdopen(dup(out_fd), "w+b");
+        if (in == NULL || out == NULL) {
+            perror("fdopen");
+            exit(1);
+        }
+        run_pipeline(stages, n, in, out);
+        fclose(in);
+        fclose(out);
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+void run_pyramid(FILE *in, FILE **outs, int num_levels) {
+    for (int k = 0; k < num_levels; k++) {
+        setvbuf(outs[k], NULL, _IOFBF, IO_BLOCK_BYTES);
+    }
+    MappedFile in_map = {NULL};
+    Bitmap *bmp = open_input(in, &in_map);
+    double start = stage_times ? now_seconds() : 0;
+    write_pyramid(bmp, outs, num_levels);
+    for (int k = 0; k < num_levels; k++) {
+        if (fflush(outs[k]) != 0) {
+            perror("fflush");
+            exit(1);
+        }
+    }
+    if (stage_times) {
+        fprintf(stage_times, "pyramid %d\t%.6f\n", num_levels, now_seconds() - start);
+    }
+    unmap_file(&in_map);
+    free_bitmap(bmp);
+}
+
+
+int pyramid_level_path(char *buf, size_t size, const char *path, int k) {
+    int len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".bmp") == 0) {
+        len -= 4;
+    }
+    int n = snprintf(buf, size, "%.*s-%d.bmp", len, path, 2 << k);
+    return n < 0 || n >= size ? -1 : 0;
+}
+
+
+/******************************************************************************
+ * Filter graphs.
+ *****************************************************************************/
+
+typedef struct {
+    int input;                   // The node this one filters (-1 for the input).
+    FilterStage stage;
+    FILE *out;                   // Where the node's image is written, or NULL.
+    int users;                   // The consumers (that lead to an output) and
+                                 // the output still to be given the image.
+    int shared;                  // Whether there was more than one at first.
+    Bitmap *image;               // Once the image is made, if it is kept:
+    Pixel *pixels;               // its size and header, and its rows.
+} GraphNode;
+
+struct FilterGraph {
+    FILE *in;
+    MappedFile in_map;
+    GraphNode *nodes;
+    int num_nodes;
+    int capacity;
+};
+
+
+FilterGraph *graph_create(FILE *in) {
+    FilterGraph *graph = calloc(1, sizeof(FilterGraph));
+    if (graph == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    graph->in = in;
+    graph->capacity = 8;
+    graph->nodes = calloc(graph->capacity, sizeof(GraphNode));
+    if (graph->nodes == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    graph->nodes[GRAPH_INPUT].input = -1;
+    graph->num_nodes = 1;
+    return graph;
+}
+
+
+/*
+ * Whether a and b do the same thing. Only the fields their filter takes
+ * are compared, so stages made by hand (not by parse_stage) match too.
+ */
+static int same_stage(const FilterStage *a, const FilterStage *b) {
+    if (a->spec != b->spec || a->arg != b->arg) {
+        return 0;
+    }
+    if (a->spec->arg_kind == SIZE_ARG) {
+        return a->width == b->width && a->height == b->height && a->method == b->method;
+    }
+    if (a->spec->arg_kind == POINT_ARG) {
+        if (a->num_params != b->num_params) {
+            return 0;
+        }
+        for (int i = 0; i < a->num_params; i++) {
+            if (a->params[i] != b->params[i]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+int graph_add(FilterGraph *graph, int input, const FilterStage *stage) {
+    if (input < 0 || input >= graph->num_nodes) {
+        fprintf(stderr, "No such node in the filter graph: %d\n", input);
+        exit(1);
+    }
+    for (int i = input + 1; i < graph->num_nodes; i++) {
+        if (graph->nodes[i].input == input && same_stage(&graph->nodes[i].stage, stage)) {
+            return i;
+        }
+    }
+    if (graph->num_nodes == graph->capacity) {
+        graph->capacity *= 2;
+        graph->nodes = realloc(graph->nodes, sizeof(GraphNode) * graph->capacity);
+        if (graph->nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    graph->nodes[graph->num_nodes] = (GraphNode) {.input = input, .stage = *stage};
+    return graph->num_nodes++;
+}
+
+
+void graph_output(FilterGraph *graph, int node, FILE *out) {
+    if (node <= GRAPH_INPUT || node >= graph->num_nodes || graph->nodes[node].out != NULL) {
+        fprintf(stderr, "Can't write node %d of the filter graph\n", node);
+        exit(1);
+    }
+    graph->nodes[node].out = out;
+}
+
+
+/*
+ * Whether chains start from the image of the given node: the input's, and
+ * that of any node with more than one user, which is kept in memory until
+ * the last of them is done with it.
+ */
+static int starts_chains(const FilterGraph *graph, int node) {
+    return node == GRAPH_INPUT || graph->nodes[node].shared;
+}
+
+
+/*
+ * One of the users of the node's image is done with it.
+ */
+static void release_node(FilterGraph *graph, int node) {
+    GraphNode *n = &graph->nodes[node];
+    if (--n->users > 0) {
+        return;
+    }
+    free(n->pixels);
+    n->pixels = NULL;
+    if (node != GRAPH_INPUT) {
+        free_bitmap(n->image);
+        n->image = NULL;
+    }
+}
+
+
+static void make_image(FilterGraph *graph, int node);
+
+
+/*
+ * Set up a Bitmap to read the image of a node that starts chains, making
+ * it first if need be.
+ */
+static Bitmap *read_node(FilterGraph *graph, int node) {
+    GraphNode *n = &graph->nodes[node];
+    if (n->image == NULL) {
+        make_image(graph, node);
+    }
+    Bitmap *bmp = malloc(sizeof(Bitmap));
+    unsigned char *header = malloc(n->image->headerSize);
+    if (bmp == NULL || header == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    *bmp = *n->image;
+    bmp->header = header;
+    memcpy(header, n->image->header, n->image->headerSize);
+    if (n->pixels != NULL) {
+        bmp->in = (PixelStream) {.pixels = n->pixels};
+    }
+    return bmp;
+}
+
+
+/*
+ * Run the chain of stages that leads to node from the nearest node that
+ * starts chains: into out if it isn't NULL, or else into memory, returning
+ * the rows. bmp_out is set to what describes the result.
+ */
+static Pixel *run_to_node(FilterGraph *graph, int node, FILE *out, Bitmap **bmp_out) {
+    int n = 0;
+    int from = node;
+    do {
+        from = graph->nodes[from].input;
+        n++;
+    } while (!starts_chains(graph, from));
+    FilterStage stages[n];
+    for (int i = n - 1, k = node; i >= 0; i--, k = graph->nodes[k].input) {
+        stages[i] = graph->nodes[k].stage;
+    }
+
+    Bitmap *bmp = read_node(graph, from);
+    MappedFile out_map = {NULL};
+    Pixel *pixels = run_chain(bmp, stages, n, out, &out_map);
+    if (out != NULL) {
+        finish_output(out, &out_map);
+    }
+    release_node(graph, from);
+    *bmp_out = bmp;
+    return pixels;
+}
+
+
+/*
+ * Make the image of a node that starts chains, and keep it.
+ */
+static void make_image(FilterGraph *graph, int node) {
+    GraphNode *n = &graph->nodes[node];
+    if (node == GRAPH_INPUT) {
+        n->image = open_input(graph->in, &graph->in_map);
+        // A stream can only be read once.
+        if (n->shared && n->image->in.fp != NULL) {
+            n->pixels = alloc_rows(n->image->width, n->image->height);
+            read_rows(n->image, n->pixels, n->image->height);
+        }
+        return;
+    }
+    n->pixels = run_to_node(graph, node, NULL, &n->image);
+}
+
+
+void graph_run(FilterGraph *graph) {
+    // Count the users of every node, leaving out nodes that lead to no
+    // output. A node comes after its input, so its own count is complete
+    // by the time it is looked at.
+    for (int i = graph->num_nodes - 1; i >= 0; i--) {
+        GraphNode *n = &graph->nodes[i];
+        n->users += n->out != NULL;
+        n->shared = n->users > 1;
+        if (n->users > 0 && i != GRAPH_INPUT) {
+            graph->nodes[n->input].users++;
+        }
+        if (n->out != NULL) {
+            setvbuf(n->out, NULL, _IOFBF, IO_BLOCK_BYTES);
+        }
+    }
+
+    // Each output pulls in the images it needs.
+    for (int i = 1; i < graph->num_nodes; i++) {
+        GraphNode *n = &graph->nodes[i];
+        if (n->out == NULL) {
+            continue;
+        }
+        Bitmap *bmp;
+        if (starts_chains(graph, i)) {
+            // The image is kept for other users too: write it out as is.
+            bmp = read_node(graph, i);
+            MappedFile out_map = {NULL};
+            FilterStage copy = {.spec = find_filter("copy")};
+            run_chain(bmp, &copy, 1, n->out, &out_map);
+            finish_output(n->out, &out_map);
+            release_node(graph, i);
+        } else {
+            run_to_node(graph, i, n->out, &bmp);
+        }
+        free_bitmap(bmp);
+    }
+
+    GraphNode *input = &graph->nodes[GRAPH_INPUT];
+    if (input->image != NULL) {
+        free_bitmap(input->image);
+        input->image = NULL;
+    }
+    unmap_file(&graph->in_map);
+}
+
+
+void graph_free(FilterGraph *graph) {
+    for (int i = 0; i < graph->num_nodes; i++) {
+        free(graph->nodes[i].pixels);
+        if (graph->nodes[i].image != NULL) {
+            free_bitmap(graph->nodes[i].image);
+        }
+    }
+    unmap_file(&graph->in_map);
+    free(graph->nodes);
+    free(graph);
+}
@@ -0,0 +1,170 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "bitmap.h"
+
+// The filter functions themselves, defined in filters/*.c.
+// Those files are compiled with FILTER_LIBRARY defined to leave out their
+// main functions when linked into another program.
+void copy_filter(Bitmap *bmp);
+void greyscale_filter(Bitmap *bmp);
+void gaussian_blur_filter(Bitmap *bmp);
+void edge_detection_filter(Bitmap *bmp);
+void scale_filter(Bitmap *bmp);
+void resize_filter(Bitmap *bmp);
+void invert_filter(Bitmap *bmp);
+void brightness_contrast_filter(Bitmap *bmp);
+void gamma_filter(Bitmap *bmp);
+void threshold_filter(Bitmap *bmp);
+void sepia_filter(Bitmap *bmp);
+void levels_filter(Bitmap *bmp);
+
+// Versions of the filters that work on whole planar images instead; arg
+// is the stage's numeric argument.
+void copy_planar(const PlanarImage *in, PlanarImage *out, int arg);
+void greyscale_planar(const PlanarImage *in, PlanarImage *out, int arg);
+void gaussian_blur_planar(const PlanarImage *in, PlanarImage *out, int arg);
+void edge_detection_planar(const PlanarImage *in, PlanarImage *out, int arg);
+
+
+// What the number after a filter's name on the command line means.
+typedef enum {
+    NO_ARG,                         // The filter doesn't take one.
+    SCALE_ARG,                      // A scale factor; required.
+    RADIUS_ARG,                     // A blur radius; optional.
+    SIZE_ARG,                       // A width and height, then optionally
+                                    // a ResampleMethod's name.
+    POINT_ARG,                      // Up to MAX_POINT_PARAMS numbers, as the
+                                    // filter's point operation takes them.
+} ArgKind;
+
+// A filter that can be run in-process, and the name it goes by on the
+// command line.
+typedef struct {
+    const char *name;               // e.g. "greyscale" or "scale"
+    void (*filter)(Bitmap *);       // The function that runs the filter.
+    ArgKind arg_kind;
+    // The planar version of the filter, or NULL if the filter only works
+    // on packed Pixels.
+    void (*planar)(const PlanarImage *, PlanarImage *, int);
+    // The row kernel of a 3-by-3 filter (used in fused chains when there's
+    // no argument), or NULL.
+    RowKernel kernel;
+    // What sets up the operation of a point filter, or NULL.
+    PointOpMaker point;
+} FilterSpec;
+
+// One stage of a filter chain.
+typedef struct {
+    const FilterSpec *spec;
+    int arg;                        // The numeric argument, or 0 if none.
+    int width;                      // For a SIZE_ARG: the size to resize to
+    int height;                     // (either may be 0 to keep the aspect
+    ResampleMethod method;          // ratio), and how.
+    double params[MAX_POINT_PARAMS];  // For a POINT_ARG: the arguments,
+    int num_params;                 // and how many there are.
+} FilterStage;
+
+
+/*
+ * Return the filter with the given name, or NULL if there isn't one.
+ * A leading "./" is ignored, so "./copy" and "copy" are the same filter.
+ */
+const FilterSpec *find_filter(const char *name);
+
+/*
+ * Parse one command in the format image_filter accepts (e.g. "greyscale",
+ * "scale 2", "gaussian_blur 5", "resize 320 0 bicubic" or "levels 16 235")
+ * into stage.
+ * Return 0 on success and -1 if the command is invalid.
+ */
+int parse_stage(const char *cmd, FilterStage *stage);
+
+/*
+ * Run the n filters in stages one after the other in this process,
+ * reading the image from in and writing the result to out.
+ *
+ * The output is byte-for-byte what running each filter as its own process,
+ * connected by pipes, would produce; but every intermediate image is handed
+ * to the next stage in memory instead. If in or out is a regular file (and
+ * out is open for reading as well), it is used through a mapping; see
+ * map_bitmap and map_output.
+ *
+ * Two or more stages in a row that work a row at a time (copy, the point
+ * filters, scale, and the 3-by-3 gaussian_blur and edge_detection) are
+ * fused into a single pass: each output row is made by pulling just the
+ * rows it needs through the chain, every 3-by-3 stage keeping a rolling
+ * window of three rows of its input. Point filters in a row are composed
+ * into one operation, which is applied to rows as they are made.
+ * No intermediate image is ever held in full.
+ *
+ * Stages that can't be fused that way but have planar versions (see
+ * FilterSpec), such as a gaussian_blur with a radius, run on a planar image
+ * together with the planar stages next to them: when such a run has two or
+ * more stages, the image is converted to a planar image once and back once,
+ * instead of being handed between the stages in full, unless the copies
+ * that takes would go over the memory budget (see get_filter_memory).
+ */
+void run_pipeline(const FilterStage *stages, int n, FILE *in, FILE *out);
+
+/*
+ * Like run_pipeline, but in a forked child, reading the image from the
+ * file open on in_fd and writing the result to the one open on out_fd
+ * (which should be open for reading too, so it can be mapped). A filter
+ * that rejects the image exits, so this fails just the one image instead
+ * of the calling process. Return 0 on success and -1 on failure.
+ */
+int run_pipeline_in_child(const FilterStage *stages, int n, int in_fd, int out_fd);
+
+/*
+ * A graph of filters run on one image, for making several images from it
+ * whose chains share stages.
+ *
+ * Node GRAPH_INPUT is the image read from in. graph_add adds a node that
+ * runs stage on the image of an existing node, and returns it; adding the
+ * same stage to the same node again returns the node added the first time,
+ * so chains that start the same way share their first nodes. graph_output
+ * has the image of a node written to out (which should be open for reading
+ * too, so it can be mapped), at most one per node.
+ *
+ * Nothing runs until graph_run, which makes each output in turn, pulling
+ * in only the images it needs. Stages between nodes with a single user run
+ * as one chain, exactly as run_pipeline would run them (fused, planar or
+ * one by one). The image of a node that more than one output depends on
+ * is made once and kept in memory until the last of them has used it. A
+ * graph can be run once; graph_free frees it (but doesn't close the files).
+ */
+#define GRAPH_INPUT 0
+
+typedef struct FilterGraph FilterGraph;
+
+FilterGraph *graph_create(FILE *in);
+int graph_add(FilterGraph *graph, int input, const FilterStage *stage);
+void graph_output(FilterGraph *graph, int node, FILE *out);
+void graph_run(FilterGraph *graph);
+void graph_free(FilterGraph *graph);
+
+/*
+ * Read the image from in once, and write num_levels successively halved
+ * copies of it to outs[0], outs[1], ... (see write_pyramid). in is used
+ * through a mapping if it is a regular file.
+ */
+void run_pyramid(FILE *in, FILE **outs, int num_levels);
+
+/*
+ * Write the name of the file for level k of the pyramid of path into buf:
+ * path with "-2", "-4", "-8", ... (the factor the level is smaller by)
+ * inserted before a ".bmp" extension, e.g. "dog-4.bmp" for level 1 of
+ * "dog.bmp". Return -1 if it doesn't fit in size bytes, and 0 otherwise.
+ */
+int pyramid_level_path(char *buf, size_t size, const char *path, int k);
+
+/*
+ * Have run_pipeline report how long each step of a chain takes, as a line
+ * per step written to report: the step's stages (joined with '+' when
+ * stages run together), a tab, and the time in seconds. Pass NULL
+ * to stop reporting.
+ */
+void report_stage_times(FILE *report);
+
+#endif /* PIPELINE_H_*/
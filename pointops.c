@@ -0,0 +1,575 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/******************************************************************************
+ * Point operations.
+ *
+ * Every output pixel depends on the input pixel in the same place only, so
+ * an operation is a handful of 256-entry tables. A plain operation looks up
+ * each channel in a table of its own. A mono operation first mixes the
+ * channels into one value: it looks each channel up in a table of its own
+ * (pre), adds them up with fixed weights, and then looks the sum up in a
+ * table per output channel (lut). With weights of 1/3 each that is exactly
+ * greyscale's (blue + green + red) / 3, since 21846 / 65536 is close enough
+ * to 1/3 for any sum up to 765.
+ *
+ * Either kind followed by a plain operation is the same kind of operation
+ * with its output tables run through the second one's. A plain operation
+ * followed by a mono one is a mono operation with the first one's tables
+ * run through the second one's pre tables. And a mono operation followed
+ * by another makes each output channel a function of the first one's
+ * mixed value, so it is a mono operation with new output tables. So any
+ * chain of point operations folds into a single one, exactly.
+ *****************************************************************************/
+
+// The weights of a mono operation are in 1/65536ths.
+#define WEIGHT_BITS 16
+#define ONE (1 << WEIGHT_BITS)
+
+// The weights of the channels in a pixel's luminance (ITU-R BT.601), in
+// blue, green, red order; they add up to exactly ONE.
+static const int luma_weights[3] = {7471, 38470, 19595};
+
+
+static unsigned char clamp_byte(double v) {
+    return v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char) (v + 0.5);
+}
+
+
+static void set_identity(unsigned char *table) {
+    for (int v = 0; v < 256; v++) {
+        table[v] = v;
+    }
+}
+
+
+/*
+ * Set up op as a plain operation that looks every channel up in table.
+ */
+static void plain_op(PointOp *op, const unsigned char *table) {
+    op->mono = 0;
+    for (int ch = 0; ch < 3; ch++) {
+        set_identity(op->pre[ch]);
+        memcpy(op->lut[ch], table, 256);
+    }
+}
+
+
+/*
+ * Set up op as a mono operation that mixes the channels with the given
+ * weights (and bias), and leaves the mixed value as it is.
+ */
+static void mono_op(PointOp *op, const int *weights, int bias) {
+    op->mono = 1;
+    for (int ch = 0; ch < 3; ch++) {
+        set_identity(op->pre[ch]);
+        set_identity(op->lut[ch]);
+        op->weights[ch] = weights[ch];
+    }
+    op->bias = bias;
+}
+
+
+static inline int mix(const PointOp *op, int blue, int green, int red) {
+    return (op->weights[0] * op->pre[0][blue] + op->weights[1] * op->pre[1][green] +
+            op->weights[2] * op->pre[2][red] + op->bias) >> WEIGHT_BITS;
+}
+
+
+void compose_point_ops(PointOp *op, const PointOp *next) {
+    if (!next->mono) {
+        for (int ch = 0; ch < 3; ch++) {
+            for (int v = 0; v < 256; v++) {
+                op->lut[ch][v] = next->lut[ch][op->lut[ch][v]];
+            }
+        }
+    } else if (!op->mono) {
+        for (int ch = 0; ch < 3; ch++) {
+            for (int v = 0; v < 256; v++) {
+                op->pre[ch][v] = next->pre[ch][op->lut[ch][v]];
+            }
+            memcpy(op->lut[ch], next->lut[ch], 256);
+            op->weights[ch] = next->weights[ch];
+        }
+        op->bias = next->bias;
+        op->mono = 1;
+    } else {
+        unsigned char lut[3][256];
+        for (int v = 0; v < 256; v++) {
+            int mixed = mix(next, op->lut[0][v], op->lut[1][v], op->lut[2][v]);
+            for (int ch = 0; ch < 3; ch++) {
+                lut[ch][v] = next->lut[ch][mixed];
+            }
+        }
+        memcpy(op->lut, lut, sizeof(lut));
+    }
+}
+
+
+/******************************************************************************
+ * The operations of the filters.
+ *****************************************************************************/
+int greyscale_op(PointOp *op, const double *params, int n) {
+    static const int thirds[3] = {21846, 21846, 21846};
+    mono_op(op, thirds, 0);
+    return n == 0 ? 0 : -1;
+}
+
+
+int invert_op(PointOp *op, const double *params, int n) {
+    unsigned char table[256];
+    for (int v = 0; v < 256; v++) {
+        table[v] = 255 - v;
+    }
+    plain_op(op, table);
+    return n == 0 ? 0 : -1;
+}
+
+
+/*
+ * brightness [contrast]: add brightness (-255 to 255) to every channel, and
+ * stretch the channels away from (or, below 0, squeeze them towards) the
+ * middle by contrast percent (at least -100).
+ */
+int brightness_contrast_op(PointOp *op, const double *params, int n) {
+    double brightness = n > 0 ? params[0] : 0;
+    double contrast = n > 1 ? params[1] : 0;
+    if (n < 1 || n > 2 || brightness < -255 || brightness > 255 || contrast < -100) {
+        return -1;
+    }
+    unsigned char table[256];
+    for (int v = 0; v < 256; v++) {
+        table[v] = clamp_byte((v - 127.5) * (1 + contrast / 100) + 127.5 + brightness);
+    }
+    plain_op(op, table);
+    return 0;
+}
+
+
+/*
+ * gamma: raise every channel (as a fraction of 255) to the power 1 / gamma,
+ * so a gamma above 1 brightens the mid-tones and one below 1 darkens them.
+ */
+int gamma_op(PointOp *op, const double *params, int n) {
+    if (n != 1 || !(params[0] > 0)) {
+        return -1;
+    }
+    unsigned char table[256];
+    for (int v = 0; v < 256; v++) {
+        table[v] = clamp_byte(255 * pow(v / 255.0, 1 / params[0]));
+    }
+    plain_op(op, table);
+    return 0;
+}
+
+
+/*
+ * [level]: make pixels whose luminance is at least level (128 by default)
+ * white, and the others black.
+ */
+int threshold_op(PointOp *op, const double *params, int n) {
+    int level = n > 0 ? (int) ceil(params[0]) : 128;
+    if (n > 1 || (n == 1 && !(params[0] >= 0 && params[0] <= 256))) {
+        return -1;
+    }
+    mono_op(op, luma_weights, ONE / 2);
+    for (int v = 0; v < 256; v++) {
+        unsigned char out = v >= level ? 255 : 0;
+        op->lut[0][v] = op->lut[1][v] = op->lut[2][v] = out;
+    }
+    return 0;
+}
+
+
+/*
+ * The usual sepia matrix, applied to the pixel's luminance: each output
+ * channel is the luminance times the sum of its row of the matrix.
+ */
+int sepia_op(PointOp *op, const double *params, int n) {
+    static const double tones[3] = {
+        0.272 + 0.534 + 0.131,       // blue
+        0.349 + 0.686 + 0.168,       // green
+        0.393 + 0.769 + 0.189,       // red
+    };
+    mono_op(op, luma_weights, ONE / 2);
+    for (int ch = 0; ch < 3; ch++) {
+        for (int v = 0; v < 256; v++) {
+            op->lut[ch][v] = clamp_byte(v * tones[ch]);
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+
+/*
+ * black [white [gamma]]: map black (and below) to 0 and white (255 by
+ * default, and above) to 255, stretching the levels in between, then apply
+ * gamma (1 by default) as the gamma filter does.
+ */
+int levels_op(PointOp *op, const double *params, int n) {
+    double black = n > 0 ? params[0] : 0;
+    double white = n > 1 ? params[1] : 255;
+    double gamma = n > 2 ? params[2] : 1;
+    if (n < 1 || n > 3 || black < 0 || !(white > black) || white > 255 || !(gamma > 0)) {
+        return -1;
+    }
+    unsigned char table[256];
+    for (int v = 0; v < 256; v++) {
+        double level = (v - black) / (white - black);
+        level = level < 0 ? 0 : level > 1 ? 1 : level;
+        table[v] = clamp_byte(255 * pow(level, 1 / gamma));
+    }
+    plain_op(op, table);
+    return 0;
+}
+
+
+int parse_point_params(double *params, char **args, int n) {
+    if (n > MAX_POINT_PARAMS) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        char *end;
+        params[i] = strtod(args[i], &end);
+        if (end == args[i] || *end != '\0') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+
+/******************************************************************************
+ * Applying an operation.
+ *
+ * The scalar version looks up every channel on its own; a mono operation
+ * that only depends on the sum of the channels (as greyscale does) looks
+ * its output up by that sum, in tables worked out for the row. The AVX-512
+ * version works on 64 pixels (192 bytes) at a time, with vpermi2b doing the
+ * table lookups: two of them look up 64 bytes in the two halves of a table,
+ * and the top bit of each byte picks which half it came from. A mono
+ * operation is split into its planes first (with the same shuffles), and
+ * the mixed value is worked out 16 pixels at a time in 32-bit lanes.
+ *****************************************************************************/
+typedef void (*PointKernel)(const PointOp *op, unsigned char *out,
+                            const unsigned char *in, int n);
+
+static int is_identity(const unsigned char *table) {
+    for (int v = 0; v < 256; v++) {
+        if (table[v] != v) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static void apply_scalar(const PointOp *op, unsigned char *out,
+                         const unsigned char *in, int n) {
+    if (!op->mono) {
+        for (int i = 0; i < n; i++) {
+            out[3 * i] = op->lut[0][in[3 * i]];
+            out[3 * i + 1] = op->lut[1][in[3 * i + 1]];
+            out[3 * i + 2] = op->lut[2][in[3 * i + 2]];
+        }
+        return;
+    }
+
+    if (op->weights[0] == op->weights[1] && op->weights[1] == op->weights[2] &&
+        is_identity(op->pre[0]) && is_identity(op->pre[1]) && is_identity(op->pre[2])) {
+        // The mixed value only depends on the sum of the channels (as with
+        // greyscale), so look the output up by that.
+        unsigned char sums[3][3 * 255 + 1];
+        for (int sum = 0; sum <= 3 * 255; sum++) {
+            int v = (sum * op->weights[0] + op->bias) >> WEIGHT_BITS;
+            for (int ch = 0; ch < 3; ch++) {
+                sums[ch][sum] = op->lut[ch][v];
+            }
+        }
+        if (memcmp(sums[0], sums[1], sizeof(sums[0])) == 0 &&
+            memcmp(sums[1], sums[2], sizeof(sums[0])) == 0) {
+            for (int i = 0; i < n; i++) {
+                unsigned char v = sums[0][in[3 * i] + in[3 * i + 1] + in[3 * i + 2]];
+                out[3 * i] = out[3 * i + 1] = out[3 * i + 2] = v;
+            }
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            int sum = in[3 * i] + in[3 * i + 1] + in[3 * i + 2];
+            out[3 * i] = sums[0][sum];
+            out[3 * i + 1] = sums[1][sum];
+            out[3 * i + 2] = sums[2][sum];
+        }
+        return;
+    }
+
+    // Otherwise, weigh the pre tables first, so that mixing is three
+    // lookups and two adds.
+    int weighted[3][256];
+    for (int ch = 0; ch < 3; ch++) {
+        for (int v = 0; v < 256; v++) {
+            weighted[ch][v] = op->weights[ch] * op->pre[ch][v] + (ch == 0 ? op->bias : 0);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int v = (weighted[0][in[3 * i]] + weighted[1][in[3 * i + 1]] +
+                 weighted[2][in[3 * i + 2]]) >> WEIGHT_BITS;
+        out[3 * i] = op->lut[0][v];
+        out[3 * i + 1] = op->lut[1][v];
+        out[3 * i + 2] = op->lut[2][v];
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+#define AVX512_TARGET "avx512f,avx512bw,avx512vbmi"
+
+// A table, as the four 64-byte vectors vpermi2b needs.
+typedef struct {
+    __m512i lo[2];              // Entries 0 to 127.
+    __m512i hi[2];              // Entries 128 to 255.
+} Table512;
+
+__attribute__((target(AVX512_TARGET)))
+static void load_table(Table512 *t, const unsigned char *table) {
+    t->lo[0] = _mm512_loadu_si512(table);
+    t->lo[1] = _mm512_loadu_si512(table + 64);
+    t->hi[0] = _mm512_loadu_si512(table + 128);
+    t->hi[1] = _mm512_loadu_si512(table + 192);
+}
+
+__attribute__((target(AVX512_TARGET)))
+static inline __m512i lookup512(const Table512 *t, __m512i v) {
+    __m512i lo = _mm512_permutex2var_epi8(t->lo[0], v, t->lo[1]);
+    __m512i hi = _mm512_permutex2var_epi8(t->hi[0], v, t->hi[1]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), lo, hi);
+}
+
+// The q-th 16 bytes of v.
+__attribute__((target(AVX512_TARGET)))
+static inline __m128i quarter512(__m512i v, int q) {
+    switch (q) {
+    case 0: return _mm512_extracti32x4_epi32(v, 0);
+    case 1: return _mm512_extracti32x4_epi32(v, 1);
+    case 2: return _mm512_extracti32x4_epi32(v, 2);
+    default: return _mm512_extracti32x4_epi32(v, 3);
+    }
+}
+
+// split_index[ch]: where byte i of plane ch is in 192 packed bytes, as
+// indices into the first two vectors and then (minus 128) into the third.
+// merge_index[k]: where byte i of packed vector k is in the three planes,
+// as indices into the first two planes and then (minus 128) the third.
+static unsigned char split_index[3][2][64] __attribute__((aligned(64)));
+static unsigned char merge_index[3][2][64] __attribute__((aligned(64)));
+static __mmask64 split_mask[3];     // The bytes taken from the third vector.
+static __mmask64 merge_mask[3];     // The bytes taken from the third plane.
+static __mmask64 channel_mask[3][3];  // Packed vector k's bytes of channel ch.
+
+static void init_indices(void) {
+    for (int g = 0; g < 192; g++) {
+        int pixel = g / 3, ch = g % 3, vec = g / 64, lane = g % 64;
+        int from_third = g >= 128;
+        split_index[ch][from_third][pixel] = g % 128;
+        if (from_third) {
+            split_mask[ch] |= 1ULL << pixel;
+        }
+        int in_third = ch == 2;
+        merge_index[vec][in_third][lane] = (ch % 2) * 64 + pixel;
+        if (in_third) {
+            merge_mask[vec] |= 1ULL << lane;
+        }
+        channel_mask[vec][ch] |= 1ULL << lane;
+    }
+}
+
+__attribute__((target(AVX512_TARGET)))
+static void apply_avx512(const PointOp *op, unsigned char *out,
+                         const unsigned char *in, int n) {
+    Table512 lut[3], pre[3];
+    int uniform = 1, pre_identity = 1;
+    for (int ch = 0; ch < 3; ch++) {
+        load_table(&lut[ch], op->lut[ch]);
+        load_table(&pre[ch], op->pre[ch]);
+        uniform &= memcmp(op->lut[ch], op->lut[0], 256) == 0;
+        pre_identity &= is_identity(op->pre[ch]);
+    }
+    int i = 0;
+
+    if (!op->mono) {
+        // Every channel of every pixel is looked up on its own, in place in
+        // the packed bytes; 64 bytes start at channel 0, 1, 2 in turn.
+        for (; i + 64 <= n; i += 64) {
+            for (int k = 0; k < 3; k++) {
+                __m512i v = _mm512_loadu_si512(in + 3 * i + 64 * k);
+                __m512i r = lookup512(&lut[0], v);
+                if (!uniform) {
+                    r = _mm512_mask_blend_epi8(channel_mask[k][1], r, lookup512(&lut[1], v));
+                    r = _mm512_mask_blend_epi8(channel_mask[k][2], r, lookup512(&lut[2], v));
+                }
+                _mm512_storeu_si512(out + 3 * i + 64 * k, r);
+            }
+        }
+        apply_scalar(op, out + 3 * i, in + 3 * i, n - i);
+        return;
+    }
+
+    const __m512i weights[3] = {
+        _mm512_set1_epi32(op->weights[0]),
+        _mm512_set1_epi32(op->weights[1]),
+        _mm512_set1_epi32(op->weights[2]),
+    };
+    const __m512i bias = _mm512_set1_epi32(op->bias);
+    for (; i + 64 <= n; i += 64) {
+        __m512i v[3], planes[3];
+        for (int k = 0; k < 3; k++) {
+            v[k] = _mm512_loadu_si512(in + 3 * i + 64 * k);
+        }
+        for (int ch = 0; ch < 3; ch++) {
+            __m512i p = _mm512_permutex2var_epi8(v[0], _mm512_load_si512(split_index[ch][0]), v[1]);
+            planes[ch] = _mm512_mask_permutexvar_epi8(p, split_mask[ch],
+                                                      _mm512_load_si512(split_index[ch][1]), v[2]);
+            if (!pre_identity) {
+                planes[ch] = lookup512(&pre[ch], planes[ch]);
+            }
+        }
+        // The mixed values, 16 at a time.
+        __m128i mixed[4];
+        for (int q = 0; q < 4; q++) {
+            __m512i sum = bias;
+            for (int ch = 0; ch < 3; ch++) {
+                __m512i wide = _mm512_cvtepu8_epi32(quarter512(planes[ch], q));
+                sum = _mm512_add_epi32(sum, _mm512_mullo_epi32(wide, weights[ch]));
+            }
+            mixed[q] = _mm512_cvtepi32_epi8(_mm512_srli_epi32(sum, WEIGHT_BITS));
+        }
+        __m512i m = _mm512_inserti32x4(_mm512_castsi128_si512(mixed[0]), mixed[1], 1);
+        m = _mm512_inserti32x4(m, mixed[2], 2);
+        m = _mm512_inserti32x4(m, mixed[3], 3);
+
+        planes[0] = lookup512(&lut[0], m);
+        planes[1] = uniform ? planes[0] : lookup512(&lut[1], m);
+        planes[2] = uniform ? planes[0] : lookup512(&lut[2], m);
+        for (int k = 0; k < 3; k++) {
+            __m512i p = _mm512_permutex2var_epi8(planes[0], _mm512_load_si512(merge_index[k][0]),
+                                                 planes[1]);
+            p = _mm512_mask_permutexvar_epi8(p, merge_mask[k],
+                                             _mm512_load_si512(merge_index[k][1]), planes[2]);
+            _mm512_storeu_si512(out + 3 * i + 64 * k, p);
+        }
+    }
+    apply_scalar(op, out + 3 * i, in + 3 * i, n - i);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static PointKernel apply_bytes = apply_scalar;
+
+/*
+ * Use AVX-512 when the CPU has it (with VBMI, for vpermi2b), unless
+ * IMAGE_FILTER_SIMD asks for something narrower (see kernels.c). There is
+ * no SSSE3 or AVX2 version: pshufb only looks up 16 entries, so a 256-entry
+ * table takes 16 shuffles and blends per vector, which is no faster than
+ * the scalar loads.
+ */
+__attribute__((constructor))
+static void pick_point_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    const char *force = getenv("IMAGE_FILTER_SIMD");
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vbmi") &&
+        (force == NULL || strcmp(force, "avx512") == 0)) {
+        init_indices();
+        apply_bytes = apply_avx512;
+    }
+#endif
+}
+
+
+void apply_point_op(const PointOp *op, Pixel *out, const Pixel *in, int n) {
+    apply_bytes(op, (unsigned char *) out, (const unsigned char *) in, n);
+}
+
+
+/*
+ * Bands of rows that are all in memory, for the filter threads to share.
+ */
+typedef struct {
+    const PointOp *op;
+    Pixel *out;
+    const Pixel *in;
+    int width;
+    int height;
+    int band_height;
+} PointBands;
+
+
+static void point_band(void *arg, int band) {
+    PointBands *bands = arg;
+    int first = band * bands->band_height;
+    int last = min(first + bands->band_height, bands->height);
+    for (int y = first; y < last; y++) {
+        size_t offset = (size_t) y * bands->width;
+        apply_point_op(bands->op, bands->out + offset, bands->in + offset, bands->width);
+    }
+}
+
+
+void point_filter(Bitmap *bmp, PointOpMaker make) {
+    PointOp op;
+    if (make(&op, bmp->params, bmp->num_params) == -1) {
+        fprintf(stderr, "Invalid arguments for a point filter\n");
+        exit(1);
+    }
+    int width = bmp->width;
+    int height = bmp->height;
+
+    // Rows that are in memory already are looked up in place, or straight
+    // from the input into the output.
+    Pixel *out = output_rows(bmp, height);
+    if (out != NULL) {
+        const Pixel *in = input_rows(bmp, height);
+        if (in == NULL) {
+            read_rows(bmp, out, height);
+            in = out;
+        }
+        PointBands bands = {&op, out, in, width, height, rows_per_block(width)};
+        int num_bands = (height + bands.band_height - 1) / bands.band_height;
+        ThreadPool *pool = get_filter_pool();
+        if (pool != NULL) {
+            pool_run(pool, point_band, &bands, num_bands);
+        } else {
+            for (int band = 0; band < num_bands; band++) {
+                point_band(&bands, band);
+            }
+        }
+        return;
+    }
+    int block = rows_per_block(width);
+    Pixel *rows = alloc_rows(width, block);
+    for (int y = 0; y < height; y += block) {
+        int n = min(block, height - y);
+        const Pixel *in = input_rows(bmp, n);
+        if (in == NULL) {
+            read_rows(bmp, rows, n);
+            in = rows;
+        }
+        for (int r = 0; r < n; r++) {
+            apply_point_op(&op, rows + (size_t) r * width, in + (size_t) r * width, width);
+        }
+        write_rows(bmp, rows, n);
+    }
+    free(rows);
+}
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+
+/******************************************************************************
+ * Image pyramids.
+ *
+ * Each level is half the size of the one before it (rounded up), and each
+ * of its pixels is the average of a 2-by-2 block of the level before; on
+ * an odd edge, the last row or column is paired with itself. Rows are
+ * pushed through the levels as they are read: a level adds up each row it
+ * gets in pairs of pixels, and once it has a second row it finishes an
+ * output row, writes it, and pushes it on to the next level. So every
+ * level only ever holds one row.
+ *****************************************************************************/
+typedef struct {
+    Bitmap *bmp;             // The level's header and output.
+    int in_width;            // The width of the rows it gets.
+    int width;
+    uint16_t *sums;          // The pair sums of the row waiting for a second.
+    int pending;             // Whether there is such a row.
+    Pixel *row;              // The output row.
+} Level;
+
+
+/*
+ * Add up the pixels of a row in horizontal pairs.
+ */
+static void pair_sums(uint16_t *sums, const Pixel *in, int in_width, int width) {
+    const unsigned char *bytes = (const unsigned char *) in;
+    for (int x = 0; x < width; x++) {
+        int right = min(2 * x + 1, in_width - 1);
+        for (int ch = 0; ch < 3; ch++) {
+            sums[3 * x + ch] = bytes[6 * x + ch] + bytes[3 * right + ch];
+        }
+    }
+}
+
+
+static void push_row(Level *levels, int k, int num_levels, const Pixel *in);
+
+/*
+ * Finish level k's output row from its pending sums and these (the sums of
+ * the row below), write it, and push it on to the next level.
+ */
+static void finish_row(Level *levels, int k, int num_levels, const uint16_t *below) {
+    Level *level = &levels[k];
+    unsigned char *out = (unsigned char *) level->row;
+    for (int i = 0; i < 3 * level->width; i++) {
+        out[i] = (level->sums[i] + below[i] + 2) >> 2;
+    }
+    level->pending = 0;
+    write_rows(level->bmp, level->row, 1);
+    if (k + 1 < num_levels) {
+        push_row(levels, k + 1, num_levels, level->row);
+    }
+}
+
+
+static void push_row(Level *levels, int k, int num_levels, const Pixel *in) {
+    Level *level = &levels[k];
+    if (!level->pending) {
+        pair_sums(level->sums, in, level->in_width, level->width);
+        level->pending = 1;
+        return;
+    }
+    uint16_t below[3 * level->width];
+    pair_sums(below, in, level->in_width, level->width);
+    finish_row(levels, k, num_levels, below);
+}
+
+
+void write_pyramid(Bitmap *bmp, FILE **outs, int num_levels) {
+    Level levels[num_levels];
+    int width = bmp->width, height = bmp->height;
+    for (int k = 0; k < num_levels; k++) {
+        Level *level = &levels[k];
+        level->in_width = width;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+
+        // Every level gets a copy of the header to rewrite.
+        level->bmp = malloc(sizeof(Bitmap));
+        unsigned char *header = malloc(bmp->headerSize);
+        level->sums = malloc(sizeof(uint16_t) * 3 * width);
+        if (level->bmp == NULL || header == NULL || level->sums == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        *level->bmp = *bmp;
+        memcpy(header, bmp->header, bmp->headerSize);
+        level->bmp->header = header;
+        level->bmp->out = (PixelStream) {.fp = outs[k]};
+        resize(level->bmp, width, height);
+        write_header(level->bmp);
+
+        level->width = width;
+        level->pending = 0;
+        level->row = alloc_rows(width, 1);
+    }
+
+    Pixel *buf = alloc_rows(bmp->width, 1);
+    for (int y = 0; y < bmp->height; y++) {
+        const Pixel *row = input_rows(bmp, 1);
+        if (row == NULL) {
+            read_rows(bmp, buf, 1);
+            row = buf;
+        }
+        push_row(levels, 0, num_levels, row);
+    }
+    // A level with an odd number of rows pairs the last one with itself;
+    // that may leave the next level with a row to finish, too.
+    for (int k = 0; k < num_levels; k++) {
+        if (levels[k].pending) {
+            finish_row(levels, k, num_levels, levels[k].sums);
+        }
+    }
+
+    free(buf);
+    for (int k = 0; k < num_levels; k++) {
+        free(levels[k].sums);
+        free(levels[k].row);
+        free_bitmap(levels[k].bmp);
+    }
+}
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE  // For memmem and strcasestr.
 #include "request.h"
 #include "response.h"
+#include "bitmap.h"
+#include "metrics.h"
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 
 
 /******************************************************************************
@@ -11,6 +16,11 @@ ClientState *init_clients(int n) {
     for (int i = 0; i < n; i++) {
         clients[i].sock = -1;  // -1 here indicates available entry
         clients[i].num_bytes = 0;
+        clients[i].reqData = NULL;
+        clients[i].last_active = 0;
+        clients[i].busy = 0;
+        clients[i].arrived = 0;
+        clients[i].arena = (Arena) {0};
         memset(clients[i].buf, 0, sizeof(clients[i].buf));
     }
     return clients;
@@ -21,26 +31,21 @@ ClientState *init_clients(int n) {
  * fields of the ClientState struct, and close the socket.
  */
 void remove_client(ClientState *cs) {
-    if (cs->reqData != NULL) {
-        free(cs->reqData->method);
-        free(cs->reqData->path);
-        cs->reqData->path = NULL;
-        cs->reqData->method = NULL;
-        for (int i = 0; i < MAX_QUERY_PARAMS && cs->reqData->params[i].name != NULL; i++) {
-            free(cs->reqData->params[i].name);
-            cs->reqData->params[i].name = NULL;
-            free(cs->reqData->params[i].value);
-            cs->reqData->params[i].value = NULL;
-        }
-        free(cs->reqData);
-        cs->reqData = NULL;
-    }
+    clear_request(cs);
+    arena_release(&cs->arena);
     close(cs->sock);
     cs->sock = -1;
     cs->num_bytes = 0;
 }
 
 
+void clear_request(ClientState *cs) {
+    // Everything parsed from the request came from the arena.
+    cs->reqData = NULL;
+    arena_reset(&cs->arena);
+}
+
+
 /*
  * Search the first inbuf characters of buf for a network newline ("\r\n").
  * Return the index *immediately after* the location of the '\n'
@@ -92,6 +97,7 @@ int read_from_client(ClientState *client) {
     char* after = client->buf + client->num_bytes;
     nbytes = read(client->sock, after, sizeof(client->buf) - 1 -client->num_bytes);
     if(nbytes > 0) {
+        metrics_bytes_received(nbytes);
         client->num_bytes += nbytes;
         client->buf[client->num_bytes] = '\0';
     }
@@ -103,9 +109,7 @@ int read_from_client(ClientState *client) {
  * Parsing the start line of an HTTP request.
  ****************************************************************************/
 // Helper function declarations.
-void parse_query(ReqData *req, const char *str);
-void update_fdata(Fdata *f, const char *str);
-void fdata_free(Fdata *f);
+void parse_query(Arena *arena, ReqData *req, char *str);
 void log_request(const ReqData *req);
 
 
@@ -116,20 +120,20 @@ void log_request(const ReqData *req);
 int parse_req_start_line(ClientState *client) {
     int where;
     if((where = find_network_newline(client->buf, client->num_bytes)) > 0){
-        //allocate memory for a ReqData
-        ReqData *req = malloc(sizeof(ReqData));
+        //allocate a ReqData (with every param unset) from the client's arena,
+        //along with everything parsed into it
+        Arena *arena = &client->arena;
+        ReqData *req = arena_alloc(arena, sizeof(ReqData));
+        memset(req, 0, sizeof(ReqData));
         client->reqData = req;
-        char* method;
-        char* path;
-        char *rest = strchr(client->buf, ' ');
+        // Parse a copy of just the line: the buffer may hold more of the
+        // request, or the next request.
+        char line[MAXLINE];
+        memcpy(line, client->buf, where - 2);
+        line[where - 2] = '\0';
+        char *rest = strchr(line, ' ');
         if(rest){
-            //length of the method
-            int length = rest - client->buf;
-            //+1 for null terminator
-            method = malloc(length + 1);
-            memcpy(method, client->buf, length);
-            method[length] = '\0';
-            req->method = method; 
+            req->method = arena_strndup(arena, line, rest - line);
         } else{
             //Did not read method, since not separated by space
             return 0;
@@ -141,30 +145,19 @@ int parse_req_start_line(ClientState *client) {
             //if not ? then check if only space separated for target 
             other = strchr(rest, ' ');
             if(other){
-                int len = other - rest;
-                path = malloc(len + 1);
-                memcpy(path, rest, len);
-                path[len] = '\0';
-                req->path = path;
+                req->path = arena_strndup(arena, rest, other - rest);
             } else {
                 //did not read target
                 return 0;
             }
         } else {
-            int len = other - rest;
-            path = malloc(len + 1);
-            memcpy(path, rest, len);
-            path[len] = '\0';
-            req->path = path;
+            req->path = arena_strndup(arena, rest, other - rest);
             other++;
             char* remaining = strchr(other, ' ');
             if(remaining){
-                int len = remaining - other;
-                char* params = malloc(len + 1);
-                memcpy(params, other, len);
-                params[len] = '\0';
-                parse_query(client->reqData, params);
-                free(params);
+                // The query is parsed in place, in the copy of the line.
+                *remaining = '\0';
+                parse_query(arena, req, other);
             } else{
                 return 0;
             }
@@ -179,36 +172,193 @@ int parse_req_start_line(ClientState *client) {
 
 
 /*
- * Initializes req->params from the key-value pairs contained in the given 
- * string.
- * Assumes that the string is the part after the '?' in the HTTP request target,
- * e.g., name1=value1&name2=value2.
+ * Copy the header line at the front of the client's buffer (without its
+ * "\r\n") into line, which has room for MAXLINE bytes, reading more of the
+ * request as necessary, and remove the line from the buffer. Return 0 on
+ * success and -1 if no complete line arrives.
  */
-void parse_query(ReqData *req, const char *str) {
-    char* copy = malloc(strlen(str) + 1);
-    strcpy(copy, str); 
-    char* separated;
-    int i = 0;
-    separated  = strtok(copy, "=&");
-    while(separated != NULL){
-        int len = strlen(separated);
-        char *pair = malloc(len + 1);
-        strcpy(pair, separated);
-        if(i % 2 == 0){
-            //name of Fdata
-            req->params[i/2].name = pair;
-        } else{
-            req->params[i/2].value = pair; 
+static int take_line(ClientState *client, char *line) {
+    int where;
+    while ((where = find_network_newline(client->buf, client->num_bytes)) < 0) {
+        if (read_from_client(client) <= 0) {
+            return -1;
         }
-        i++;
-        separated = strtok(NULL, "=&");
     }
-    free(copy);
+    memcpy(line, client->buf, where - 2);
+    line[where - 2] = '\0';
+    remove_buffered_line(client);
+    return 0;
+}
+
+
+int parse_req_headers(ClientState *client) {
+    ReqData *req = client->reqData;
+    // HTTP/1.1 connections stay open unless the client says otherwise,
+    // and HTTP/1.0 ones are closed unless it asks.
+    char line[MAXLINE];
+    if (take_line(client, line) == -1) {
+        return -1;
+    }
+    int len = strlen(line);
+    req->keep_alive = len >= 8 && strcmp(line + len - 8, "HTTP/1.1") == 0;
+    req->content_length = -1;
+    req->content_type = NULL;
+    req->chunked = 0;
+    req->expect_continue = 0;
+
+    int got_line;
+    while ((got_line = take_line(client, line) != -1) && line[0] != '\0') {
+        char *value = strchr(line, ':');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        if (strcasecmp(line, "Connection") == 0) {
+            if (strcasecmp(value, "close") == 0) {
+                req->keep_alive = 0;
+            } else if (strcasecmp(value, "keep-alive") == 0) {
+                req->keep_alive = 1;
+            }
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            char *end;
+            req->content_length = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || req->content_length < 0) {
+                return -1;
+            }
+        } else if (strcasecmp(line, "Content-Type") == 0) {
+            req->content_type = arena_strndup(&client->arena, value, strlen(value));
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            // Without "chunked" last, the body can't be told apart from
+            // the next request.
+            if (strcasecmp(value, "chunked") != 0) {
+                return -1;
+            }
+            req->chunked = 1;
+        } else if (strcasecmp(line, "Expect") == 0) {
+            req->expect_continue = strcasecmp(value, "100-continue") == 0;
+        }
+    }
+    if (!got_line) {
+        return -1;
+    }
+    // A chunked body starts with the size of its first chunk, and
+    // Content-Length doesn't count for it.
+    req->body_left = req->chunked || req->content_length < 0 ? 0 : req->content_length;
+    return 0;
+}
+
+
+/*
+ * Start the next chunk of a chunked body: read its size line, or, after the
+ * last chunk, the trailer. Return 0 on success and -1 if the chunk is
+ * malformed.
+ */
+static int next_chunk(ClientState *client) {
+    ReqData *req = client->reqData;
+    char line[MAXLINE];
+    if (take_line(client, line) == -1) {
+        return -1;
+    }
+    char *end;
+    req->body_left = strtol(line, &end, 16);
+    if (end == line || (*end != '\0' && *end != ';') || req->body_left < 0) {
+        return -1;
+    }
+    if (req->body_left == 0) {
+        // The last chunk: skip any trailer fields, up to the empty line.
+        req->chunked = 0;
+        do {
+            if (take_line(client, line) == -1) {
+                return -1;
+            }
+        } while (line[0] != '\0');
+    }
+    return 0;
+}
 
 
+ssize_t read_req_body(ClientState *client, char *dst, size_t len) {
+    ReqData *req = client->reqData;
+    if (req->expect_continue) {
+        // (Otherwise the client waits a while before sending anyway.)
+        const char *go_ahead = "HTTP/1.1 100 Continue\r\n\r\n";
+        req->expect_continue = 0;
+        if (write(client->sock, go_ahead, strlen(go_ahead)) == -1) {
+            return -1;
+        }
+    }
+    if (req->body_left == 0 && req->chunked && next_chunk(client) == -1) {
+        return -1;
+    }
+    if (req->body_left == 0) {
+        return 0;
+    }
+    if (len > (size_t) req->body_left) {
+        len = req->body_left;
+    }
+
+    // Whatever has been read into the client's buffer comes first; after
+    // that, read straight into dst.
+    ssize_t n;
+    if (client->num_bytes > 0) {
+        n = min(len, (size_t) client->num_bytes);
+        memcpy(dst, client->buf, n);
+        client->num_bytes -= n;
+        memmove(client->buf, client->buf + n, client->num_bytes);
+    } else {
+        do {
+            n = read(client->sock, dst, len);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return -1;
+        }
+        metrics_bytes_received(n);
+    }
+    req->body_left -= n;
+
+    // Each chunk's data is followed by a CRLF.
+    if (req->body_left == 0 && req->chunked) {
+        char line[MAXLINE];
+        if (take_line(client, line) == -1 || line[0] != '\0') {
+            return -1;
+        }
+    }
+    return n;
 }
 
 
+int skip_req_body(ClientState *client) {
+    char scratch[4096];
+    ssize_t n;
+    while ((n = read_req_body(client, scratch, sizeof(scratch))) > 0) {
+    }
+    return n;
+}
+
+
+/*
+ * Initializes req->params from the key-value pairs contained in the given 
+ * string, copying the names and values into the arena. Pairs after the
+ * first MAX_QUERY_PARAMS are ignored.
+ * Assumes that the string is the part after the '?' in the HTTP request target,
+ * e.g., name1=value1&name2=value2. The string is modified.
+ */
+void parse_query(Arena *arena, ReqData *req, char *str) {
+    char *saveptr;
+    char *pair = strtok_r(str, "&", &saveptr);
+    for (int i = 0; i < MAX_QUERY_PARAMS && pair != NULL; i++) {
+        char *value = strchr(pair, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        } else {
+            value = "";
+        }
+        req->params[i].name = arena_strndup(arena, pair, strlen(pair));
+        req->params[i].value = arena_strndup(arena, value, strlen(value));
+        pair = strtok_r(NULL, "&", &saveptr);
+    }
+}
 
 
 /*
@@ -227,134 +377,224 @@ void log_request(const ReqData *req) {
  * Parsing multipart form data (image-upload)
  *****************************************************************************/
 
-char *get_boundary(ClientState *client) {
-    int len_header = strlen(POST_BOUNDARY_HEADER);
+/*
+ * Read more of the body into the upload's buffer, first moving what hasn't
+ * been used yet to the front. Return the number of bytes read, 0 if the
+ * buffer is full or the body has all been read, or -1 on a malformed body.
+ */
+static int fill_upload(Upload *upload) {
+    if (upload->start > 0) {
+        upload->end -= upload->start;
+        memmove(upload->data, upload->data + upload->start, upload->end);
+        upload->start = 0;
+    }
+    if (upload->eof || upload->end == UPLOAD_BUFFER_BYTES) {
+        return 0;
+    }
+    ssize_t n = read_req_body(upload->client, upload->data + upload->end,
+                              UPLOAD_BUFFER_BYTES - upload->end);
+    if (n > 0) {
+        upload->end += n;
+    } else if (n == 0) {
+        upload->eof = 1;
+    }
+    return n;
+}
 
-    while (1) {
-        int where = find_network_newline(client->buf, client->num_bytes);
-        if (where > 0) {
-            if (where < len_header || strncmp(POST_BOUNDARY_HEADER, client->buf, len_header) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the boundary string!
-                // We are going to add "--" to the beginning to make it easier
-                // to match the boundary line later
-                char *boundary = malloc(where - len_header + 1);
-                strncpy(boundary, "--", where - len_header + 1);
-                strncat(boundary, client->buf + len_header, where - len_header - 1);
-                boundary[where - len_header] = '\0';
-                return boundary;
-            }
-        } else {
-            // Need to read more bytes
-            if (read_from_client(client) <= 0) {
-                // Couldn't read; this is a bad request, so give up.
-                return NULL;
-            }
+
+/*
+ * Return the offset in the upload's buffer of the next occurrence of the
+ * given bytes, or -1 if they aren't in the unused part of it.
+ */
+static int find_in_upload(const Upload *upload, const char *what, int len) {
+    char *found = memmem(upload->data + upload->start, upload->end - upload->start, what, len);
+    return found == NULL ? -1 : found - upload->data;
+}
+
+
+/*
+ * Return the offset just past the "\r\n" ending the next line in the
+ * upload's buffer, reading more of the body as necessary, or -1 if there
+ * is no such line.
+ */
+static int next_upload_line(Upload *upload) {
+    int where;
+    while ((where = find_in_upload(upload, "\r\n", 2)) == -1) {
+        if (fill_upload(upload) <= 0) {
+            return -1;
         }
     }
-    return NULL;
+    return where + 2;
 }
 
 
-char *get_bitmap_filename(ClientState *client, const char *boundary) {
-    int len_boundary = strlen(boundary);
+int start_upload(Upload *upload, ClientState *client) {
+    memset(upload, 0, sizeof(Upload));
+    upload->client = client;
+    char *boundary = get_boundary(client);
+    if (boundary == NULL) {
+        return -1;
+    }
+    upload->len_delimiter = strlen(boundary) + 2;
+    upload->delimiter = arena_alloc(&client->arena, upload->len_delimiter + 1);
+    strcpy(upload->delimiter, "\r\n");
+    strcat(upload->delimiter, boundary);
+    upload->data = malloc(UPLOAD_BUFFER_BYTES);
+    if (upload->data == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    // The first boundary starts the body rather than following a CRLF; a
+    // CRLF in front of the body lets it be found like any other.
+    memcpy(upload->data, "\r\n", 2);
+    upload->end = 2;
+    return 0;
+}
 
-    // Read until finding the boundary string.
-    while (1) {
-        int where = find_network_newline(client->buf, client->num_bytes);
-        if (where > 0) {
-            if (where < len_boundary + 2 ||
-                    strncmp(boundary, client->buf, len_boundary) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the line with the boundary!
-                remove_buffered_line(client);
+
+void end_upload(Upload *upload) {
+    free(upload->data);
+}
+
+
+char *get_boundary(ClientState *client) {
+    int len_prefix = strlen(POST_BOUNDARY_PREFIX);
+    const char *type = client->reqData->content_type;
+    if (type == NULL || strncmp(type, POST_BOUNDARY_PREFIX, len_prefix) != 0) {
+        return NULL;
+    }
+    // We are going to add "--" to the beginning to make it easier
+    // to match the boundary line later
+    const char *raw = type + len_prefix;
+    char *boundary = arena_alloc(&client->arena, strlen(raw) + 3);
+    strcpy(boundary, "--");
+    strcat(boundary, raw);
+    return boundary;
+}
+
+
+char *get_bitmap_filename(Upload *upload) {
+    // Skip the preamble, up to the first boundary.
+    int where;
+    while ((where = find_in_upload(upload, upload->delimiter, upload->len_delimiter)) == -1) {
+        // Keep just enough to match a boundary split across reads.
+        upload->start = max(upload->start, upload->end - upload->len_delimiter + 1);
+        if (fill_upload(upload) <= 0) {
+            return NULL;
+        }
+    }
+    upload->start = where + upload->len_delimiter;
+    if ((where = next_upload_line(upload)) == -1) {
+        return NULL;
+    }
+    upload->start = where;
+
+    // Then look through the part's headers, up to the empty line.
+    char *filename = NULL;
+    while ((where = next_upload_line(upload)) != -1 && where - upload->start > 2) {
+        char *line = upload->data + upload->start;
+        int len = where - upload->start - 2;
+        upload->start = where;
+        line[len] = '\0';  // Over the '\r', so strings end with the line.
+        char *raw_filename = strcasestr(line, "Content-Disposition:") == line ?
+                             strstr(line, "filename=\"") : NULL;
+        if (raw_filename != NULL) {
+            raw_filename += strlen("filename=\"");
+            char *quote = strchr(raw_filename, '"');
+            if (quote == NULL) {
                 break;
             }
-        } else {
-            // Need to read more bytes
-            if (read_from_client(client) <= 0) {
-                // Couldn't read; this is a bad request, so give up.
-                return NULL;
-            }
+            filename = arena_strndup(&upload->client->arena, raw_filename,
+                                     quote - raw_filename);
         }
     }
+    if (where == -1 || filename == NULL || filename[0] == '\0' || filename[0] == '.' ||
+            strchr(filename, '/') != NULL) {
+        return NULL;
+    }
+    upload->start = where;
+    return filename;
+}
 
-    int where = find_network_newline(client->buf, client->num_bytes);
-
-    client->buf[where-1] = '\0';  // Used for strrchr to work on just the single line.
-    char *raw_filename = strrchr(client->buf, '=') + 2;
-    int len_filename = client->buf + where - 3 - raw_filename;
-    char *filename = malloc(len_filename + 1);
-    strncpy(filename, raw_filename, len_filename);
-    filename[len_filename] = '\0';
 
-    // Restore client->buf
-    client->buf[where - 1] = '\n';
-    remove_buffered_line(client);
-    return filename;
+/*
+ * Check that the start of an uploaded file is the header of a BMP in a
+ * format the filters can read (see parse_bmp_info), and set *image_size to
+ * the size the header implies. Return 0 if so and -1 otherwise.
+ */
+static int check_bitmap_header(const unsigned char *data, int len, off_t *image_size) {
+    BmpInfo info;
+    if (parse_bmp_info(data, len, &info) == -1) {
+        return -1;
+    }
+    *image_size = info.header_size + (off_t) info.row_bytes * info.height;
+    return 0;
 }
 
+
 /*
- * Read the file data from the socket and write it to the file descriptor
- * file_fd.
- * You know when you have reached the end of the file in one of two ways:
- *    - search for the boundary string in each chunk of data read 
- * (Remember the "\r\n" that comes before the boundary string, and the 
- * "--\r\n" that comes after.)
- *    - extract the file size from the bitmap data, and use that to determine
- * how many bytes to read from the socket and write to the file
+ * Write all len bytes of data to fd. Return 0 on success and -1 on failure.
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd) {
-    // Read in the next two lines: Content-Type line, and empty line
-    remove_buffered_line(client);
-    remove_buffered_line(client);
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            perror("write");
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-    // IMPLEMENT THIS
-    int file_size;
-    //check if we have image_size
-    if(client->num_bytes > 2 + sizeof(int)){
-        memcpy(&file_size, &(client->buf[2]), sizeof(int));
-        if(file_size < client->num_bytes){
-            if(write(file_fd, client->buf, file_size) != file_size){
-                perror("write");
-                exit(1);
-            }
+
+int save_file_upload(Upload *upload, int file_fd) {
+    // Wait for enough of the BMP header to tell its format (or the end of
+    // the file, if it's shorter than that) and check it before writing
+    // anything.
+    int where;
+    while ((where = find_in_upload(upload, upload->delimiter, upload->len_delimiter)) == -1 &&
+           upload->end - upload->start < BMP_INFO_BYTES) {
+        if (fill_upload(upload) <= 0) {
+            return -1;
         }
-    
-        if(write(file_fd, client->buf, client->num_bytes) != client->num_bytes){
-            perror("write");
-            exit(1);
+    }
+    int len = (where == -1 ? upload->end : where) - upload->start;
+    off_t image_size;
+    if (check_bitmap_header((unsigned char *) upload->data + upload->start, len, &image_size) == -1) {
+        return -1;
+    }
+
+    // Then write the data as it comes, holding back just enough to match a
+    // boundary split across reads.
+    off_t written = 0;
+    while ((where = find_in_upload(upload, upload->delimiter, upload->len_delimiter)) == -1) {
+        int safe = max(upload->start, upload->end - upload->len_delimiter + 1);
+        if (write_all(file_fd, upload->data + upload->start, safe - upload->start) == -1) {
+            return -1;
         }
-        file_size -= client->num_bytes;
-        while(file_size > 0){
-            if(file_size < sizeof(client->buf)){
-                int n = read(client->sock, client->buf, file_size);
-                if(n < 0){
-                    perror("read");
-                    exit(1);
-                }
-                if(write(file_fd, client->buf, n) != n){
-                    perror("write");
-                    exit(1);
-                }
-                file_size -= n;
-            } else {
-                int n = read(client->sock, client->buf, sizeof(client->buf) - 1);
-                if(n < 0){
-                    perror("read");
-                    exit(1);
-                }
-                if(write(file_fd, client->buf, n) != n){
-                    perror("write");
-                    exit(1);
-                }
-                file_size -= n;
-            }
+        written += safe - upload->start;
+        upload->start = safe;
+        if (fill_upload(upload) <= 0) {
+            return -1;
         }
     }
-    see_other_response(client->sock, MAIN_HTML);
-    client->num_bytes = 0;
-    return 0;
+    if (write_all(file_fd, upload->data + upload->start, where - upload->start) == -1) {
+        return -1;
+    }
+    written += where - upload->start;
+    upload->start = where + upload->len_delimiter;
+    if (written < image_size) {
+        return -1;
+    }
+
+    // Whatever else is in the body (the final "--", more parts) is ignored.
+    upload->start = upload->end;
+    while (fill_upload(upload) > 0) {
+        upload->start = upload->end;
+    }
+    return upload->eof ? 0 : -1;
 }
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include "arena.h"
 
 
 #define MAX_QUERY_PARAMS 5
@@ -16,11 +18,24 @@
 #define MAIN_HTML "/main.html"
 #define IMAGE_FILTER "/image-filter"
 #define IMAGE_UPLOAD "/image-upload"
+#define METRICS "/metrics"
+#define THUMBNAIL "/thumbnail"
 
 #define IMAGE_DIR "images/"
 #define FILTER_DIR "filters/"
+#define THUMBNAIL_DIR "thumbnails/"
 
-#define POST_BOUNDARY_HEADER "Content-Type: multipart/form-data; boundary="
+// How many levels of thumbnails are made for each image (half, a quarter,
+// an eighth of its size, ...).
+#define NUM_THUMBNAILS 3
+
+#define POST_BOUNDARY_PREFIX "multipart/form-data; boundary="
+
+// How long an idle persistent connection is kept open, in seconds.
+#define KEEP_ALIVE_TIMEOUT 15
+
+// The size of the buffer an upload is read through.
+#define UPLOAD_BUFFER_BYTES (1 << 20)
 
 
 // A struct representing a key-value pair as a query params
@@ -34,12 +49,27 @@ typedef struct formdata {
  *
  * The params array should be parsed from the 'query' field.
  * If there are fewer than MAX_QUERY_PARAMS, each remaining Fdata 
- * value should have its fields set to NULL.
+ * value should have its fields set to NULL. A param without a value
+ * (e.g. "?name") has an empty one.
+ *
+ * The ReqData and every string it points to belong to the client's arena,
+ * so they last until clear_request (or remove_client) and are never freed
+ * on their own.
  */
 typedef struct {
     char *method;       // Either "GET" or "POST"
     char *path;         // Request path, e.g. "main.html" or "image-filter"
     Fdata params[MAX_QUERY_PARAMS];  // An array of query params.
+    // The following are set by parse_req_headers.
+    int keep_alive;     // Whether the connection stays open afterwards.
+    long content_length;  // The Content-Length header, or -1 if none.
+    char *content_type;   // The Content-Type header, or NULL if none.
+    // The following keep track of reading the body (see read_req_body).
+    int expect_continue;  // Whether the client waits for "100 Continue"
+                          // before sending the body.
+    int chunked;        // Whether more chunks of a chunked body are to come.
+    long body_left;     // The bytes of the body, or of its current chunk,
+                        // not read yet.
 } ReqData;
 
 
@@ -51,7 +81,15 @@ typedef struct {
     int num_bytes;       // The number of bytes currently in the buffer
                          // (must be between 0 and MAXLINE - 1).
     ReqData *reqData;    // The data parsed from the first line of the HTTP 
-                         // request from the client.
+                         // request from the client (allocated from arena).
+    Arena arena;         // Owns everything parsed from the current request;
+                         // reset by clear_request.
+    time_t last_active;  // When the client last sent anything (for the
+                         // keep-alive timeout).
+    int busy;            // Whether the request is being responded to
+                         // (rather than the server waiting for one).
+    double arrived;      // When the current request arrived (see
+                         // metrics.h), or 0 if none has yet.
 } ClientState;
 
 
@@ -61,12 +99,19 @@ typedef struct {
 ClientState *init_clients(int n);
 
 /*
- * Frees memory allocated for the given client fields.
+ * Frees memory allocated for the given client fields, including its arena.
  * Doesn't actually free the client itself since it is allocated as part of
  * an array of ClientState, but sets its sock value to -1 to act as a flag.
  */
 void remove_client(ClientState *cs);
 
+/*
+ * Free the request data of the given client by resetting its arena,
+ * keeping its socket and buffer, so that the client can send another
+ * request.
+ */
+void clear_request(ClientState *cs);
+
 
 /******************************************************************************
  * Functions for directly maniputing client buffers.
@@ -78,6 +123,13 @@ void remove_client(ClientState *cs);
  */
 int read_from_client(ClientState *client);
 
+/*
+ * Search the first inbuf characters of buf for a network newline ("\r\n").
+ * Return the index *immediately after* the location of the '\n'
+ * if the network newline is found, or -1 otherwise.
+ */
+int find_network_newline(const char *buf, int inbuf);
+
 
 /******************************************************************************
  * Functions for parsing parts of the HTTP request
@@ -85,15 +137,83 @@ int read_from_client(ClientState *client);
 
 /*
  * Parse the start line of an HTTP request, storing the data in client->reqData.
+ * Return 1 on success, and 0 if the line is incomplete or malformed (in
+ * which case whatever was parsed is released with the arena).
  */
 int parse_req_start_line(ClientState *client);
 
 
 /*
- * Return the boundary string for this request.
- * This should be returned in a separate dynamically-allocated,
- * null-terminated string (note that the boundary in the raw request data is
- * certainly *not* null-terminated).
+ * Read and parse the headers of the request whose start line has been
+ * parsed, removing the start line and headers from the client's buffer.
+ * This sets the keep_alive, content_length and content_type fields of
+ * client->reqData, and gets it ready to read the body (which is either
+ * Content-Length bytes long or chunked). (The socket must be blocking.)
+ *
+ * Return 0 on success and -1 if the headers are malformed or the client
+ * stopped sending before the end of them.
+ */
+int parse_req_headers(ClientState *client);
+
+
+/*
+ * Read up to len bytes of the request body into dst, after the bytes read
+ * by earlier calls, undoing the chunked encoding if the body has it. Nothing
+ * past the end of the body is consumed, so the next request (if any) stays
+ * at the front of the client's buffer.
+ *
+ * A client that sent "Expect: 100-continue" is told to go ahead first.
+ *
+ * Return the number of bytes read, 0 at the end of the body, or -1 if the
+ * body is malformed or the client stops sending before the end of it.
+ */
+ssize_t read_req_body(ClientState *client, char *dst, size_t len);
+
+
+/*
+ * Skip (the rest of) the body of a request, so that the next request on the
+ * connection starts at the front of the buffer. Return 0 on success and -1
+ * if the body couldn't be read.
+ */
+int skip_req_body(ClientState *client);
+
+
+/******************************************************************************
+ * Functions for reading an uploaded file from a multipart/form-data body.
+ *****************************************************************************/
+
+/*
+ * An upload being read from a request body.
+ *
+ * The body is read through a buffer of UPLOAD_BUFFER_BYTES, so a large
+ * file takes a read and a write per megabyte rather than per line, and is
+ * scanned for the boundary that ends it as it goes by.
+ */
+typedef struct {
+    ClientState *client;
+    char *delimiter;     // "\r\n--" followed by the boundary (in the
+                         // client's arena).
+    int len_delimiter;
+    char *data;          // The buffer.
+    int start;           // data[start..end) has been read but not used yet.
+    int end;
+    int eof;             // Whether the whole body has been read.
+} Upload;
+
+
+/*
+ * Get ready to read the upload in the client's request. Return 0 on
+ * success and -1 if the request isn't multipart/form-data with a boundary.
+ * Release the upload with end_upload either way.
+ */
+int start_upload(Upload *upload, ClientState *client);
+void end_upload(Upload *upload);
+
+
+/*
+ * Return the boundary string for this request, with "--" in front of it.
+ * This is returned in a null-terminated string allocated from the client's
+ * arena.
  *
  * Return NULL if no boundary string is found.
  */
@@ -101,33 +221,31 @@ char *get_boundary(ClientState *client);
 
 
 /*
- * Return the filename of the bitmap image for this request, using the
- * given boundary string to detect sections.
- * This should be returned in a separate dynamically-allocated,
- * null-terminated string (note that the filename in the raw request data is
- * certainly *not* null-terminated).
- * Make sure not to include the quotation marks in the filename.
+ * Return the filename of the bitmap image for this upload, read from the
+ * headers of the first part of the body, leaving the upload at the start of
+ * the file data. This is returned in a null-terminated string allocated
+ * from the client's arena, without the quotation marks.
  *
- * Return NULL if no filename string is found.
+ * Return NULL if no filename is found, or it isn't a plain file name (it
+ * contains a '/' or starts with a '.').
  */
-char *get_bitmap_filename(ClientState *client, const char *boundary);
+char *get_bitmap_filename(Upload *upload);
 
 
 /*
- * Finally, read the bitmap image data from the request and write it
- * to the given fd (representing a file).
- *
- * Use the boundary string to determine when the file data stops,
- * as described on the assignment handout.
+ * Read the bitmap image data from the upload and write it to the given fd
+ * (representing a file), up to the boundary that ends it, then read the
+ * rest of the body.
  *
- * Return 0 if boundary string was found at the end of the request,
- * and -1 otherwise (this indicates a bad request).
+ * The image is checked as it arrives: its header has to be that of a BMP in
+ * a format the filters can read (24-bit, 32-bit or 8-bit with a palette;
+ * see parse_bmp_info), and it has to hold all the pixels the header says it
+ * does.
  *
- * HINT: You may assume that the characters "\r\n--<boundary>--\r\n" are
- * guaranteed to be the last characters in the request data.
- * Just remember there's no null-terminator.
+ * Return 0 on success, and -1 if the data isn't such an image or the body
+ * ends without the boundary (this indicates a bad request).
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd);
+int save_file_upload(Upload *upload, int file_fd);
 
 
 #endif /* REQUEST_H_*/
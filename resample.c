@@ -0,0 +1,446 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/******************************************************************************
+ * Resizing by an arbitrary ratio.
+ *
+ * Every output pixel is a weighted sum of the input pixels around it, and
+ * the weights only depend on the pixel's column (horizontally) and row
+ * (vertically), so they are worked out once per column and once per row,
+ * in a WeightTable. The resizing is then a horizontal pass over each input
+ * row, which makes a row of the output width, and a vertical pass over the
+ * rows each output row needs; whichever shrinks the image goes first.
+ * Input rows are read in order and only the rows the current output row
+ * needs are kept, so the memory used is a few rows of the image width.
+ *
+ * Everything is integer fixed point: weights are in Q14 (they add up to
+ * exactly 1 << 14) and the rows between the passes hold Q7 values (the
+ * pixel value times 128) in 16 bits, clamped to the range of a pixel.
+ * That lets the vertical pass multiply and add pairs of rows at a time
+ * with SSE2 or AVX2. When an output pixel is made of so many input pixels
+ * that Q14 can't tell their weights apart (an area weight rounds to 0 past
+ * a ratio of about 1 << 14), its weights get more bits, and the passes
+ * add them up in 64 bits.
+ *
+ * The weights follow the usual filters, widened by the ratio when
+ * downscaling so that every input pixel contributes:
+ *   - area: the fraction of each input pixel that the output pixel covers;
+ *   - bilinear: a triangle filter;
+ *   - bicubic: the Keys cubic with a = -0.5.
+ * Near the border, the weights of the input pixels that exist are scaled
+ * up to make up for the ones that don't.
+ *****************************************************************************/
+#define WEIGHT_BITS 14
+#define TAP_BITS 6                 // The bits each weight gets on average,
+#define MAX_WEIGHT_BITS 28         // as long as the total stays within this.
+#define VALUE_BITS 7
+
+typedef struct {
+    int size;                // The number of output columns or rows.
+    int taps;                // The most input pixels any of them uses.
+    int bits;                // The weights of each add up to 1 << bits.
+    int *first;              // The first input pixel each one uses.
+    int32_t *weights;        // taps weights for each one (some of them 0).
+} WeightTable;
+
+
+static double triangle(double x) {
+    x = fabs(x);
+    return x < 1 ? 1 - x : 0;
+}
+
+
+static double cubic(double x) {
+    const double a = -0.5;
+    x = fabs(x);
+    if (x < 1) {
+        return ((a + 2) * x - (a + 3)) * x * x + 1;
+    }
+    if (x < 2) {
+        return (((x - 5) * x + 8) * x - 4) * a;
+    }
+    return 0;
+}
+
+
+/*
+ * Work out the weights for resizing in_size pixels to out_size pixels.
+ */
+static void make_weights(WeightTable *table, int in_size, int out_size, ResampleMethod method) {
+    double ratio = (double) in_size / out_size;
+    double stretch = max(ratio, 1.0);
+    double support;
+    if (method == RESAMPLE_AREA) {
+        support = ratio / 2;
+    } else {
+        support = (method == RESAMPLE_BICUBIC ? 2 : 1) * stretch;
+    }
+    table->size = out_size;
+    table->taps = min((int) ceil(support) * 2 + 1, in_size);
+    table->bits = WEIGHT_BITS;
+    while (table->taps > 1 << (table->bits - TAP_BITS) && table->bits < MAX_WEIGHT_BITS) {
+        table->bits++;
+    }
+    table->first = malloc(sizeof(int) * out_size);
+    table->weights = calloc((size_t) out_size * table->taps, sizeof(int32_t));
+    // The taps can run into the millions, so this isn't on the stack.
+    double *raw = malloc(sizeof(double) * table->taps);
+    if (table->first == NULL || table->weights == NULL || raw == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int x = 0; x < out_size; x++) {
+        double centre = (x + 0.5) * ratio;
+        int first = max((int) floor(centre - support), 0);
+        int last = min((int) ceil(centre + support), in_size) - 1;
+        int count = min(last - first + 1, table->taps);
+
+        double total = 0;
+        for (int k = 0; k < count; k++) {
+            int i = first + k;
+            if (method == RESAMPLE_AREA) {
+                // The overlap of pixel i with [centre - support, centre + support).
+                raw[k] = max(0.0, min(i + 1.0, centre + support) - max((double) i, centre - support));
+            } else if (method == RESAMPLE_BILINEAR) {
+                raw[k] = triangle((i + 0.5 - centre) / stretch);
+            } else {
+                raw[k] = cubic((i + 0.5 - centre) / stretch);
+            }
+            total += raw[k];
+        }
+
+        // Every output pixel uses taps input pixels, with zero weights for
+        // the ones past its last, so the first is moved back near the end.
+        int shift = max(first + table->taps - in_size, 0);
+        table->first[x] = first - shift;
+
+        // Round to fixed point; any rounding error goes on the biggest weight.
+        int32_t *weights = table->weights + (size_t) x * table->taps + shift;
+        int sum = 0, biggest = 0;
+        for (int k = 0; k < count; k++) {
+            weights[k] = lround(raw[k] / total * (1 << table->bits));
+            sum += weights[k];
+            if (weights[k] > weights[biggest]) {
+                biggest = k;
+            }
+        }
+        weights[biggest] += (1 << table->bits) - sum;
+    }
+    free(raw);
+}
+
+
+static void free_weights(WeightTable *table) {
+    free(table->first);
+    free(table->weights);
+}
+
+
+/*
+ * Resize one row of pixels horizontally into out, 3 * table->size Q7 values.
+ */
+static void resize_row(int16_t *out, const Pixel *in, const WeightTable *table) {
+    const int max_value = 255 << VALUE_BITS;
+    const int64_t round = 1 << (table->bits - VALUE_BITS - 1);
+    int shift = table->bits - VALUE_BITS;
+    for (int x = 0; x < table->size; x++) {
+        const int32_t *weights = table->weights + (size_t) x * table->taps;
+        const Pixel *p = in + table->first[x];
+        int64_t blue = 0, green = 0, red = 0;
+        for (int k = 0; k < table->taps; k++) {
+            blue += (int64_t) weights[k] * p[k].blue;
+            green += (int64_t) weights[k] * p[k].green;
+            red += (int64_t) weights[k] * p[k].red;
+        }
+        out[3 * x] = min(max((blue + round) >> shift, 0), max_value);
+        out[3 * x + 1] = min(max((green + round) >> shift, 0), max_value);
+        out[3 * x + 2] = min(max((red + round) >> shift, 0), max_value);
+    }
+}
+
+
+/******************************************************************************
+ * The vertical pass.
+ *
+ * out[i] is the weighted sum of rows[k][i] over the n rows, back in 8 bits.
+ * The vector versions handle as many whole vectors as fit in [start, end)
+ * and return the index of the first value they did not handle; the scalar
+ * version finishes off the rest (and returns end).
+ *****************************************************************************/
+#define VERTICAL_ROUND (1 << (WEIGHT_BITS + VALUE_BITS - 1))
+#define VERTICAL_SHIFT (WEIGHT_BITS + VALUE_BITS)
+
+typedef int (*VerticalKernel)(unsigned char *out, const int16_t **rows,
+                              const int16_t *weights, int n, int start, int end);
+
+
+static int vertical_scalar(unsigned char *out, const int16_t **rows,
+                           const int16_t *weights, int n, int start, int end) {
+    for (int i = start; i < end; i++) {
+        int sum = VERTICAL_ROUND;
+        for (int k = 0; k < n; k++) {
+            sum += weights[k] * rows[k][i];
+        }
+        out[i] = min(max(sum >> VERTICAL_SHIFT, 0), 255);
+    }
+    return end;
+}
+
+
+/*
+ * The same for weights that add up to 1 << bits rather than to Q14, with
+ * too many rows for the sums to fit in 32 bits.
+ */
+static void vertical_wide(unsigned char *out, const int16_t **rows,
+                          const int32_t *weights, int n, int bits, int end) {
+    const int64_t round = (int64_t) 1 << (bits + VALUE_BITS - 1);
+    for (int i = 0; i < end; i++) {
+        int64_t sum = round;
+        for (int k = 0; k < n; k++) {
+            sum += (int64_t) weights[k] * rows[k][i];
+        }
+        out[i] = min(max(sum >> (bits + VALUE_BITS), 0), 255);
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * The weights of rows k and k + 1 (or 0 for the second when !pair), as
+ * the two 16-bit halves of a 32-bit lane. The halves are put together
+ * unsigned, since shifting a negative weight left is undefined.
+ */
+static inline int weight_pair(const int16_t *weights, int k, int pair) {
+    uint32_t second = pair ? (uint16_t) weights[k + 1] : 0;
+    return (int) ((uint32_t) (uint16_t) weights[k] | second << 16);
+}
+
+
+/*
+ * Rows are taken in pairs: interleaving the values of two rows lets
+ * madd multiply each by its row's weight and add the two products in one go.
+ * An odd row out is paired with itself and a weight of 0.
+ */
+__attribute__((target("sse2")))
+static int vertical_sse2(unsigned char *out, const int16_t **rows,
+                         const int16_t *weights, int n, int start, int end) {
+    int i = start;
+    for (; i + 8 <= end; i += 8) {
+        __m128i low = _mm_set1_epi32(VERTICAL_ROUND);
+        __m128i high = low;
+        for (int k = 0; k < n; k += 2) {
+            int pair = k + 1 < n;
+            __m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + i));
+            __m128i b = _mm_loadu_si128((const __m128i *) (rows[k + pair] + i));
+            __m128i w = _mm_set1_epi32(weight_pair(weights, k, pair));
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        __m128i values = _mm_packs_epi32(_mm_srai_epi32(low, VERTICAL_SHIFT),
+                                         _mm_srai_epi32(high, VERTICAL_SHIFT));
+        _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(values, values));
+    }
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+static int vertical_avx2(unsigned char *out, const int16_t **rows,
+                         const int16_t *weights, int n, int start, int end) {
+    int i = start;
+    for (; i + 16 <= end; i += 16) {
+        __m256i low = _mm256_set1_epi32(VERTICAL_ROUND);
+        __m256i high = low;
+        for (int k = 0; k < n; k += 2) {
+            int pair = k + 1 < n;
+            __m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (rows[k + pair] + i));
+            __m256i w = _mm256_set1_epi32(weight_pair(weights, k, pair));
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        // Unpacking and packing both work within 128-bit lanes, so the
+        // values come out in order, but the bytes need gathering up.
+        __m256i values = _mm256_packs_epi32(_mm256_srai_epi32(low, VERTICAL_SHIFT),
+                                            _mm256_srai_epi32(high, VERTICAL_SHIFT));
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(values, values), 0xD8);
+        _mm_storeu_si128((__m128i *) (out + i), _mm256_castsi256_si128(bytes));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static VerticalKernel vertical_bytes = vertical_scalar;
+
+/*
+ * Pick the widest kernel the CPU supports, as kernels.c does (and with the
+ * same IMAGE_FILTER_SIMD override).
+ */
+__attribute__((constructor))
+static void pick_vertical_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    const char *force = getenv("IMAGE_FILTER_SIMD");
+    __builtin_cpu_init();
+    if (force != NULL && strcmp(force, "scalar") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2") &&
+        (force == NULL || strcmp(force, "avx2") == 0 || strcmp(force, "avx512") == 0)) {
+        vertical_bytes = vertical_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        vertical_bytes = vertical_sse2;
+    }
+#endif
+}
+
+
+int parse_resample_method(const char *name, ResampleMethod *method) {
+    static const char *names[] = {"area", "bilinear", "bicubic"};
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *method = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Widen a row of n bytes to Q7 values.
+ */
+static void widen_row(int16_t *out, const unsigned char *in, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = in[i] << VALUE_BITS;
+    }
+}
+
+
+/*
+ * Round a row of n Q7 values back to bytes.
+ */
+static void narrow_row(unsigned char *out, const int16_t *in, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = (in[i] + (1 << (VALUE_BITS - 1))) >> VALUE_BITS;
+    }
+}
+
+
+void resample(Bitmap *bmp, ResampleMethod method) {
+    int in_width = bmp->width;
+    int out_width = bmp->out_width;
+    WeightTable columns, rows;
+    make_weights(&columns, in_width, out_width, method);
+    make_weights(&rows, bmp->height, bmp->out_height, method);
+
+    // The vertical pass works on whole rows with vector instructions, so
+    // when the image gets shorter it goes first and the horizontal pass only
+    // sees output rows; otherwise the horizontal pass goes first and the
+    // vertical pass only sees rows of the output width.
+    int vertical_first = bmp->out_height < bmp->height;
+    int ring_width = vertical_first ? in_width : out_width;
+    int values = 3 * ring_width;
+
+    // The last rows.taps input rows, resized horizontally unless
+    // vertical_first; input row k is kept in ring[k % rows.taps].
+    int16_t **ring = malloc(sizeof(int16_t *) * rows.taps);
+    // Each output row's rows and weights, leaving out the weights of 0;
+    // narrow_used is used as the vector kernels want it, in 16 bits.
+    const int16_t **window = malloc(sizeof(int16_t *) * rows.taps);
+    int32_t *used = malloc(sizeof(int32_t) * rows.taps);
+    int16_t *narrow_used = malloc(sizeof(int16_t) * rows.taps);
+    if (ring == NULL || window == NULL || used == NULL || narrow_used == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int k = 0; k < rows.taps; k++) {
+        ring[k] = malloc(sizeof(int16_t) * values);
+        if (ring[k] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    Pixel *in_buf = alloc_rows(in_width, 1);
+    Pixel *out_buf = alloc_rows(out_width, 1);
+    Pixel *tall_buf = vertical_first ? alloc_rows(in_width, 1) : NULL;
+    int16_t *short_buf = vertical_first ? malloc(sizeof(int16_t) * 3 * out_width) : NULL;
+    int next_in = 0;
+
+    for (int y = 0; y < rows.size; y++) {
+        const int32_t *weights = rows.weights + (size_t) y * rows.taps;
+        int first = rows.first[y];
+        int n = rows.taps;
+        // Input rows are needed in order, so only new ones are read.
+        while (next_in < first + n) {
+            const Pixel *in = input_rows(bmp, 1);
+            if (in == NULL) {
+                read_rows(bmp, in_buf, 1);
+                in = in_buf;
+            }
+            if (vertical_first) {
+                widen_row(ring[next_in % rows.taps], (const unsigned char *) in, values);
+            } else {
+                resize_row(ring[next_in % rows.taps], in, &columns);
+            }
+            next_in++;
+        }
+
+        // Rows with a weight of 0 are left out of the sums.
+        int num_used = 0;
+        for (int k = 0; k < n; k++) {
+            if (weights[k] != 0) {
+                window[num_used] = ring[(first + k) % rows.taps];
+                used[num_used++] = weights[k];
+            }
+        }
+        Pixel *out = output_rows(bmp, 1);
+        if (out == NULL) {
+            out = out_buf;
+        }
+        unsigned char *bytes = (unsigned char *) (vertical_first ? tall_buf : out);
+        if (rows.bits == WEIGHT_BITS) {
+            for (int k = 0; k < num_used; k++) {
+                narrow_used[k] = used[k];
+            }
+            int done = vertical_bytes(bytes, window, narrow_used, num_used, 0, values);
+            vertical_scalar(bytes, window, narrow_used, num_used, done, values);
+        } else {
+            vertical_wide(bytes, window, used, num_used, rows.bits, values);
+        }
+        if (vertical_first) {
+            resize_row(short_buf, tall_buf, &columns);
+            narrow_row((unsigned char *) out, short_buf, 3 * out_width);
+        }
+        if (out == out_buf) {
+            write_rows(bmp, out_buf, 1);
+        }
+    }
+
+    for (int k = 0; k < rows.taps; k++) {
+        free(ring[k]);
+    }
+    free(ring);
+    free(window);
+    free(used);
+    free(narrow_used);
+    free(in_buf);
+    free(out_buf);
+    free(tall_buf);
+    free(short_buf);
+    free_weights(&columns);
+    free_weights(&rows);
+}
@@ -1,70 +1,149 @@
+#define _GNU_SOURCE  // For memfd_create.
 #define MAXLINE 1024
 #define IMAGE_DIR "images/"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <dirent.h>  // Used to inspect directory contents.
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "response.h"
 #include "request.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "metrics.h"
 
 // Functions for internal use only.
-void write_image_list(int fd);
-void write_image_response_header(int fd);
+void write_image_list(FILE *out);
+void write_image_response_header(int fd, off_t length);
+static void write_response(int fd, const char *status, const char *headers,
+                           const char *body, size_t length);
+static off_t unpadded_bitmap_size(int image_fd);
+static int run_filter_to_memory(const char *filter, const char *name, int image_fd);
+static int run_filter_in_process(const char *name, int image_fd);
+static int make_thumbnails(const char *name);
+
+// Whether filters known to pipeline.c run in this process (see
+// set_in_process_filters).
+static int in_process_filters = 0;
+
+
+void set_in_process_filters(int enabled) {
+    in_process_filters = enabled;
+}
+
+
+// Whether the connection stays open after the current response.
+static int keep_alive = 0;
+
+
+void set_keep_alive(int enabled) {
+    keep_alive = enabled;
+}
 
 
 /*
- * Write the main.html response to the given fd.
- * This response dynamically populates the image-filter form with
- * the filenames located in IMAGE_DIR.
+ * Write the status line and headers of a response whose body is length
+ * bytes long. headers holds any other header lines (each ending in "\r\n").
  */
-void main_html_response(int fd) {
-    char *header =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-type: text/html\r\n\r\n";
+static void write_response_header(int fd, const char *status, const char *headers,
+                                  off_t length) {
+    metrics_first_byte();
+    metrics_count_status(atoi(status));
+    metrics_bytes_sent(dprintf(fd, "HTTP/1.1 %s\r\n%sContent-Length: %lld\r\n%s\r\n",
+                               status, headers, (long long) length,
+                               keep_alive ? "" : "Connection: close\r\n"));
+}
 
-    if(write(fd, header, strlen(header)) == -1) {
+
+/*
+ * Write a whole response with the given body.
+ */
+static void write_response(int fd, const char *status, const char *headers,
+                           const char *body, size_t length) {
+    write_response_header(fd, status, headers, length);
+    ssize_t n = write(fd, body, length);
+    if(n == -1) {
         perror("write");
     }
+    metrics_bytes_sent(n);
+}
 
+
+/*
+ * Write the main.html response to the given fd.
+ * This response dynamically populates the image-filter form with
+ * the filenames located in IMAGE_DIR.
+ */
+void main_html_response(int fd) {
+    // The page is put together in memory first, to know its length.
+    char *page;
+    size_t length;
+    FILE *out = open_memstream(&page, &length);
     FILE *in_fp = fopen("main.html", "r");
+    if (out == NULL || in_fp == NULL) {
+        perror("main.html");
+        exit(1);
+    }
     char buf[MAXLINE];
-    while (fgets(buf, MAXLINE, in_fp) > 0) {
-        if(write(fd, buf, strlen(buf)) == -1) {
-            perror("write");
-        }
+    while (fgets(buf, MAXLINE, in_fp) != NULL) {
+        fputs(buf, out);
         // Insert a bit of dynamic Javascript into the HTML page.
         // This assumes there's only one "<script>" element in the page.
         if (strncmp(buf, "<script>", strlen("<script>")) == 0) {
-            write_image_list(fd);
+            write_image_list(out);
         }
     }
     fclose(in_fp);
+    fclose(out);
+    write_response(fd, "200 OK", "Content-type: text/html\r\n", page, length);
+    free(page);
+}
+
+
+void metrics_response(int fd) {
+    char *page;
+    size_t length;
+    FILE *out = open_memstream(&page, &length);
+    if (out == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    write_metrics(out);
+    fclose(out);
+    write_response(fd, "200 OK", "Content-type: text/plain; version=0.0.4\r\n", page, length);
+    free(page);
 }
 
 
 /*
- * Write image directory contents to the given fd, in the format
+ * Write image directory contents to the given stream, in the format
  * "var filenames = ['<filename1>', '<filename2>', ...];\n"
  *
  * This is actually a line of Javascript that's used to populate the form
  * when the webpage is loaded.
  */
-void write_image_list(int fd) {
+void write_image_list(FILE *out) {
     DIR *d = opendir(IMAGE_DIR);
     struct dirent *dir;
 
-    dprintf(fd, "var filenames = [");
+    fprintf(out, "var filenames = [");
     if (d != NULL) {
         while ((dir = readdir(d)) != NULL) {
-            if (strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) {
-                dprintf(fd, "'%s', ", dir->d_name);
+            // This skips ".", ".." and uploads still in progress.
+            if (dir->d_name[0] != '.') {
+                fprintf(out, "'%s', ", dir->d_name);
             }
         }
         closedir(d);
     }
-    dprintf(fd, "];\n");
+    fprintf(out, "];\n");
 }
 
 
@@ -80,9 +159,10 @@ void write_image_list(int fd) {
  * 2. If the request is invalid, send an informative error message as a response
  *    using the internal_server_error_response function.
  *
- * 3. Otherwise, write an appropriate HTTP header for a bitmap file (we've
- *    provided a function to do so), and then use dup2 and execl to run
- *    the specified image filter and write the output directly to the socket.
+ * 3. Otherwise, run the specified image filter with its output going to an
+ *    in-memory file, and send that to the socket with sendfile, after an
+ *    HTTP header for a bitmap file of that length. (A copy of an image
+ *    that the filter would leave unchanged is sent straight from images/.)
  *
  *
  * Will execute the first "validated" filter and image
@@ -169,24 +249,266 @@ void image_filter_response(int fd, const ReqData *reqData) {
     }else if(filter_index == -3){
         bad_request_response(fd, "No executable filter");
     }else{
-        char copy_filt[strlen(path_filter) + 2];
+        char copy_filt[strlen(path_filter) + 3];
         copy_filt[0] = '\0';
         strcat(copy_filt, "./");
         strcat(copy_filt, path_filter);
         free(path_filter);
-        write_image_response_header(fd);
-        FILE* file = fopen(path_image, "rb");
+        int image = open(path_image, O_RDONLY);
         free(path_image);
-        if(dup2(fileno(file), STDIN_FILENO) == -1){
-            perror("dup2");
+        if(image == -1){
+            perror("open");
             exit(1);
         }
-        if(dup2(fd, STDOUT_FILENO) == -1){
+
+        // Copying an image whose rows need no padding gives back the file
+        // itself, so there is no need to run the filter at all.
+        off_t size = -1;
+        if(strcmp(reqData->params[filter_index].value, "copy") == 0){
+            size = unpadded_bitmap_size(image);
+        }
+        if(size >= 0){
+            send_image_response(fd, image, size);
+            close(image);
+            return;
+        }
+
+        // Popular images and filters are served from the result cache.
+        CacheKey key;
+        int cached = cache_key(&key, image, reqData->params[filter_index].value) == 0;
+        int output = cached ? cache_lookup(&key, &size) : -1;
+        metrics_cache_result(output >= 0);
+        if(output >= 0){
+            send_image_response(fd, output, size);
+            close(output);
+            close(image);
+            return;
+        }
+
+        const char *filter = reqData->params[filter_index].value;
+        double start = metrics_now();
+        if(in_process_filters && find_filter(filter) != NULL){
+            output = run_filter_in_process(filter, image);
+        } else {
+            output = run_filter_to_memory(copy_filt, filter, image);
+        }
+        metrics_filter_time(filter, metrics_now() - start);
+        close(image);
+        struct stat st;
+        if(output == -1 || fstat(output, &st) == -1){
+            internal_server_error_response(fd, "The filter failed.");
+            return;
+        }
+        if(cached){
+            cache_store(&key, output, st.st_size);
+        }
+        send_image_response(fd, output, st.st_size);
+        close(output);
+    }
+}
+
+
+void thumbnail_response(int fd, const ReqData *reqData) {
+    const char *name = NULL;
+    const char *size = NULL;
+    for(int i = 0; i < MAX_QUERY_PARAMS && reqData->params[i].name != NULL; i++){
+        if(name == NULL && strcmp("image", reqData->params[i].name) == 0){
+            name = reqData->params[i].value;
+        } else if(size == NULL && strcmp("size", reqData->params[i].name) == 0){
+            size = reqData->params[i].value;
+        }
+    }
+    if(name == NULL){
+        bad_request_response(fd, "No query parameter \"image\" found");
+        return;
+    }
+    if(strchr(name, '/') != NULL){
+        bad_request_response(fd, "A '/' was found in the image name");
+        return;
+    }
+
+    // The level that is size times smaller; the first (half the size) by
+    // default.
+    int level = 0;
+    if(size != NULL){
+        char *end;
+        long factor = strtol(size, &end, 10);
+        while(level < NUM_THUMBNAILS && (2L << level) != factor){
+            level++;
+        }
+        if(*end != '\0' || level == NUM_THUMBNAILS){
+            bad_request_response(fd, "No thumbnail of that size");
+            return;
+        }
+    }
+
+    char path[MAXLINE];
+    char thumbnail_path[strlen(THUMBNAIL_DIR) + strlen(name) + 1];
+    strcpy(thumbnail_path, THUMBNAIL_DIR);
+    strcat(thumbnail_path, name);
+    if(pyramid_level_path(path, sizeof(path), thumbnail_path, level) == -1){
+        bad_request_response(fd, "The image name is too long");
+        return;
+    }
+    int thumbnail = open(path, O_RDONLY);
+    if(thumbnail == -1){
+        // Images that weren't uploaded (or were uploaded before there were
+        // thumbnails) get theirs on their first request.
+        char image_path[strlen(IMAGE_DIR) + strlen(name) + 1];
+        strcpy(image_path, IMAGE_DIR);
+        strcat(image_path, name);
+        if(access(image_path, R_OK) == -1){
+            not_found_response(fd);
+            return;
+        }
+        if(make_thumbnails(name) == -1 || (thumbnail = open(path, O_RDONLY)) == -1){
+            internal_server_error_response(fd, "Couldn't make the thumbnail.");
+            return;
+        }
+    }
+    struct stat st;
+    if(fstat(thumbnail, &st) == -1){
+        perror("fstat");
+        internal_server_error_response(fd, "Couldn't read the thumbnail.");
+    } else {
+        send_image_response(fd, thumbnail, st.st_size);
+    }
+    close(thumbnail);
+}
+
+
+/*
+ * If the BMP file open on image_fd is a 24-bit one that consists of exactly
+ * its header and pixel rows that need no padding, return its size;
+ * otherwise return -1. (Any other image is changed by copying it.)
+ */
+static off_t unpadded_bitmap_size(int image_fd) {
+    unsigned char header[BMP_INFO_BYTES];
+    BmpInfo info;
+    struct stat st;
+    ssize_t len;
+    if(fstat(image_fd, &st) == -1 || (len = pread(image_fd, header, sizeof(header), 0)) == -1 ||
+       parse_bmp_info(header, len, &info) == -1){
+        return -1;
+    }
+    if(info.format != BMP_BGR24 || info.row_bytes != info.width * 3 ||
+       st.st_size != info.header_size + (off_t) info.row_bytes * info.height){
+        return -1;
+    }
+    return st.st_size;
+}
+
+
+/*
+ * Run the given filter on the image open on image_fd, with its output going
+ * to an in-memory file (which filters write into through a mapping).
+ * Return that file, or -1 if the filter failed.
+ */
+static int run_filter_to_memory(const char *filter, const char *name, int image_fd) {
+    int output = memfd_create("output.bmp", 0);
+    if(output == -1){
+        perror("memfd_create");
+        return -1;
+    }
+    int n = fork();
+    if(n < 0){
+        perror("fork");
+        close(output);
+        return -1;
+    }
+    if(n == 0){
+        if(dup2(image_fd, STDIN_FILENO) == -1 || dup2(output, STDOUT_FILENO) == -1){
             perror("dup2");
             exit(1);
         }
-        fclose(file);
-        execl(copy_filt, reqData->params[filter_index].value, NULL);
+        close(output);
+        execl(filter, name, NULL);
+        perror("execl");
+        exit(1);
+    }
+    int status;
+    if(waitpid(n, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        close(output);
+        return -1;
+    }
+    return output;
+}
+
+
+/*
+ * Whether the stage can filter the image open on image_fd: a BMP in a
+ * supported format with all of its rows there, and at least 3 by 3 for the
+ * filters that need a 3 by 3 neighbourhood. The filters exit on any other
+ * image, which in-process would take the whole worker down with it.
+ */
+static int can_filter(const FilterStage *stage, int image_fd) {
+    unsigned char header[BMP_INFO_BYTES];
+    BmpInfo info;
+    struct stat st;
+    ssize_t len;
+    if(fstat(image_fd, &st) == -1 || (len = pread(image_fd, header, sizeof(header), 0)) == -1 ||
+       parse_bmp_info(header, len, &info) == -1){
+        return 0;
+    }
+    if(st.st_size < info.header_size + (off_t) info.row_bytes * info.height){
+        return 0;
+    }
+    int three_by_three = strcmp(stage->spec->name, "edge_detection") == 0 ||
+                         (strcmp(stage->spec->name, "gaussian_blur") == 0 && stage->arg == 0);
+    return !three_by_three || (info.width >= 3 && info.height >= 3);
+}
+
+
+/*
+ * Like run_filter_to_memory, but run the filter (which must be in the
+ * filter table) in this process, rather than exec'ing the filter's program.
+ * The image is checked first, so that a bad one fails just its request.
+ */
+static int run_filter_in_process(const char *name, int image_fd) {
+    FilterStage stage;
+    if(parse_stage(name, &stage) == -1 || !can_filter(&stage, image_fd)){
+        return -1;
+    }
+    int output = memfd_create("output.bmp", 0);
+    if(output == -1){
+        perror("memfd_create");
+        return -1;
+    }
+    // The streams get their own descriptors, so closing them leaves
+    // image_fd and output open.
+    FILE *in = fdopen(dup(image_fd), "rb");
+    FILE *out = fdopen(dup(output), "w+b");
+    if(in == NULL || out == NULL){
+        perror("fdopen");
+        if(in != NULL){
+            fclose(in);
+        }
+        if(out != NULL){
+            fclose(out);
+        }
+        close(output);
+        return -1;
+    }
+    run_pipeline(&stage, 1, in, out);
+    fclose(in);
+    fclose(out);
+    return output;
+}
+
+
+void send_image_response(int fd, int file_fd, off_t size) {
+    write_image_response_header(fd, size);
+    off_t offset = 0;
+    while(offset < size){
+        ssize_t sent = sendfile(fd, file_fd, &offset, size - offset);
+        if(sent == -1 && errno == EINTR){
+            continue;
+        }
+        if(sent <= 0){
+            perror("sendfile");
+            return;
+        }
+        metrics_bytes_sent(sent);
     }
 }
 
@@ -194,30 +516,38 @@ void image_filter_response(int fd, const ReqData *reqData) {
 
 
 
+/*
+ * Reject an upload with a Bad Request response. What's left of the body
+ * can't be told apart from a next request, so the connection is closed.
+ */
+static int reject_upload(int fd, const char *message) {
+    set_keep_alive(0);
+    bad_request_response(fd, message);
+    return -1;
+}
+
+
 /*
  * Respond to an image-upload request.
- * We have provided the complete implementation of this function;
- * you shouldn't change it, but instead read through it carefully and implement
- * the required functions in `request.c` according to their docstrings.
  *
- * We've split up the parsing of the rest of the request data into different
- * steps, so at each step it's a bit easier for you to test your code.
+ * The image is written to a temporary file in IMAGE_DIR and only linked
+ * into place once all of it has arrived and checks out, so no one sees
+ * half an image, and an existing image is never replaced (even one that
+ * appeared while the upload was on its way).
  */
-void image_upload_response(ClientState *client) {
-    // First, extract the boundary string for the request.
-    char *boundary = get_boundary(client);
-    if (boundary == NULL) {
-        bad_request_response(client->sock, "Couldn't find boundary string in request.");
-        exit(1);
+int image_upload_response(ClientState *client) {
+    Upload upload;
+    if (start_upload(&upload, client) == -1) {
+        end_upload(&upload);
+        return reject_upload(client->sock, "Couldn't find boundary string in request.");
     }
-    fprintf(stderr, "Boundary string: %s\n", boundary);
+    fprintf(stderr, "Boundary string: %s\n", upload.delimiter + 2);
 
     // Use the boundary string to extract the name of the uploaded bitmap file.
-    char *filename = get_bitmap_filename(client, boundary);
+    char *filename = get_bitmap_filename(&upload);
     if (filename == NULL) {
-        bad_request_response(client->sock, "Couldn't find bitmap filename in request.");
-        close(client->sock);
-        exit(1);
+        end_upload(&upload);
+        return reject_upload(client->sock, "Couldn't find bitmap filename in request.");
     }
 
     // If the file already exists, send a Bad Request error to the user.
@@ -227,47 +557,131 @@ void image_upload_response(ClientState *client) {
 
     fprintf(stderr, "Bitmap path: %s\n", path);
 
+    const char *error = NULL;
+    char tmp[] = IMAGE_DIR ".upload.XXXXXX";
+    int file_fd = -1;
     if (access(path, F_OK) >= 0) {
-        bad_request_response(client->sock, "File already exists.");
-        exit(1);
+        error = "File already exists.";
+    } else if ((file_fd = mkstemp(tmp)) == -1) {
+        perror("mkstemp");
+        error = "Couldn't save the image.";
+    } else {
+        fchmod(file_fd, 0644);
+        if (save_file_upload(&upload, file_fd) == -1) {
+            error = "The upload isn't a complete bitmap image in a supported format.";
+        } else if (link(tmp, path) == -1) {
+            error = errno == EEXIST ? "File already exists." : "Couldn't save the image.";
+        }
+        close(file_fd);
+        unlink(tmp);
+    }
+    end_upload(&upload);
+    if (error != NULL) {
+        free(path);
+        return reject_upload(client->sock, error);
     }
 
-    FILE *file = fopen(path, "wb");
-    save_file_upload(client, boundary, fileno(file));
-    fclose(file);
-    free(boundary);
-    free(filename);
+    // Cached results for whatever was at this path don't apply any more.
+    cache_invalidate(path);
+    // Make the thumbnails now, so they are there for the first request.
+    make_thumbnails(path + strlen(IMAGE_DIR));
     free(path);
     see_other_response(client->sock, MAIN_HTML);
+    return 0;
 }
 
 
 /*
- * Write the header for a bitmap image response to the given fd.
+ * Write the NUM_THUMBNAILS thumbnails of the image with the given name in
+ * IMAGE_DIR to THUMBNAIL_DIR, in one pass over the image (see run_pyramid).
+ * Each goes to a temporary file first, and is renamed into place once it is
+ * complete. Return 0 on success and -1 on failure.
  */
-void write_image_response_header(int fd) {
-    char *response =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: image/bmp\r\n"
-        "Content-Disposition: attachment; filename=\"output.bmp\"\r\n\r\n";
+static int make_thumbnails(const char *name) {
+    if(mkdir(THUMBNAIL_DIR, 0755) == -1 && errno != EEXIST){
+        perror("mkdir");
+        return -1;
+    }
+    char image_path[strlen(IMAGE_DIR) + strlen(name) + 1];
+    strcpy(image_path, IMAGE_DIR);
+    strcat(image_path, name);
+    FILE *in = fopen(image_path, "rb");
+    if(in == NULL){
+        perror("fopen");
+        return -1;
+    }
+
+    char tmp[NUM_THUMBNAILS][sizeof(THUMBNAIL_DIR "tmp.XXXXXX")];
+    FILE *outs[NUM_THUMBNAILS];
+    int k, result = 0;
+    for(k = 0; k < NUM_THUMBNAILS; k++){
+        strcpy(tmp[k], THUMBNAIL_DIR "tmp.XXXXXX");
+        int out_fd = mkstemp(tmp[k]);
+        if(out_fd == -1 || (outs[k] = fdopen(out_fd, "wb")) == NULL){
+            perror("mkstemp");
+            if(out_fd != -1){
+                close(out_fd);
+                unlink(tmp[k]);
+            }
+            result = -1;
+            break;
+        }
+        fchmod(out_fd, 0644);
+    }
+    if(result == 0){
+        run_pyramid(in, outs, NUM_THUMBNAILS);
+    }
+    fclose(in);
+
+    // k is the number of temporary files made.
+    char thumbnail_path[strlen(THUMBNAIL_DIR) + strlen(name) + 1];
+    strcpy(thumbnail_path, THUMBNAIL_DIR);
+    strcat(thumbnail_path, name);
+    for(int i = 0; i < k; i++){
+        char path[MAXLINE];
+        if(fclose(outs[i]) != 0 || result == -1 ||
+           pyramid_level_path(path, sizeof(path), thumbnail_path, i) == -1 ||
+           rename(tmp[i], path) == -1){
+            unlink(tmp[i]);
+            result = -1;
+        }
+    }
+    if(result == -1){
+        fprintf(stderr, "Couldn't make the thumbnails of %s\n", image_path);
+    }
+    return result;
+}
 
-    write(fd, response, strlen(response));
+
+/*
+ * Write the header for a bitmap image response of the given length
+ * to the given fd.
+ */
+void write_image_response_header(int fd, off_t length) {
+    write_response_header(fd, "200 OK",
+                          "Content-Type: image/bmp\r\n"
+                          "Content-Disposition: attachment; filename=\"output.bmp\"\r\n",
+                          length);
 }
 
 
 void not_found_response(int fd) {
-    char *response =
-        "HTTP/1.1 404 Not Found\r\n"
-        "Content-Type: text/plain\r\n\r\n"
-        "Page not found.\r\n";
-    write(fd, response, strlen(response));
+    char *body = "Page not found.\r\n";
+    write_response(fd, "404 Not Found", "Content-Type: text/plain\r\n", body, strlen(body));
+}
+
+
+void service_unavailable_response(int fd) {
+    char *body = "The server is busy right now.";
+    // The connection is closed right after this.
+    keep_alive = 0;
+    write_response(fd, "503 Service Unavailable", "Content-Type: text/plain\r\n",
+                   body, strlen(body));
 }
 
 
 void internal_server_error_response(int fd, const char *message) {
-    char *response =
-        "HTTP/1.1 500 Internal Server Error\r\n"
-        "Content-Type: text/html\r\n\r\n"
+    char *response_body =
         "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
         "<html><head>\r\n"
         "<title>500 Internal Server Error</title>\r\n"
@@ -275,16 +689,14 @@ void internal_server_error_response(int fd, const char *message) {
         "<h1>Internal Server Error</h1>\r\n"
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
-
-    dprintf(fd, response, message);
+    char body_buf[MAXLINE];
+    int length = snprintf(body_buf, sizeof(body_buf), response_body, message);
+    write_response(fd, "500 Internal Server Error", "Content-Type: text/html\r\n",
+                   body_buf, min(length, (int) sizeof(body_buf) - 1));
 }
 
 
 void bad_request_response(int fd, const char *message) {
-    char *response_header =
-        "HTTP/1.1 400 Bad Request\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: %d\r\n\r\n";
     char *response_body = 
         "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
         "<html><head>\r\n"
@@ -293,24 +705,15 @@ void bad_request_response(int fd, const char *message) {
         "<h1>Bad Request</h1>\r\n"
         "<p>%s<p>\r\n"
         "</body></html>\r\n";
-    char header_buf[MAXLINE];
     char body_buf[MAXLINE];
-    sprintf(body_buf, response_body, message);
-    sprintf(header_buf, response_header, strlen(body_buf));
-    write(fd, header_buf, strlen(header_buf));
-    write(fd, body_buf, strlen(body_buf));
-    // Because we are making some simplfications with the HTTP protocol
-    // the browser will get a "connection reset" message. This happens
-    // because our server is closing the connection and terminating the process.
-    // So this is really a hack.
-    sleep(1);
+    int length = snprintf(body_buf, sizeof(body_buf), response_body, message);
+    write_response(fd, "400 Bad Request", "Content-Type: text/html\r\n",
+                   body_buf, min(length, (int) sizeof(body_buf) - 1));
 }
 
 
 void see_other_response(int fd, const char *other) {
-    char *response =
-        "HTTP/1.1 303 See Other\r\n"
-        "Location: %s\r\n\r\n";
-
-    dprintf(fd, response, other);
-}
\ No newline at end of file
+    char headers[MAXLINE];
+    snprintf(headers, sizeof(headers), "Location: %s\r\n", other);
+    write_response(fd, "303 See Other", headers, "", 0);
+}
@@ -2,6 +2,7 @@
 #define RESPONSE_H_
 
 #include <sys/socket.h>
+#include <sys/types.h>
 #include "request.h"
 
 
@@ -12,26 +13,65 @@
  */
 void main_html_response(int fd);
 
+/*
+ * Write the server's metrics (see metrics.h) to the given fd, in the
+ * Prometheus text format.
+ */
+void metrics_response(int fd);
+
 /*
  * Write an response for the image-filter route with the given request data.
  */
 void image_filter_response(int fd, const ReqData *reqData);
 
+/*
+ * Write a response for the thumbnail route: the image named by the "image"
+ * query parameter, scaled down by the factor given as "size" (2, 4, ...,
+ * 2 by default; see NUM_THUMBNAILS). Thumbnails missing from THUMBNAIL_DIR
+ * are made first.
+ */
+void thumbnail_response(int fd, const ReqData *reqData);
+
+/*
+ * With enabled set, image_filter_response runs the filters it knows about
+ * (see pipeline.h) in a child forked from the calling process instead of
+ * exec'ing the filter program. An image a filter rejects fails just that
+ * request, with a 500.
+ */
+void set_in_process_filters(int enabled);
+
+/*
+ * Whether the responses that follow tell the client that the connection
+ * stays open (the default is to say it will be closed). The server sets
+ * this for each request according to its headers.
+ */
+void set_keep_alive(int enabled);
+
+/*
+ * Send the first size bytes of the file open on file_fd to the given fd as
+ * a bitmap image response. The data goes from the file to the socket with
+ * sendfile, without being copied through this process.
+ */
+void send_image_response(int fd, int file_fd, off_t size);
+
 
 /*
- * Respond to an image-upload request.
+ * Respond to an image-upload request. Return 0 if the whole request has
+ * been read (so the connection can be reused), and -1 otherwise.
  */
-void image_upload_response(ClientState *client);
+int image_upload_response(ClientState *client);
 
 
 /*
  * The following are generic responses for different HTTP response codes;
  * we have provided these for you to use in various parts of the assignment.
  * Some of them can be customized with a message.
+ * Every response has a Content-Length, so the connection can be reused.
  */
 void not_found_response(int fd);
 void bad_request_response(int fd, const char *message);
 void internal_server_error_response(int fd, const char *message);
+void service_unavailable_response(int fd);
 
 // This one takes a resource name instead, and redirects the client
 // to that resource.
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,7 +68,8 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
 
 /*
  * Wait for and accept a new connection.
- * Return -1 if the accept call failed.
+ * Return -1 if the accept call failed (or, for a non-blocking listenfd,
+ * if there was no connection waiting).
  */
 int accept_connection(int listenfd) {
     struct sockaddr_in peer;
@@ -77,7 +79,9 @@ int accept_connection(int listenfd) {
     fprintf(stderr, "Waiting for a new connection...\n");
     int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
     if (client_socket < 0) {
-        perror("accept");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
         return -1;
     } else {
         fprintf(stderr,
@@ -89,6 +93,21 @@ int accept_connection(int listenfd) {
 }
 
 
+/*
+ * Close a connection the server is done with. Anything the client sent that
+ * hasn't been read is read first, because closing a socket with unread data
+ * makes the kernel reset the connection, and the client may then lose the
+ * end of the response.
+ */
+void close_connection(int sock) {
+    char buf[4096];
+    shutdown(sock, SHUT_WR);
+    while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    close(sock);
+}
+
+
 /******************************************************************************
  * Client-specific functions
  *****************************************************************************/
@@ -8,6 +8,7 @@
 struct sockaddr_in *init_server_addr(int port);
 int setup_server_socket(struct sockaddr_in *self, int num_queue);
 int accept_connection(int listenfd);
+void close_connection(int sock);
 
 int connect_to_server(int port, const char *hostname);
 
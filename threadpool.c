@@ -0,0 +1,547 @@
+#define _GNU_SOURCE  // For memfd_create, sched_getcpu and pthread_attr_setaffinity_np.
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#define THREAD_LIMIT_ENV "IMAGE_FILTER_THREAD_LIMIT"
+#define MAX_NODES 64
+#define CACHE_LINE 64
+
+// How long a worker that has been refused a thread slot waits before
+// asking again (slots are given back by other processes, which can't
+// signal this one).
+#define SLOT_RETRY_NS 1000000
+
+
+typedef struct {
+    void (*fn)(void *, int);
+    void *arg;
+    int unfinished;              // Tasks not finished yet (atomic).
+} Job;
+
+/*
+ * The tasks [begin, end) of a job.
+ */
+typedef struct {
+    Job *job;
+    int begin;
+    int end;
+} Range;
+
+/*
+ * The tasks queued by one thread. Its owner takes tasks one at a time from
+ * the newest range, lowest task first; other threads steal the upper half
+ * of the oldest range.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    Range *ranges;               // A ring of capacity ranges, oldest at head.
+    int capacity;
+    int head;
+    int count;
+    int node;                    // The NUMA node the owner runs on.
+    int *victims;                // The other deques, same node first.
+} __attribute__((aligned(CACHE_LINE))) Deque;
+
+typedef struct {
+    ThreadPool *pool;
+    int index;
+} Worker;
+
+struct threadpool {
+    int num_threads;             // Total threads, counting the caller of pool_run.
+    pthread_t *threads;          // The num_threads - 1 worker threads.
+    Worker *workers;
+    Deque *deques;               // One per thread; deques[0] is for callers
+                                 // from outside the pool.
+    int queued;                  // Tasks in the deques (atomic).
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // Signalled when tasks are queued, a job
+                                 // finishes, or the pool shuts down.
+    int shutdown;
+};
+
+/*
+ * The pool a thread is a worker of, and its deque there; the calling
+ * thread of pool_run uses deques[0] of any other pool.
+ */
+static __thread ThreadPool *current_pool = NULL;
+static __thread int current_index = 0;
+
+/*
+ * The threads that may still start running tasks, shared by every process
+ * (see pool_share_thread_limit), or NULL for no limit; and whether this
+ * thread counts against it at the moment.
+ */
+static int *thread_slots = NULL;
+static __thread int holding_slot = 0;
+
+
+/*
+ * Take a thread slot: always if force is set (the count may go below
+ * zero), or otherwise only if there is one left. Returns 1 if it was taken.
+ */
+static int take_slot(int force) {
+    if (thread_slots == NULL) {
+        return 1;
+    }
+    if (force) {
+        __atomic_sub_fetch(thread_slots, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    int slots = __atomic_load_n(thread_slots, __ATOMIC_RELAXED);
+    while (slots > 0) {
+        if (__atomic_compare_exchange_n(thread_slots, &slots, slots - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void give_slot(void) {
+    if (thread_slots != NULL) {
+        __atomic_add_fetch(thread_slots, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void pool_share_thread_limit(int max_threads) {
+    // A memfd rather than an anonymous mapping, so that filter programs
+    // exec'd later can map it too.
+    int fd = memfd_create("thread_limit", 0);
+    if (fd == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    if (ftruncate(fd, sizeof(int)) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    thread_slots = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (thread_slots == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    *thread_slots = max_threads;
+
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(THREAD_LIMIT_ENV, value, 1);
+}
+
+
+/*
+ * Map the limit shared by whichever process called pool_share_thread_limit
+ * before exec'ing this one, if any.
+ */
+static void attach_thread_limit(void) {
+    char *env = getenv(THREAD_LIMIT_ENV);
+    if (thread_slots != NULL || env == NULL) {
+        return;
+    }
+    int *slots = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED,
+                      strtol(env, NULL, 10), 0);
+    if (slots != MAP_FAILED) {
+        thread_slots = slots;
+    }
+}
+
+
+/*
+ * The CPUs this process may run on, grouped by NUMA node.
+ */
+typedef struct {
+    cpu_set_t cpus;
+    int num_cpus;
+} Node;
+
+
+/*
+ * Fill in the nodes that have at least one CPU this process may run on, and
+ * return how many there are (0 if the machine doesn't say).
+ */
+static int read_nodes(Node *nodes) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return 0;
+    }
+    int num_nodes = 0;
+    for (int i = 0; i < MAX_NODES; i++) {
+        char path[64];
+        char list[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        char *read = fgets(list, sizeof(list), f);
+        fclose(f);
+        if (read == NULL) {
+            continue;
+        }
+
+        // The list looks like "0-3,8-11".
+        Node *node = &nodes[num_nodes];
+        CPU_ZERO(&node->cpus);
+        node->num_cpus = 0;
+        char *p = list;
+        while (1) {
+            char *end;
+            long first = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            long last = first;
+            if (*end == '-') {
+                last = strtol(end + 1, &end, 10);
+            }
+            for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    CPU_SET(cpu, &node->cpus);
+                    node->num_cpus++;
+                }
+            }
+            if (*end != ',') {
+                break;
+            }
+            p = end + 1;
+        }
+        if (node->num_cpus > 0) {
+            num_nodes++;
+        }
+    }
+    return num_nodes;
+}
+
+
+/*
+ * Decide which node each thread runs on, filling the caller's node first,
+ * then the next, in proportion to their CPUs, and pin the worker threads
+ * there through attrs. Threads are pinned to a node rather than a CPU, so
+ * that the pools of several processes don't pile onto the same CPUs.
+ */
+static void place_threads(ThreadPool *pool, pthread_attr_t *attrs) {
+    char *env = getenv("IMAGE_FILTER_PIN");
+    Node nodes[MAX_NODES];
+    int num_nodes = 0;
+    if (env == NULL || strcmp(env, "0") != 0) {
+        num_nodes = read_nodes(nodes);
+    }
+    if (num_nodes < 2) {
+        return;
+    }
+    int first = 0;
+    int total = 0;
+    int cpu = sched_getcpu();
+    for (int n = 0; n < num_nodes; n++) {
+        if (cpu >= 0 && CPU_ISSET(cpu, &nodes[n].cpus)) {
+            first = n;
+        }
+        total += nodes[n].num_cpus;
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        int k = i % total;
+        int n = first;
+        while (k >= nodes[n].num_cpus) {
+            k -= nodes[n].num_cpus;
+            n = (n + 1) % num_nodes;
+        }
+        pool->deques[i].node = n;
+        if (i > 0) {
+            pthread_attr_setaffinity_np(&attrs[i - 1], sizeof(cpu_set_t), &nodes[n].cpus);
+        }
+    }
+}
+
+
+static void push_range(Deque *deque, Range range) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity > 0 ? deque->capacity * 2 : 8;
+        Range *ranges = malloc(sizeof(Range) * capacity);
+        if (ranges == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < deque->count; i++) {
+            ranges[i] = deque->ranges[(deque->head + i) % deque->capacity];
+        }
+        free(deque->ranges);
+        deque->ranges = ranges;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->ranges[(deque->head + deque->count) % deque->capacity] = range;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+
+/*
+ * Take the next task from the owner's end of the deque. Returns 0 if it's
+ * empty.
+ */
+static int pop_task(Deque *deque, Job **job, int *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    Range *range = &deque->ranges[(deque->head + deque->count - 1) % deque->capacity];
+    *job = range->job;
+    *task = range->begin++;
+    if (range->begin == range->end) {
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+
+/*
+ * Take the upper half of the oldest range in the deque (or all of it, if
+ * it's a single task). Returns 0 if it's empty.
+ */
+static int steal_range(Deque *deque, Range *stolen) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    Range *range = &deque->ranges[deque->head];
+    *stolen = *range;
+    if (range->end - range->begin >= 2) {
+        stolen->begin = range->begin + (range->end - range->begin) / 2;
+        range->end = stolen->begin;
+    } else {
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+
+/*
+ * Find a task for thread self: from its own deque, or else stolen from
+ * another, nearest first (keeping the rest of what was stolen for later).
+ * Returns 0 if there was nothing to find.
+ */
+static int find_task(ThreadPool *pool, int self, Job **job, int *task) {
+    if (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+    Deque *own = &pool->deques[self];
+    if (!pop_task(own, job, task)) {
+        Range stolen;
+        int i = 0;
+        while (i < pool->num_threads - 1 && !steal_range(&pool->deques[own->victims[i]], &stolen)) {
+            i++;
+        }
+        if (i == pool->num_threads - 1) {
+            return 0;
+        }
+        *job = stolen.job;
+        *task = stolen.begin++;
+        if (stolen.begin < stolen.end) {
+            push_range(own, stolen);
+        }
+    }
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+static void run_task(ThreadPool *pool, Job *job, int task) {
+    job->fn(job->arg, task);
+    if (__atomic_sub_fetch(&job->unfinished, 1, __ATOMIC_ACQ_REL) == 0) {
+        // The job may be gone as soon as its caller sees this, so only the
+        // pool is touched from here on.
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+static void *worker_main(void *data) {
+    Worker *worker = data;
+    ThreadPool *pool = worker->pool;
+    current_pool = pool;
+    current_index = worker->index;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown) {
+        if (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+            continue;
+        }
+        if (!take_slot(0)) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += SLOT_RETRY_NS;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&pool->changed, &pool->lock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        holding_slot = 1;
+        Job *job;
+        int task;
+        while (find_task(pool, worker->index, &job, &task)) {
+            run_task(pool, job, task);
+        }
+        holding_slot = 0;
+        give_slot();
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+ThreadPool *pool_create(int num_threads) {
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    attach_thread_limit();
+    int n = pool->num_threads = num_threads < 1 ? 1 : num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    if (posix_memalign((void **) &pool->deques, CACHE_LINE, sizeof(Deque) * n) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(pool->deques, 0, sizeof(Deque) * n);
+    pool->threads = malloc(sizeof(pthread_t) * n);
+    pool->workers = malloc(sizeof(Worker) * n);
+    pthread_attr_t *attrs = malloc(sizeof(pthread_attr_t) * n);
+    if (pool->threads == NULL || pool->workers == NULL || attrs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        if (i > 0) {
+            pthread_attr_init(&attrs[i - 1]);
+        }
+    }
+    place_threads(pool, attrs);
+
+    // Each thread steals from the others on its node before going further,
+    // starting with the one after it, so that thieves spread out.
+    for (int i = 0; i < n; i++) {
+        Deque *deque = &pool->deques[i];
+        deque->victims = malloc(sizeof(int) * n);
+        if (deque->victims == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        int count = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int k = 1; k < n; k++) {
+                int v = (i + k) % n;
+                if ((pool->deques[v].node == deque->node) == (pass == 0)) {
+                    deque->victims[count++] = v;
+                }
+            }
+        }
+    }
+
+    for (int i = 1; i < n; i++) {
+        pool->workers[i] = (Worker) {pool, i};
+        if (pthread_create(&pool->threads[i - 1], &attrs[i - 1], worker_main, &pool->workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attrs[i - 1]);
+    }
+    free(attrs);
+    return pool;
+}
+
+
+void pool_run(ThreadPool *pool, void (*fn)(void *, int), void *arg, int num_tasks) {
+    if (num_tasks <= 0) {
+        return;
+    }
+    int self = current_pool == pool ? current_index : 0;
+    int took_slot = !holding_slot;
+    if (took_slot) {
+        // The caller is a thread running filters whether or not it can
+        // have a slot.
+        take_slot(1);
+        holding_slot = 1;
+    }
+    Job job = {fn, arg, num_tasks};
+    push_range(&pool->deques[self], (Range) {&job, 0, num_tasks});
+    __atomic_add_fetch(&pool->queued, num_tasks, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    // The caller works on the job too, and on whatever else is queued while
+    // it waits for the rest of its tasks.
+    while (__atomic_load_n(&job.unfinished, __ATOMIC_ACQUIRE) > 0) {
+        Job *next;
+        int task;
+        if (find_task(pool, self, &next, &task)) {
+            run_task(pool, next, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&job.unfinished, __ATOMIC_ACQUIRE) > 0 &&
+               __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (took_slot) {
+        holding_slot = 0;
+        give_slot();
+    }
+}
+
+
+int pool_size(const ThreadPool *pool) {
+    return pool->num_threads;
+}
+
+
+void pool_destroy(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads - 1; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].ranges);
+        free(pool->deques[i].victims);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
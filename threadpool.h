@@ -0,0 +1,38 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+/*
+ * A fixed-size, work-stealing pool of worker threads.
+ *
+ * pool_run splits a job into num_tasks tasks and calls fn(arg, i) once for
+ * every i in [0, num_tasks), spread over the workers and the calling thread.
+ * It returns once every task has finished. Jobs can be run from several
+ * threads at once, and from inside a task of another job.
+ *
+ * Every thread has a deque of the tasks it has queued. A thread works
+ * through its own tasks in order, and when it runs out, steals the upper
+ * half of the oldest range of tasks queued by another thread, so that
+ * neighbouring tasks (bands of rows, tiles) tend to run on the same thread.
+ *
+ * On a machine with more than one NUMA node, the workers are pinned to
+ * nodes, starting with the node of the thread that creates the pool, and
+ * steal from the threads on their own node first. Setting the
+ * IMAGE_FILTER_PIN environment variable to 0 turns this off.
+ */
+typedef struct threadpool ThreadPool;
+
+ThreadPool *pool_create(int num_threads);
+void pool_run(ThreadPool *pool, void (*fn)(void *, int), void *arg, int num_tasks);
+int pool_size(const ThreadPool *pool);
+void pool_destroy(ThreadPool *pool);
+
+/*
+ * Limit the threads running tasks at once to max_threads, across the pools
+ * of this process and of every process started from it afterwards (forked,
+ * or exec'd with its descriptors and environment). The thread that calls
+ * pool_run always works on its job, but it counts against the limit, and
+ * workers only join in while the count is under it.
+ */
+void pool_share_thread_limit(int max_threads);
+
+#endif /* THREADPOOL_H_*/
@@ -0,0 +1,323 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bitmap.h"
+
+
+/******************************************************************************
+ * Tiled processing of neighbourhood filters.
+ *
+ * The image is cut into tiles side by side, and each tile is worked out
+ * from the input pixels around it (its halo) alone, so tiles can be done
+ * in any order, and at the same time on the filter threads.
+ *
+ * When the input and output rows are all in memory already (an in-memory
+ * image, or a mapped file), the tiles are strips that go all the way down
+ * the image, and a filter streams through its strip a row at a time. As
+ * it goes, release_tile_rows drops the pages of mapped rows it is done
+ * with, so a file much bigger than the memory budget goes through with
+ * only a bounded number of its pages resident at any time. Otherwise, the
+ * image goes through buffers in bands of rows, top to bottom, each cut
+ * into tiles; the input buffer keeps the halo rows each band shares with
+ * the one before.
+ *
+ * The memory budget sets the size of both. The tiles being worked on (one
+ * per thread) get what the filter says they need per input column, and
+ * the resident rows of a strip, up to half of it; bands get the rest.
+ *****************************************************************************/
+#define DEFAULT_FILTER_MEMORY ((size_t) 256 << 20)
+#define MIN_TILE_WIDTH 16          // The narrowest a tile gets, however tight
+                                   // the budget.
+#define MIN_SPLIT_WIDTH 64         // The narrowest tiles made just to share
+                                   // a narrow band between threads.
+#define MIN_BAND_HEIGHT 16
+#define RELEASE_ROWS 32            // How many rows release_tile_rows lets
+                                   // pile up before it drops their pages.
+#define FAULT_AROUND_BYTES (64 << 10)  // Linux's default fault_around_bytes.
+
+static size_t filter_memory = 0;     // 0 means "not configured yet".
+
+
+int parse_memory_size(const char *s, size_t *bytes) {
+    static const char units[] = "KMG";
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s || errno != 0 || strchr(s, '-') != NULL) {
+        return -1;
+    }
+    int shift = 0;
+    const char *unit = *end ? strchr(units, toupper((unsigned char) *end)) : NULL;
+    if (unit != NULL) {
+        shift = 10 * (unit - units + 1);
+        end++;
+    }
+    if (*end != '\0' || n == 0 || n > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *bytes = (size_t) n << shift;
+    return 0;
+}
+
+
+void set_filter_memory(size_t bytes) {
+    filter_memory = max(bytes, 1);
+}
+
+
+size_t get_filter_memory(void) {
+    if (filter_memory == 0) {
+        char *env = getenv("IMAGE_FILTER_MEMORY");
+        size_t bytes;
+        set_filter_memory(env && parse_memory_size(env, &bytes) == 0 ? bytes
+                                                                    : DEFAULT_FILTER_MEMORY);
+    }
+    return filter_memory;
+}
+
+
+const Pixel *tile_input_row(const Tile *tile, int y) {
+    return (const Pixel *) (tile->in + (size_t) (y - tile->in_y) * tile->in_stride);
+}
+
+
+Pixel *tile_output_row(const Tile *tile, int y) {
+    return (Pixel *) (tile->out + (size_t) (y - tile->y) * tile->out_stride);
+}
+
+
+/*
+ * Drop the pages of a mapping that hold n rows, stride bytes apart from
+ * first on, from the resident set (the pages they share with the rows
+ * around them too). Input pages are read back from the file if they are
+ * touched again, and output pages stay in the page cache to be written
+ * back as usual, so this never loses anything.
+ */
+static void drop_rows(const unsigned char *first, size_t stride, int n) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) first & ~(page - 1);
+    uintptr_t end = ((uintptr_t) (first + n * stride) + page - 1) & ~(page - 1);
+    if (n > 0) {
+        madvise((void *) start, end - start, MADV_DONTNEED);
+    }
+}
+
+
+void release_tile_rows(Tile *tile, int y, int in_y) {
+    if (y - tile->released < RELEASE_ROWS && y < tile->y + tile->height) {
+        return;
+    }
+    // Whole rows are dropped, not just the tile's part of them: reading
+    // a mapping brings in the pages around the ones read as well. Rows
+    // that other tiles are still working on just come back on their next
+    // access.
+    if (tile->drop_out) {
+        drop_rows(tile->out + (size_t) (tile->released - tile->y) * tile->out_stride -
+                  (size_t) tile->x * sizeof(Pixel), tile->out_stride, y - tile->released);
+    }
+    if (tile->drop_in && in_y > tile->released_in) {
+        drop_rows(tile->in + (size_t) (tile->released_in - tile->in_y) * tile->in_stride -
+                  (size_t) tile->in_x * sizeof(Pixel), tile->in_stride, in_y - tile->released_in);
+        tile->released_in = in_y;
+    }
+    tile->released = y;
+}
+
+
+// The tiles of one band; shared by the threads.
+typedef struct {
+    TileFilter filter;
+    void *arg;
+    Tile *tiles;
+} TileJob;
+
+
+/*
+ * The input rows a tile of output rows [y0, y1) may look at: those within
+ * halo of them, and, near the top or bottom, those within halo of the first
+ * or last row at least halo rows in. The border rows of the 3-by-3 filters
+ * use the grid of their inner neighbour, so the last row needs the row
+ * two above it, even in a tile of its own.
+ */
+static int input_first(int y0, int halo, int height) {
+    return max(min(y0, height - 1 - halo) - halo, 0);
+}
+
+static int input_end(int y1, int halo, int height) {
+    return min(max(y1, halo + 1) + halo, height);
+}
+
+
+static void run_tile(void *arg, int task) {
+    TileJob *job = arg;
+    job->filter(job->arg, &job->tiles[task]);
+}
+
+
+void run_tiled(Bitmap *bmp, int halo, size_t column_bytes, TileFilter filter, void *arg) {
+    int width = bmp->width;
+    int height = bmp->height;
+    int threads = get_filter_threads();
+    ThreadPool *pool = get_filter_pool();
+    size_t budget = get_filter_memory();
+
+    // Input and output rows that are already in memory are used in place;
+    // strides are in bytes, since mapped rows are padded.
+    PixelStream *in = &bmp->in;
+    PixelStream *out = &bmp->out;
+    size_t in_stride = (size_t) width * sizeof(Pixel);
+    size_t out_stride = in_stride;
+    unsigned char *in_base = NULL, *out_base = NULL;    // Row 0, if in place.
+    if (in->data != NULL && in->format == BMP_BGR24) {
+        in_stride = BMP_ROW_BYTES(width);
+        in_base = in->data + (size_t) in->row * in_stride;
+    } else if (in->data == NULL && in->fp == NULL) {
+        in_base = (unsigned char *) (in->pixels + (size_t) in->row * width);
+    }
+    if (out->data != NULL) {
+        out_stride = BMP_ROW_BYTES(width);
+        out_base = out->data + (size_t) out->row * out_stride;
+    } else if (out->fp == NULL) {
+        out_base = (unsigned char *) (out->pixels + (size_t) out->row * width);
+    }
+    int in_place = in_base != NULL && out_base != NULL;
+
+    // A tile costs column_bytes per input column, and when everything is in
+    // place, the rows of it that stay resident between releases as well:
+    // reading a mapping brings in the pages around those read, so these
+    // take FAULT_AROUND_BYTES a row at least. Tiles are as wide as a tile per thread
+    // fits into half the budget (a whole row, if it does), and narrower if
+    // that leaves threads without one: rows are best gone through in one
+    // piece, since splitting them costs the halo columns twice.
+    size_t per_column = column_bytes, per_tile = 0;
+    if (in_place) {
+        size_t resident = 2 * RELEASE_ROWS + 3;
+        per_column += resident * sizeof(Pixel);
+        per_tile = resident * FAULT_AROUND_BYTES;
+    }
+    long share = (long) (budget / 2 / threads) - (long) per_tile;
+    long fits = share / (long) max(per_column, 1) - 2L * halo;
+    int tile_width = min(max(fits, MIN_TILE_WIDTH), width);
+    if (threads > 1) {
+        tile_width = min(tile_width, max((width + threads - 1) / threads, MIN_SPLIT_WIDTH));
+    }
+    // Every tile is at least 2 pixels wide, so that it and its halo are at
+    // least 3 wide.
+    int num_columns = max(1, min((width + tile_width - 1) / tile_width, width / 2));
+
+    // With everything in place, the tiles go all the way down the image,
+    // and drop the pages they are done with as they go. Otherwise the rows
+    // go through buffers a band at a time, and bands are as tall as the
+    // rest of the budget allows for their input rows (with the halo) and
+    // output rows; but no shorter than the halo, as the halo rows of every
+    // band are worked out twice.
+    long band_height = height;
+    if (!in_place) {
+        size_t tile_bytes = (size_t) threads * (tile_width + 2 * halo) * column_bytes;
+        size_t row_bytes = 2 * (size_t) BMP_ROW_BYTES(width);
+        band_height = (long) ((budget - min(tile_bytes, budget / 2)) / row_bytes) - 2L * halo;
+        band_height = min(max(band_height, max(MIN_BAND_HEIGHT, halo)), height);
+    }
+    Pixel *in_buf = in_base ? NULL : alloc_rows(width, min(band_height + 2 * halo, height));
+    Pixel *out_buf = out_base ? NULL : alloc_rows(width, band_height);
+    int buf_first = 0;    // The first input row in in_buf,
+    int loaded = 0;       // and the number of rows after it.
+
+    // A band split into fewer tiles than there are threads is cut across
+    // as well, as long as the slices stay well above the halo.
+    int slices = 1;
+    if (pool != NULL && num_columns < threads) {
+        slices = min((threads + num_columns - 1) / num_columns,
+                     max(1, band_height / max(4 * halo, 1)));
+    }
+    Tile *tiles = malloc(sizeof(Tile) * num_columns * slices);
+    if (tiles == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int first = 0; first < height; first += band_height) {
+        int rows = min(band_height, height - first);
+        int in_first = input_first(first, halo, height);
+        int in_end = input_end(first + rows, halo, height);
+
+        const unsigned char *band_in;       // Input row in_first.
+        unsigned char *band_out;            // Output row first.
+        if (in_base != NULL) {
+            band_in = in_base + (size_t) in_first * in_stride;
+        } else {
+            // Keep the halo rows we already have, and read in the rest.
+            int keep = max(buf_first + loaded - in_first, 0);
+            memmove(in_buf, in_buf + (size_t) (loaded - keep) * width,
+                    (size_t) keep * width * sizeof(Pixel));
+            buf_first = in_first;
+            loaded = keep;
+            read_rows(bmp, in_buf + (size_t) loaded * width, in_end - in_first - loaded);
+            loaded = in_end - in_first;
+            band_in = (const unsigned char *) in_buf;
+        }
+        band_out = out_base ? out_base + (size_t) first * out_stride : (unsigned char *) out_buf;
+
+        int num_tiles = 0;
+        for (int s = 0; s < slices; s++) {
+            int y0 = first + (long) rows * s / slices;
+            int y1 = first + (long) rows * (s + 1) / slices;
+            for (int c = 0; c < num_columns && y1 > y0; c++) {
+                int x0 = (long) width * c / num_columns;
+                int x1 = (long) width * (c + 1) / num_columns;
+                Tile *tile = &tiles[num_tiles++];
+                *tile = (Tile) {
+                    .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0,
+                    .in_x = max(x0 - halo, 0), .in_y = input_first(y0, halo, height),
+                    .image_width = width, .image_height = height,
+                    .in_stride = in_stride, .out_stride = out_stride,
+                    .released = y0, .released_in = input_first(y0, halo, height),
+                    .drop_in = in_place && in->data != NULL,
+                    .drop_out = in_place && out->data != NULL,
+                };
+                tile->in_width = min(x1 + halo, width) - tile->in_x;
+                tile->in_height = input_end(y1, halo, height) - tile->in_y;
+                tile->in = band_in + (size_t) (tile->in_y - in_first) * in_stride +
+                           (size_t) tile->in_x * sizeof(Pixel);
+                tile->out = band_out + (size_t) (y0 - first) * out_stride +
+                            (size_t) x0 * sizeof(Pixel);
+            }
+        }
+        TileJob job = {.filter = filter, .arg = arg, .tiles = tiles};
+        if (pool != NULL && num_tiles > 1) {
+            pool_run(pool, run_tile, &job, num_tiles);
+        } else {
+            for (int i = 0; i < num_tiles; i++) {
+                run_tile(&job, i);
+            }
+        }
+
+        // Drop the pages of a mapped input or output that the band is done
+        // with (the halo rows above the next band are still needed).
+        if (out_buf != NULL) {
+            write_rows(bmp, out_buf, rows);
+        } else if (out->data != NULL && !in_place) {
+            drop_rows(band_out, out_stride, rows);
+        }
+        if (in->data != NULL && in_base != NULL && !in_place) {
+            int next_in_first = input_first(first + rows, halo, height);
+            drop_rows(band_in, in_stride, next_in_first - in_first);
+        }
+    }
+
+    // Count the rows used in place as read and written.
+    if (in_base != NULL) {
+        in->row += height;
+    }
+    if (out_base != NULL) {
+        out->row += height;
+    }
+    free(tiles);
+    free(in_buf);
+    free(out_buf);
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE  // For close_range.
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "socket.h"
+#include "workers.h"
+
+
+typedef struct {
+    pid_t pid;
+    int channel;             // The server's end of the worker's UNIX socket.
+    int busy;                // Whether the worker is serving a request.
+    int sock;                // The client it is serving, if it is busy.
+} Worker;
+
+// What a worker sends back when it has finished a request.
+typedef struct {
+    int keep_alive;
+    char buf[MAXLINE];       // The rest of what it read from the client.
+} Reply;
+
+// A request waiting for a worker.
+typedef struct {
+    int sock;
+    double arrived;
+    int num_bytes;
+    char buf[MAXLINE];
+} QueuedRequest;
+
+static Worker *workers = NULL;
+static int num_workers = 0;
+static int num_busy = 0;
+static int epoll_fd = -1;
+static int (*serve_request)(ClientState *client) = NULL;
+static void (*finish_request)(int sock, int keep_alive, const char *buf, int num_bytes) = NULL;
+
+// A ring buffer of waiting requests.
+static QueuedRequest *queue = NULL;
+static int queue_capacity = 0;
+static int queue_head = 0;
+static int queue_length = 0;
+
+
+/*
+ * Send a client's socket, the time its request arrived, and its buffered
+ * bytes down a worker's channel. Return 0 on success and -1 on failure.
+ */
+static int send_request(int channel, int sock, double arrived, const char *buf, int num_bytes) {
+    struct iovec iov[] = {
+        {.iov_base = &arrived, .iov_len = sizeof(double)},
+        {.iov_base = (void *) buf, .iov_len = num_bytes},
+    };
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+    if (sendmsg(channel, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Receive a request sent by send_request into client.
+ * Return 0 on success and -1 once the server has gone away.
+ */
+static int receive_request(int channel, ClientState *client) {
+    struct iovec iov[] = {
+        {.iov_base = &client->arrived, .iov_len = sizeof(double)},
+        {.iov_base = client->buf, .iov_len = sizeof(client->buf) - 1},
+    };
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space),
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(channel, &msg, 0);
+    } while (n == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n < (ssize_t) sizeof(double) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&client->sock, CMSG_DATA(cmsg), sizeof(int));
+    client->num_bytes = n - sizeof(double);
+    client->buf[client->num_bytes] = '\0';
+    client->reqData = NULL;
+    return 0;
+}
+
+
+/*
+ * The body of a worker process: serve requests until the server goes away.
+ */
+static void worker_loop(int channel) {
+    // A client hanging up mid-response must not take the worker down.
+    signal(SIGPIPE, SIG_IGN);
+    // The client's arena is kept from one request to the next.
+    ClientState client = {.sock = -1};
+    Reply reply;
+    while (receive_request(channel, &client) == 0) {
+        // The server hands over a request as soon as its start line is in,
+        // so a client that stops there must not hold the worker forever.
+        struct timeval timeout = {.tv_sec = KEEP_ALIVE_TIMEOUT};
+        setsockopt(client.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        reply.keep_alive = serve_request(&client);
+        clear_request(&client);
+        int num_bytes = 0;
+        if (reply.keep_alive) {
+            num_bytes = client.num_bytes;
+            memcpy(reply.buf, client.buf, num_bytes);
+            close(client.sock);
+        } else {
+            close_connection(client.sock);
+        }
+        if (write(channel, &reply, sizeof(int) + num_bytes) == -1) {
+            break;
+        }
+    }
+    exit(0);
+}
+
+
+static void spawn_worker(Worker *worker) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        // Drop every other descriptor the server has open (the listening
+        // socket, other clients, other workers), so that a worker never
+        // keeps someone else's connection alive.
+        int channel = fds[1];
+        if (channel > 3) {
+            close_range(3, channel - 1, 0);
+        }
+        close_range(channel + 1, ~0U, 0);
+        worker_loop(channel);
+    }
+    close(fds[1]);
+    worker->pid = pid;
+    worker->channel = fds[0];
+    worker->busy = 0;
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = worker->channel};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->channel, &event) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+
+/*
+ * Give the oldest queued request to the given idle worker, if there is one.
+ */
+static void dispatch_queued(Worker *worker) {
+    while (queue_length > 0 && !worker->busy) {
+        QueuedRequest *req = &queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_length--;
+        if (send_request(worker->channel, req->sock, req->arrived, req->buf, req->num_bytes) == 0) {
+            worker->busy = 1;
+            worker->sock = req->sock;
+            num_busy++;
+        } else {
+            finish_request(req->sock, 0, NULL, 0);
+        }
+    }
+}
+
+
+void start_workers(int n, int max_queue, int epfd, int (*serve)(ClientState *client),
+                   void (*finished)(int sock, int keep_alive, const char *buf, int num_bytes)) {
+    num_workers = n;
+    epoll_fd = epfd;
+    serve_request = serve;
+    finish_request = finished;
+    queue_capacity = max_queue;
+    queue = malloc(sizeof(QueuedRequest) * (max_queue > 0 ? max_queue : 1));
+    workers = malloc(sizeof(Worker) * n);
+    if (queue == NULL || workers == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        spawn_worker(&workers[i]);
+    }
+}
+
+
+static Worker *find_worker(int fd) {
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].channel == fd) {
+            return &workers[i];
+        }
+    }
+    return NULL;
+}
+
+
+int is_worker_fd(int fd) {
+    return find_worker(fd) != NULL;
+}
+
+
+void handle_worker_event(int fd) {
+    Worker *worker = find_worker(fd);
+    Reply reply;
+    ssize_t n = read(fd, &reply, sizeof(reply));
+    if (n == -1 && errno == EINTR) {
+        return;
+    }
+    int was_busy = worker->busy;
+    int sock = worker->sock;
+    if (n < (ssize_t) sizeof(int)) {
+        // The worker died (most likely exiting on a bad request); whatever
+        // it was serving is lost, but the next request gets a fresh worker.
+        fprintf(stderr, "Worker [%d] exited; starting a new one\n", worker->pid);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        waitpid(worker->pid, NULL, 0);
+        spawn_worker(worker);
+        reply.keep_alive = 0;
+        n = sizeof(int);
+    }
+    if (was_busy) {
+        worker->busy = 0;
+        num_busy--;
+    }
+    // Queued requests go first: the client's next request, if it has sent
+    // one already, waits its turn behind them.
+    dispatch_queued(worker);
+    if (was_busy) {
+        finish_request(sock, reply.keep_alive, reply.buf, n - sizeof(int));
+    }
+}
+
+
+int submit_request(const ClientState *client) {
+    for (int i = 0; i < num_workers; i++) {
+        if (!workers[i].busy &&
+            send_request(workers[i].channel, client->sock, client->arrived, client->buf,
+                         client->num_bytes) == 0) {
+            workers[i].busy = 1;
+            workers[i].sock = client->sock;
+            num_busy++;
+            return 0;
+        }
+    }
+    if (queue_length >= queue_capacity) {
+        return -1;
+    }
+    QueuedRequest *req = &queue[(queue_head + queue_length) % queue_capacity];
+    req->sock = client->sock;
+    req->arrived = client->arrived;
+    req->num_bytes = client->num_bytes;
+    memcpy(req->buf, client->buf, client->num_bytes);
+    queue_length++;
+    return 0;
+}
+
+
+int busy_workers(void) {
+    return num_busy;
+}
+
+
+int queued_requests(void) {
+    return queue_length;
+}
@@ -0,0 +1,43 @@
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include "request.h"
+
+/*
+ * A pool of pre-forked worker processes for image_server.
+ *
+ * Instead of forking for every request, the server hands each request to an
+ * idle worker: the client's socket is passed over a UNIX socket together
+ * with the bytes read from it so far, and the worker calls serve on a
+ * ClientState rebuilt from them. Requests that arrive while every worker is
+ * busy wait in a queue of at most max_queue requests.
+ *
+ * serve returns whether the connection stays open. Either way, the worker
+ * then reports back, and finished is called in the server with the client's
+ * socket (as the server knows it), that result, and whatever the worker had
+ * read beyond the request (the start of the next one, for a pipelining
+ * client). The worker has closed its own copy of the socket by then.
+ *
+ * start_workers forks the workers and watches their sockets with the given
+ * epoll instance (level-triggered, with the socket fd as the event data).
+ * The server passes events on those fds to handle_worker_event, which
+ * notices finished requests and replaces workers that died. (The request a
+ * worker was serving when it died is finished as not keeping the
+ * connection open.)
+ *
+ * submit_request hands the client's request to a worker, or queues it. The
+ * server must keep the socket open, and not read from it, until the request
+ * is finished. Return 0 on success, or -1 if the queue is full.
+ *
+ * busy_workers and queued_requests report the current load.
+ */
+void start_workers(int num_workers, int max_queue, int epfd,
+                   int (*serve)(ClientState *client),
+                   void (*finished)(int sock, int keep_alive, const char *buf, int num_bytes));
+int is_worker_fd(int fd);
+void handle_worker_event(int fd);
+int submit_request(const ClientState *client);
+int busy_workers(void);
+int queued_requests(void);
+
+#endif /* WORKERS_H_*/